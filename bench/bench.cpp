@@ -0,0 +1,612 @@
+// Benchmarks for the parser, VM, register VM, CFG construction, snapshots,
+// fork server, and binary codec. The register VM counts its dispatches as
+// instructions, so its instruction counts compare with those of the VM on
+// the same program.
+//
+// ./run_bench [--json <file>] [--reps <n>] [filter]
+//
+// Run from the repository root, since the corpus includes programs/. The
+// synthetic part of the corpus is generated deterministically and versioned
+// by CORPUS_VERSION, which must be bumped whenever it changes so that JSON
+// results from different commits are only compared on the same corpus.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../src/binary.h"
+#include "../src/cfg.h"
+#include "../src/emitter.h"
+#include "../src/forkserver.h"
+#include "../src/instruction.h"
+#include "../src/memo.h"
+#include "../src/optimizer.h"
+#include "../src/parser.h"
+#include "../src/regvm.h"
+#include "../src/specializer.h"
+#include "../src/vm.h"
+
+using namespace WS;
+
+const int CORPUS_VERSION = 7;
+
+struct Work {
+    unsigned long long instructions;
+    unsigned long long bytes;
+    size_t heap_bytes; // Memory of the VM heap at the end of the run
+};
+
+struct Result {
+    std::string name;
+    std::vector<double> seconds;
+    Work work;
+
+    double percentile(double p) const {
+        std::vector<double> sorted(seconds);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+    }
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<Work()> run;
+};
+
+std::vector<Instruction> parseFile(FILE* file) {
+    Parser parser(file);
+    std::vector<Instruction> instructions;
+    Instruction instr;
+    while (parser.next(instr)) {
+        instructions.push_back(instr);
+    }
+    return instructions;
+}
+
+std::vector<Instruction> parseProgram(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        exit(1);
+    }
+    std::vector<Instruction> instructions = parseFile(file);
+    fclose(file);
+    return instructions;
+}
+
+std::string readFile(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+FILE* tempFile(const std::string& contents) {
+    FILE* file = tmpfile();
+    fwrite(contents.data(), 1, contents.size(), file);
+    rewind(file);
+    return file;
+}
+
+// Counting loop that stores its counter in the heap each iteration
+std::vector<Instruction> syntheticLoop(integer_t iterations) {
+    return {
+        Instruction(PUSH, iterations),
+        Instruction(LABEL, 0),
+        Instruction(PUSH, 100),
+        Instruction(COPY, 1),
+        STORE,
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        DROP,
+        END
+    };
+}
+
+// Counting loop that keeps its counter only in the heap, at a constant address
+std::vector<Instruction> syntheticHeapCounter(integer_t iterations) {
+    return {
+        Instruction(PUSH, 100),
+        Instruction(PUSH, iterations),
+        STORE,
+        Instruction(LABEL, 0),
+        Instruction(PUSH, 100),
+        Instruction(PUSH, 100),
+        RETRIEVE,
+        Instruction(PUSH, 1),
+        SUB,
+        STORE,
+        Instruction(PUSH, 100),
+        RETRIEVE,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        END
+    };
+}
+
+// Loop that stores to and loads from addresses that hash its counter into
+// a range of cells, like the buckets of a hash table
+std::vector<Instruction> syntheticScatter(integer_t iterations, integer_t range) {
+    return {
+        Instruction(PUSH, iterations),
+        Instruction(LABEL, 0),
+        DUP,
+        Instruction(PUSH, 2654435761LL),
+        MUL,
+        Instruction(PUSH, range),
+        MOD,
+        DUP,
+        Instruction(COPY, 2),
+        STORE,
+        RETRIEVE,
+        DROP,
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        DROP,
+        END
+    };
+}
+
+// Pushes a number of values with the loop counter in the heap, then adds
+// them up
+std::vector<Instruction> syntheticDeepStack(integer_t values) {
+    return {
+        Instruction(PUSH, 0),
+        Instruction(PUSH, values),
+        STORE,
+        Instruction(LABEL, 0),
+        Instruction(PUSH, 0),
+        RETRIEVE,
+        Instruction(PUSH, 0),
+        Instruction(COPY, 1),
+        Instruction(PUSH, 1),
+        SUB,
+        STORE,
+        Instruction(PUSH, 0),
+        RETRIEVE,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        Instruction(PUSH, 0),
+        Instruction(PUSH, values - 1),
+        STORE,
+        Instruction(LABEL, 2),
+        ADD,
+        Instruction(PUSH, 0),
+        Instruction(PUSH, 0),
+        RETRIEVE,
+        Instruction(PUSH, 1),
+        SUB,
+        STORE,
+        Instruction(PUSH, 0),
+        RETRIEVE,
+        Instruction(JZ, 3),
+        Instruction(JMP, 2),
+        Instruction(LABEL, 3),
+        DROP,
+        END
+    };
+}
+
+// Loop calling a subroutine that reads and writes sparse heap addresses
+std::vector<Instruction> syntheticCalls(integer_t iterations) {
+    return {
+        Instruction(PUSH, iterations),
+        Instruction(LABEL, 0),
+        Instruction(CALL, 2),
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        DROP,
+        END,
+        Instruction(LABEL, 2),
+        DUP,
+        Instruction(PUSH, 4099),
+        MUL,
+        Instruction(PUSH, 65536),
+        MOD,
+        DUP,
+        RETRIEVE,
+        Instruction(PUSH, 1),
+        ADD,
+        STORE,
+        RET
+    };
+}
+
+// Naive recursive Fibonacci, which recomputes each call exponentially often
+std::vector<Instruction> syntheticFib(integer_t n) {
+    return {
+        Instruction(PUSH, n),
+        Instruction(CALL, 0),
+        DROP,
+        END,
+        Instruction(LABEL, 0),
+        DUP,
+        Instruction(PUSH, 2),
+        SUB,
+        Instruction(JN, 1),
+        DUP,
+        Instruction(PUSH, 1),
+        SUB,
+        Instruction(CALL, 0),
+        SWAP,
+        Instruction(PUSH, 2),
+        SUB,
+        Instruction(CALL, 0),
+        ADD,
+        RET,
+        Instruction(LABEL, 1),
+        RET
+    };
+}
+
+// Sum from 1 to n by recursion n calls deep
+std::vector<Instruction> syntheticRecursion(integer_t n) {
+    return {
+        Instruction(PUSH, n),
+        Instruction(CALL, 0),
+        DROP,
+        END,
+        Instruction(LABEL, 0),
+        DUP,
+        Instruction(JZ, 1),
+        DUP,
+        Instruction(PUSH, 1),
+        SUB,
+        Instruction(CALL, 0),
+        ADD,
+        Instruction(LABEL, 1),
+        RET
+    };
+}
+
+// Fills a table of squares, then prints the square of each character read
+// until the end of the input, like a program with costly initialization
+std::vector<Instruction> syntheticTable(integer_t cells) {
+    return {
+        Instruction(PUSH, cells),
+        Instruction(LABEL, 0),
+        DUP,
+        DUP,
+        DUP,
+        MUL,
+        STORE,
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JN, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        DROP,
+        Instruction(LABEL, 2),
+        Instruction(PUSH, -1),
+        READC,
+        Instruction(PUSH, -1),
+        RETRIEVE,
+        DUP,
+        Instruction(JN, 3),
+        RETRIEVE,
+        PRINTI,
+        Instruction(JMP, 2),
+        Instruction(LABEL, 3),
+        DROP,
+        END
+    };
+}
+
+// Large program of pseudo-random instructions for parser and codec
+// throughput. It is not meant to be executed.
+std::vector<Instruction> syntheticStraightLine(size_t count) {
+    static const InstructionType types[] = {
+        PUSH, DUP, COPY, SWAP, DROP, SLIDE, ADD, SUB, MUL, DIV, MOD, STORE, RETRIEVE,
+        LABEL, CALL, JMP, JZ, JN, RET, END, PRINTC, PRINTI, READC, READI
+    };
+    std::vector<Instruction> instructions;
+    unsigned long long state = 88172645463325252ULL;
+    for (size_t i = 0; i < count; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        InstructionType type = types[state % (sizeof(types) / sizeof(types[0]))];
+        integer_t value = (integer_t) (state >> 40) - (1 << 23);
+        if (type == LABEL || type == CALL || type == JMP || type == JZ || type == JN) {
+            value = (state >> 32) % 4096;
+        }
+        instructions.push_back(Instruction(type, value));
+    }
+    return instructions;
+}
+
+Work runVM(const std::vector<Instruction>& program, const std::string& input,
+          const std::vector<std::string>& strings = std::vector<std::string>(), size_t memo_entries = 0,
+          integer_t paged_window = 0) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    VM vm(program, in, out);
+    vm.setStrings(strings);
+    vm.setMemoization(memo_entries);
+    vm.setPagedHeap(paged_window);
+    vm.execute();
+    VMStats stats = vm.getStats();
+    return Work{stats.instructions, 0, stats.heap_bytes};
+}
+
+Work runGuardedVM(const std::vector<Instruction>& program, const std::string& input) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    VM vm(program, in, out);
+    vm.setGuardedStack(GUARDED_STACK_CAPACITY);
+    vm.execute();
+    VMStats stats = vm.getStats();
+    return Work{stats.instructions, 0, stats.heap_bytes};
+}
+
+// Keeps the whole stack in one vector however large it grows
+Work runUnsegmentedVM(const std::vector<Instruction>& program, const std::string& input) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    VM vm(program, in, out);
+    vm.setStackSegment(0);
+    vm.execute();
+    VMStats stats = vm.getStats();
+    return Work{stats.instructions, 0, stats.heap_bytes};
+}
+
+Work runRegisterVM(const RegisterProgram& program, const std::string& input) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    RegisterVM vm(program, in, out);
+    vm.execute();
+    return Work{vm.getDispatches(), 0};
+}
+
+// Short benchmarks are repeated within each sample to run for at least a
+// millisecond, so timer resolution does not dominate
+Result measure(const Benchmark& benchmark, int reps) {
+    Result result;
+    result.name = benchmark.name;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    result.work = benchmark.run(); // Warm up
+    double warmup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int batch = warmup < 1e-3 ? (int) (1e-3 / std::max(warmup, 1e-7)) + 1 : 1;
+    for (int i = 0; i < reps; i++) {
+        start = std::chrono::steady_clock::now();
+        for (int j = 0; j < batch; j++) {
+            benchmark.run();
+        }
+        result.seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / batch);
+    }
+    return result;
+}
+
+void writeJSON(std::ostream& out, const std::vector<Result>& results) {
+    out << "{\n  \"corpus_version\": " << CORPUS_VERSION << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        double median = result.percentile(0.5);
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << result.name << "\", \"reps\": " << result.seconds.size()
+            << ", \"median_s\": " << median << ", \"p95_s\": " << result.percentile(0.95)
+            << ", \"instructions\": " << result.work.instructions << ", \"bytes\": " << result.work.bytes
+            << ", \"instructions_per_s\": " << result.work.instructions / median
+            << ", \"mb_per_s\": " << result.work.bytes / median / 1e6
+            << ", \"heap_bytes\": " << result.work.heap_bytes << '}';
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+    const char* json = NULL;
+    const char* filter = "";
+    int reps = 15;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        }
+        else {
+            filter = argv[i];
+        }
+    }
+
+    const std::vector<Instruction> hello_world = parseProgram("programs/hello-world.ws");
+    const std::vector<Instruction> bottles = parseProgram("programs/bottles.generated.ws");
+    const std::vector<Instruction> interpreter = parseProgram("programs/ws/interpreter.generated.ws");
+    const std::string hello_world_source = readFile("programs/hello-world.ws") + '\0';
+    const std::vector<Instruction> loop = syntheticLoop(1000000);
+    const std::vector<Instruction> calls = syntheticCalls(200000);
+    const std::vector<Instruction> heap_counter = syntheticHeapCounter(1000000);
+    const std::vector<Instruction> fib = syntheticFib(24);
+    const std::vector<Instruction> recursion = syntheticRecursion(1000000);
+    const std::vector<Instruction> deep_stack = syntheticDeepStack(4000000);
+    const std::vector<Instruction> scatter_dense = syntheticScatter(200000, 1 << 18);
+    const std::vector<Instruction> scatter_sparse = syntheticScatter(200000, 1LL << 40);
+    const std::vector<Instruction> table = syntheticTable(200000);
+
+    const std::vector<Instruction> bottles_optimized = optimize(bottles, 3);
+    const std::vector<Instruction> interpreter_optimized = optimize(interpreter, 3);
+    const std::vector<Instruction> heap_counter_optimized = optimize(heap_counter, 3);
+    const std::vector<Instruction> interpreter_specialized = specialize(interpreter, hello_world_source).program;
+    const Supercompilation bottles_supercompiled = supercompile(bottles);
+    const RegisterProgram bottles_registers = translateToRegisters(bottles);
+    const RegisterProgram interpreter_registers = translateToRegisters(interpreter);
+    const RegisterProgram loop_registers = translateToRegisters(loop);
+    const RegisterProgram calls_registers = translateToRegisters(calls);
+    const RegisterProgram recursion_registers = translateToRegisters(recursion);
+
+    std::ostringstream source_stream;
+    const std::vector<Instruction> straight_line = syntheticStraightLine(1000000);
+    emitWhitespace(source_stream, straight_line);
+    const std::string source = source_stream.str();
+    const std::string interpreter_source = readFile("programs/ws/interpreter.generated.ws");
+    std::string binary;
+    {
+        FILE* in = tempFile(source);
+        FILE* out = tmpfile();
+        toBinary(in, out);
+        fflush(out);
+        binary.resize(ftell(out));
+        rewind(out);
+        binary.resize(fread(&binary[0], 1, binary.size(), out));
+        fclose(in);
+        fclose(out);
+    }
+    // State of the dense scatter at its end, saved once for restoring
+    std::istringstream snapshot_in;
+    std::ostringstream snapshot_out;
+    VM snapshot_vm(scatter_dense, snapshot_in, snapshot_out);
+    snapshot_vm.execute();
+    const char* snapshot_path = "respace-bench.snapshot";
+    {
+        std::ofstream file(snapshot_path, std::ios::binary);
+        snapshot_vm.save(file);
+    }
+    const size_t snapshot_bytes = (size_t) std::ifstream(snapshot_path, std::ios::binary | std::ios::ate).tellg();
+
+    ForkServer table_server(table);
+
+    // The self-hosted interpreter does not yet implement jumps or stores,
+    // so it cannot run bottles to completion and runs hello-world instead.
+    std::vector<Benchmark> benchmarks{
+        {"vm/hello-world", [&]() { return runVM(hello_world, ""); }},
+        {"vm/bottles", [&]() { return runVM(bottles, ""); }},
+        {"vm/self-interpreter/hello-world", [&]() { return runVM(interpreter, hello_world_source); }},
+        {"vm/synthetic/loop-1M", [&]() { return runVM(loop, ""); }},
+        {"vm/synthetic/calls-200K", [&]() { return runVM(calls, ""); }},
+        {"vm/synthetic/heap-counter-1M", [&]() { return runVM(heap_counter, ""); }},
+        {"vm/synthetic/fib-24", [&]() { return runVM(fib, ""); }},
+        {"vm/synthetic/scatter-dense-200K", [&]() { return runVM(scatter_dense, ""); }},
+        {"vm/synthetic/scatter-sparse-200K", [&]() { return runVM(scatter_sparse, ""); }},
+        {"vm/synthetic/recursion-1M", [&]() { return runVM(recursion, ""); }},
+        {"vm/synthetic/deep-stack-4M", [&]() { return runVM(deep_stack, ""); }},
+        {"vm-O3/bottles", [&]() { return runVM(bottles_optimized, ""); }},
+        {"vm-O3/self-interpreter/hello-world", [&]() { return runVM(interpreter_optimized, hello_world_source); }},
+        {"vm-O3/synthetic/heap-counter-1M", [&]() { return runVM(heap_counter_optimized, ""); }},
+        {"vm-supercompiled/bottles", [&]() {
+            return runVM(bottles_supercompiled.program, "", bottles_supercompiled.strings);
+        }},
+        {"vm-memoized/synthetic/fib-24", [&]() { return runVM(fib, "", std::vector<std::string>(), MEMO_CACHE_SIZE); }},
+        {"vm-paged/synthetic/scatter-dense-200K", [&]() {
+            return runVM(scatter_dense, "", std::vector<std::string>(), 0, PAGED_HEAP_WINDOW);
+        }},
+        {"vm-paged/synthetic/scatter-sparse-200K", [&]() {
+            return runVM(scatter_sparse, "", std::vector<std::string>(), 0, PAGED_HEAP_WINDOW);
+        }},
+        {"vm-guarded/bottles", [&]() { return runGuardedVM(bottles, ""); }},
+        {"vm-guarded/self-interpreter/hello-world", [&]() { return runGuardedVM(interpreter, hello_world_source); }},
+        {"vm-guarded/synthetic/loop-1M", [&]() { return runGuardedVM(loop, ""); }},
+        {"vm-guarded/synthetic/calls-200K", [&]() { return runGuardedVM(calls, ""); }},
+        {"vm-unsegmented/synthetic/deep-stack-4M", [&]() { return runUnsegmentedVM(deep_stack, ""); }},
+        {"vm/synthetic/table-200K", [&]() { return runVM(table, "hello"); }},
+        {"fork-server/synthetic/table-200K", [&]() {
+            table_server.run("hello");
+            return Work{table_server.lastInstructions(), 0};
+        }},
+        {"vm-specialized/self-interpreter/hello-world", [&]() { return runVM(interpreter_specialized, ""); }},
+        {"regvm/bottles", [&]() { return runRegisterVM(bottles_registers, ""); }},
+        {"regvm/self-interpreter/hello-world", [&]() { return runRegisterVM(interpreter_registers, hello_world_source); }},
+        {"regvm/synthetic/loop-1M", [&]() { return runRegisterVM(loop_registers, ""); }},
+        {"regvm/synthetic/calls-200K", [&]() { return runRegisterVM(calls_registers, ""); }},
+        {"regvm/synthetic/recursion-1M", [&]() { return runRegisterVM(recursion_registers, ""); }},
+        {"regvm/translate/self-interpreter", [&]() {
+            RegisterProgram registers = translateToRegisters(interpreter);
+            return Work{interpreter.size(), 0};
+        }},
+        {"specialize/self-interpreter/hello-world", [&]() {
+            Specialization specialization = specialize(interpreter, hello_world_source);
+            return Work{interpreter.size(), hello_world_source.size()};
+        }},
+        {"parse/self-interpreter", [&]() {
+            FILE* file = tempFile(interpreter_source);
+            Work work{parseFile(file).size(), interpreter_source.size()};
+            fclose(file);
+            return work;
+        }},
+        {"parse/synthetic-1M", [&]() {
+            FILE* file = tempFile(source);
+            Work work{parseFile(file).size(), source.size()};
+            fclose(file);
+            return work;
+        }},
+        {"cfg/self-interpreter", [&]() {
+            CFG cfg(interpreter);
+            return Work{interpreter.size(), 0};
+        }},
+        {"cfg/synthetic-1M", [&]() {
+            CFG cfg(straight_line);
+            return Work{straight_line.size(), 0};
+        }},
+        {"binary/to-binary", [&]() {
+            FILE* in = tempFile(source);
+            FILE* out = tmpfile();
+            toBinary(in, out);
+            fclose(in);
+            fclose(out);
+            return Work{0, source.size()};
+        }},
+        {"snapshot/save/scatter-dense-200K", [&]() {
+            std::ostringstream out;
+            snapshot_vm.save(out);
+            return Work{0, out.str().size(), snapshot_vm.getStats().heap_bytes};
+        }},
+        {"snapshot/restore/scatter-dense-200K", [&]() {
+            std::istringstream in;
+            std::ostringstream out;
+            VM vm(scatter_dense, in, out);
+            vm.restore(snapshot_path);
+            return Work{0, snapshot_bytes, vm.getStats().heap_bytes};
+        }},
+        {"binary/from-binary", [&]() {
+            FILE* in = tempFile(binary);
+            FILE* out = tmpfile();
+            fromBinary(in, out);
+            fclose(in);
+            fclose(out);
+            return Work{0, binary.size()};
+        }}
+    };
+
+    std::vector<Result> results;
+    printf("%-38s %10s %10s %12s %10s %10s\n", "benchmark", "median ms", "p95 ms", "Minstr/s", "MB/s", "heap KB");
+    for (const Benchmark& benchmark : benchmarks) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        Result result = measure(benchmark, reps);
+        double median = result.percentile(0.5);
+        printf("%-38s %10.3f %10.3f", result.name.c_str(), median * 1e3, result.percentile(0.95) * 1e3);
+        if (result.work.instructions) printf(" %12.2f", result.work.instructions / median / 1e6);
+        else printf(" %12s", "-");
+        if (result.work.bytes) printf(" %10.2f", result.work.bytes / median / 1e6);
+        else printf(" %10s", "-");
+        if (result.work.heap_bytes) printf(" %10zu\n", result.work.heap_bytes / 1024);
+        else printf(" %10s\n", "-");
+        results.push_back(result);
+    }
+    if (json) {
+        std::ofstream out(json);
+        writeJSON(out, results);
+    }
+    std::remove(snapshot_path);
+    return 0;
+}
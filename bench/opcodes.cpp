@@ -0,0 +1,171 @@
+// Microbenchmarks for the handler of each instruction type.
+//
+// ./run_opbench [--iterations <n>] [filter]
+//
+// Each kernel is a stack-neutral sequence exercising one instruction type,
+// repeated inside a counting loop. The loop is timed with the sequence
+// unrolled REPS and 2 * REPS times, and the difference divided by REPS is
+// the cost of one sequence, with loop overhead cancelled out. Every engine
+// in the registry is timed, and each must leave the same stack and heap as
+// the reference VM.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../src/engine.h"
+#include "../src/instruction.h"
+
+using namespace WS;
+
+const int REPS = 16; // Even, so that swap kernels are neutral
+const integer_t UNIQUE_LABEL = -1; // Replaced by a label unique to each repetition
+const integer_t EXIT_LABEL = 1;
+const integer_t SUBROUTINE_LABEL = 2;
+
+struct Kernel {
+    const char* targets;
+    std::vector<Instruction> sequence;
+    std::string input; // Consumed per sequence
+};
+
+// The stack holds 3 and 5 beneath the loop counter, which stays at least 1
+// within the loop body
+std::vector<Instruction> kernelProgram(const Kernel& kernel, int reps, integer_t iterations) {
+    std::vector<Instruction> program{
+        Instruction(PUSH, 3),
+        Instruction(PUSH, 5),
+        Instruction(PUSH, iterations),
+        Instruction(LABEL, 0)
+    };
+    for (int i = 0; i < reps; i++) {
+        for (Instruction instr : kernel.sequence) {
+            if (instr.value == UNIQUE_LABEL && (instr.type == LABEL || instr.type == JMP || instr.type == JZ)) {
+                instr.value = 100 + i;
+            }
+            program.push_back(instr);
+        }
+    }
+    std::vector<Instruction> tail{
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, EXIT_LABEL),
+        Instruction(JMP, 0),
+        Instruction(LABEL, EXIT_LABEL),
+        DROP,
+        END,
+        Instruction(LABEL, SUBROUTINE_LABEL),
+        RET
+    };
+    program.insert(program.end(), tail.begin(), tail.end());
+    return program;
+}
+
+std::vector<Kernel> kernels() {
+    return {
+        {"push, drop", {Instruction(PUSH, 1), DROP}, ""},
+        {"dup", {DUP, DROP}, ""},
+        {"copy", {Instruction(COPY, 2), DROP}, ""},
+        {"swap", {SWAP}, ""},
+        {"slide", {DUP, Instruction(SLIDE, 1)}, ""},
+        {"add", {Instruction(PUSH, 0), ADD}, ""},
+        {"sub", {Instruction(PUSH, 0), SUB}, ""},
+        {"mul", {Instruction(PUSH, 1), MUL}, ""},
+        {"div", {Instruction(PUSH, 1), DIV}, ""},
+        {"mod", {Instruction(PUSH, 1LL << 62), MOD}, ""},
+        {"fastdiv", {Instruction(PUSH, 1), FASTDIV}, ""},
+        {"fastmod", {Instruction(PUSH, 1LL << 62), FASTMOD}, ""},
+        {"store", {Instruction(PUSH, 7), DUP, STORE}, ""},
+        {"retrieve", {Instruction(PUSH, 7), RETRIEVE, DROP}, ""},
+        {"label", {Instruction(LABEL, UNIQUE_LABEL)}, ""},
+        {"jmp", {Instruction(JMP, UNIQUE_LABEL), Instruction(LABEL, UNIQUE_LABEL)}, ""},
+        {"jz (taken)", {Instruction(PUSH, 0), Instruction(JZ, UNIQUE_LABEL), Instruction(LABEL, UNIQUE_LABEL)}, ""},
+        {"jz (not taken)", {DUP, Instruction(JZ, EXIT_LABEL)}, ""},
+        {"jn (not taken)", {DUP, Instruction(JN, EXIT_LABEL)}, ""},
+        {"call, ret", {Instruction(CALL, SUBROUTINE_LABEL)}, ""},
+        {"printc", {Instruction(PUSH, 'x'), PRINTC}, ""},
+        {"printi", {DUP, PRINTI}, ""},
+        {"readc", {Instruction(PUSH, 7), READC}, "x"},
+        {"readi", {Instruction(PUSH, 7), READI}, "42\n"}
+    };
+}
+
+std::string sequenceText(const Kernel& kernel) {
+    std::string text;
+    for (const Instruction& instr : kernel.sequence) {
+        if (!text.empty()) {
+            text += "; ";
+        }
+        text += mnemonic(instr.type);
+        if (instr.type == PUSH || instr.type == COPY || instr.type == SLIDE) {
+            text += ' ' + std::to_string(instr.value);
+        }
+    }
+    return text;
+}
+
+double timeKernel(const Engine& engine, const Kernel& kernel, int reps, integer_t iterations, Execution& state) {
+    std::vector<Instruction> program = kernelProgram(kernel, reps, iterations);
+    std::string input;
+    for (integer_t i = 0; i < iterations * reps && !kernel.input.empty(); i++) {
+        input += kernel.input;
+    }
+    double best = 1e9;
+    for (int trial = 0; trial < 5; trial++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        state = engine.run(program, input, 0);
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    integer_t iterations = 100000;
+    const char* filter = "";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoll(argv[++i]);
+        }
+        else {
+            filter = argv[i];
+        }
+    }
+
+    const std::vector<Engine>& all_engines = engines();
+    printf("%-16s %-32s", "kernel", "sequence");
+    for (const Engine& engine : all_engines) {
+        printf(" %10s", (std::string(engine.name) + " ns").c_str());
+    }
+    putchar('\n');
+
+    int failures = 0;
+    for (const Kernel& kernel : kernels()) {
+        if (!strstr(kernel.targets, filter)) {
+            continue;
+        }
+        printf("%-16s %-32s", kernel.targets, sequenceText(kernel).c_str());
+        Execution reference;
+        for (size_t e = 0; e < all_engines.size(); e++) {
+            Execution single, twice;
+            double t1 = timeKernel(all_engines[e], kernel, REPS, iterations, single);
+            double t2 = timeKernel(all_engines[e], kernel, 2 * REPS, iterations, twice);
+            if (e == 0) {
+                reference = single;
+            }
+            bool matches = single.error.empty() && twice.error.empty() &&
+                           single.stack == std::vector<integer_t>{3, 5} && twice.stack == single.stack &&
+                           single.heap == reference.heap && twice.heap == reference.heap;
+            printf(" %10.2f%s", std::max(0.0, t2 - t1) / (REPS * (double) iterations) * 1e9, matches ? "" : "!");
+            failures += !matches;
+        }
+        putchar('\n');
+    }
+    if (failures) {
+        fprintf(stderr, "%d kernels left a different stack or heap (marked with !)\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,713 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include "cfg.h"
+
+namespace WS {
+
+const size_t CFG::NONE;
+const size_t CFG::EXIT;
+
+namespace {
+
+bool intraprocedural(const Edge& edge) {
+    return edge.kind != EDGE_CALL && edge.to != CFG::EXIT;
+}
+
+// Value partway through an iteration of a loop, in terms of the state at
+// its header
+struct LoopValue {
+    enum Kind { UNKNOWN, CONSTANT, ENTRY, CELL } kind;
+    integer_t where;  // Depth of the entry at the header, or address of the cell
+    integer_t offset; // The constant, or what was added to the entry or cell
+
+    bool operator==(const LoopValue& other) const {
+        return kind == other.kind && where == other.where && offset == other.offset;
+    }
+};
+
+const LoopValue UNKNOWN_VALUE{LoopValue::UNKNOWN, 0, 0};
+
+LoopValue plus(const LoopValue& value, integer_t c) {
+    if (value.kind == LoopValue::UNKNOWN) {
+        return value;
+    }
+    return LoopValue{value.kind, value.where, (integer_t) ((unsigned_t) value.offset + (unsigned_t) c)};
+}
+
+// The stack partway through an iteration is the header's with its top
+// `taken` entries popped, and `stack` above them
+struct LoopState {
+    bool reached;
+    size_t taken;
+    std::vector<LoopValue> stack;
+    std::set<integer_t> stored; // Cells that may have been stored since the header
+
+    ptrdiff_t height() const { return (ptrdiff_t) stack.size() - (ptrdiff_t) taken; }
+
+    // Moves the header's entries down to the given depth into the stack
+    void take(size_t depth) {
+        while (taken < depth) {
+            stack.insert(stack.begin(), LoopValue{LoopValue::ENTRY, (integer_t) taken++, 0});
+        }
+    }
+};
+
+// Merges the state along another edge into a block, or fails when the
+// stack heights differ
+bool join(LoopState& to, LoopState from, bool& changed) {
+    changed = false;
+    if (!to.reached) {
+        to = from;
+        changed = true;
+        return true;
+    }
+    if (to.height() != from.height()) {
+        return false;
+    }
+    size_t taken = std::max(to.taken, from.taken);
+    to.take(taken);
+    from.take(taken);
+    for (size_t i = 0; i < to.stack.size(); i++) {
+        if (!(to.stack[i] == from.stack[i]) && to.stack[i].kind != LoopValue::UNKNOWN) {
+            to.stack[i] = UNKNOWN_VALUE;
+            changed = true;
+        }
+    }
+    for (integer_t cell : from.stored) {
+        changed |= to.stored.insert(cell).second;
+    }
+    return true;
+}
+
+} // namespace
+
+CFG::CFG(const std::vector<Instruction>& instructions) : instructions_(instructions) {
+    buildBlocks();
+    buildEdges();
+    findSubroutines();
+    computeDominators();
+    findLoops();
+}
+
+bool CFG::dominates(size_t a, size_t b) const {
+    if (!reachable(a) || !reachable(b)) {
+        return false;
+    }
+    return dom_pre_[a] <= dom_pre_[b] && dom_post_[b] <= dom_post_[a];
+}
+
+size_t CFG::loopDepth(size_t b) const {
+    size_t depth = 0;
+    for (size_t loop = loop_of_[b]; loop != NONE; loop = loops_[loop].parent) {
+        depth++;
+    }
+    return depth;
+}
+
+std::vector<InductionVariable> CFG::inductionVariables(size_t l) const {
+    const Loop& loop = loops_[l];
+    std::vector<InductionVariable> variables;
+    std::unordered_map<size_t, LoopState> in;
+    for (size_t b : loop.blocks) {
+        in[b] = LoopState{false, 0, std::vector<LoopValue>(), std::set<integer_t>()};
+    }
+    in[loop.header].reached = true;
+
+    // The stores to each constant address in the loop, with the last value
+    // stored
+    struct Stores {
+        size_t block;
+        size_t count;
+        LoopValue value;
+    };
+    std::map<integer_t, Stores> stores;
+    bool unknown_store = false;
+
+    // Follows a block from the state on entry, or fails for instructions
+    // the analysis cannot follow
+    auto run = [&](size_t b, LoopState& state, bool record) {
+        std::vector<LoopValue>& stack = state.stack;
+        auto pop = [&]() {
+            state.take(state.taken + stack.empty());
+            LoopValue top = stack.back();
+            stack.pop_back();
+            return top;
+        };
+        auto store = [&](const LoopValue& address, const LoopValue& value) {
+            if (address.kind != LoopValue::CONSTANT) {
+                unknown_store = true;
+                return;
+            }
+            state.stored.insert(address.offset);
+            if (record) {
+                Stores& cell = stores.insert(std::make_pair(address.offset, Stores{b, 0, value})).first->second;
+                cell.block = b;
+                cell.count++;
+                cell.value = value;
+            }
+        };
+        auto load = [&](const LoopValue& address) {
+            if (address.kind == LoopValue::CONSTANT && !state.stored.count(address.offset)) {
+                return LoopValue{LoopValue::CELL, address.offset, 0};
+            }
+            return UNKNOWN_VALUE;
+        };
+        for (size_t pc = blocks_[b].start; pc < blocks_[b].end; pc++) {
+            const Instruction& instr = instructions_[pc];
+            switch (instr.type) {
+            case PUSH:
+                stack.push_back(LoopValue{LoopValue::CONSTANT, 0, instr.value});
+                break;
+            case DUP: case COPY: {
+                integer_t n = instr.type == COPY ? instr.value : 0;
+                size_t size = stack.size();
+                if (n < 0) {
+                    return false;
+                }
+                stack.push_back((unsigned_t) n < size ? stack[size - 1 - n] :
+                                LoopValue{LoopValue::ENTRY, (integer_t) (state.taken + n - size), 0});
+                break;
+            }
+            case SWAP: {
+                LoopValue a = pop();
+                LoopValue b = pop();
+                stack.push_back(a);
+                stack.push_back(b);
+                break;
+            }
+            case DROP:
+                // Dropping from an empty stack does nothing, so the header's
+                // entries might not be where they are assumed to be
+                if (stack.empty()) {
+                    return false;
+                }
+                stack.pop_back();
+                break;
+            case SLIDE: {
+                if (instr.value < 0) {
+                    return false;
+                }
+                LoopValue top = pop();
+                if ((unsigned_t) instr.value <= stack.size()) {
+                    stack.resize(stack.size() - instr.value);
+                }
+                else {
+                    state.taken += instr.value - stack.size();
+                    stack.clear();
+                }
+                stack.push_back(top);
+                break;
+            }
+            case ADD: case SUB: {
+                LoopValue rhs = pop();
+                LoopValue lhs = pop();
+                if (rhs.kind == LoopValue::CONSTANT) {
+                    stack.push_back(plus(lhs, instr.type == ADD ? rhs.offset : (integer_t) (0 - (unsigned_t) rhs.offset)));
+                }
+                else if (lhs.kind == LoopValue::CONSTANT && instr.type == ADD) {
+                    stack.push_back(plus(rhs, lhs.offset));
+                }
+                else {
+                    stack.push_back(UNKNOWN_VALUE);
+                }
+                break;
+            }
+            case ADDI:
+                stack.push_back(plus(pop(), instr.value));
+                break;
+            case MUL: case DIV: case MOD: case FASTDIV: case FASTMOD:
+                pop();
+                pop();
+                stack.push_back(UNKNOWN_VALUE);
+                break;
+            case SHL: case SHR:
+                pop();
+                stack.push_back(UNKNOWN_VALUE);
+                break;
+            case STORE: {
+                LoopValue value = pop();
+                store(pop(), value);
+                break;
+            }
+            case RETRIEVE:
+                stack.push_back(load(pop()));
+                break;
+            case READC: case READI:
+                store(pop(), UNKNOWN_VALUE);
+                break;
+            case STORECELL:
+                store(LoopValue{LoopValue::CONSTANT, 0, instr.value}, pop());
+                break;
+            case LOADCELL:
+                stack.push_back(load(LoopValue{LoopValue::CONSTANT, 0, instr.value}));
+                break;
+            case LOADVAR:
+                stack.push_back(UNKNOWN_VALUE);
+                break;
+            case STOREVAR: case PRINTC: case PRINTI: case JZ: case JN:
+                pop();
+                break;
+            case CALL: case RET:
+                return false;
+            default:
+                break;
+            }
+        }
+        return true;
+    };
+
+    // Follows the blocks of one iteration until the states entering them
+    // settle, which takes more than one visit only for nested loops
+    std::vector<size_t> worklist(1, loop.header);
+    for (size_t budget = 64 * loop.blocks.size(); !worklist.empty(); budget--) {
+        if (budget == 0) {
+            return variables;
+        }
+        size_t b = worklist.back();
+        worklist.pop_back();
+        LoopState state = in[b];
+        if (!run(b, state, false)) {
+            return variables;
+        }
+        for (const Edge& edge : successors(b)) {
+            if (edge.to == loop.header || !in.count(edge.to)) {
+                continue;
+            }
+            bool changed;
+            if (!join(in[edge.to], state, changed)) {
+                return variables;
+            }
+            if (changed) {
+                worklist.push_back(edge.to);
+            }
+        }
+    }
+    std::vector<LoopState> ends;
+    for (size_t b : loop.blocks) {
+        LoopState state = in[b];
+        if (state.reached) {
+            run(b, state, true);
+            if (std::find(loop.latches.begin(), loop.latches.end(), b) != loop.latches.end()) {
+                ends.push_back(state);
+            }
+        }
+    }
+
+    bool balanced = !ends.empty();
+    size_t taken = 0;
+    for (const LoopState& end : ends) {
+        balanced &= end.height() == 0;
+        taken = std::max(taken, end.taken);
+    }
+    for (size_t depth = 0; balanced && depth < taken; depth++) {
+        LoopValue value = UNKNOWN_VALUE;
+        for (LoopState& end : ends) {
+            end.take(taken);
+            const LoopValue& entry = end.stack[taken - 1 - depth];
+            if (&end == &ends[0]) {
+                value = entry;
+            }
+            else if (!(entry == value)) {
+                value = UNKNOWN_VALUE;
+            }
+        }
+        if (value.kind == LoopValue::ENTRY && value.where == (integer_t) depth && value.offset != 0) {
+            variables.push_back(InductionVariable{false, value.where, value.offset});
+        }
+    }
+    for (const std::pair<const integer_t, Stores>& cell : stores) {
+        const LoopValue& value = cell.second.value;
+        bool once = cell.second.count == 1 && loop_of_[cell.second.block] == l;
+        for (size_t latch : loop.latches) {
+            once &= dominates(cell.second.block, latch);
+        }
+        if (!unknown_store && once && value.kind == LoopValue::CELL && value.where == cell.first && value.offset != 0) {
+            variables.push_back(InductionVariable{true, cell.first, value.offset});
+        }
+    }
+    return variables;
+}
+
+void CFG::writeDot(std::ostream& out) const {
+    static const char* const styles[] = {
+        "", " [style=bold]", " [label=\"T\"]", " [label=\"F\"]",
+        " [style=dashed, label=\"call\"]", " [style=dotted, label=\"return\"]", ""
+    };
+    const size_t MAX_LINES = 8;
+    std::vector<std::vector<size_t>> members(subroutines_.size() + 1);
+    for (size_t b = 0; b < blocks_.size(); b++) {
+        members[reachable(b) ? owner_[b] : subroutines_.size()].push_back(b);
+    }
+
+    out << "digraph cfg {\n    node [shape=box, fontname=monospace];\n    exit [shape=ellipse];\n";
+    for (size_t s = 0; s < members.size(); s++) {
+        if (members[s].empty()) {
+            continue;
+        }
+        out << "    subgraph cluster_" << s << " {\n        label=\"";
+        if (s == subroutines_.size()) out << "unreachable";
+        else if (s == 0) out << "main";
+        else out << "label_" << subroutines_[s].label;
+        out << "\";\n";
+        for (size_t b : members[s]) {
+            const Block& block = blocks_[b];
+            out << "        b" << b << " [label=\"";
+            for (size_t pc = block.start; pc < block.end && pc < block.start + MAX_LINES; pc++) {
+                const Instruction& instr = instructions_[pc];
+                out << (instr.type == LABEL ? "" : "  ") << mnemonic(instr.type);
+                switch (instr.type) {
+                case PUSH: case COPY: case SLIDE:
+                    out << ' ' << instr.value;
+                    break;
+                case LABEL: case CALL: case JMP: case JZ: case JN:
+                    out << " label_" << instr.value;
+                    break;
+                default:
+                    break;
+                }
+                out << "\\l";
+            }
+            if (block.end - block.start > MAX_LINES) {
+                out << "  ... " << (block.end - block.start - MAX_LINES) << " more\\l";
+            }
+            if (loop_of_[b] != NONE && loops_[loop_of_[b]].header == b) {
+                for (const InductionVariable& variable : inductionVariables(loop_of_[b])) {
+                    out << "  ; " << (variable.cell ? "cell " : "entry ") << variable.where << " += " << variable.step << "\\l";
+                }
+            }
+            out << '"' << (s == subroutines_.size() ? ", style=dashed" : "") << "];\n";
+        }
+        out << "    }\n";
+    }
+    for (const Edge& edge : succ_) {
+        out << "    b" << edge.from << " -> ";
+        if (edge.to == EXIT) out << "exit";
+        else out << 'b' << edge.to;
+        out << styles[edge.kind] << ";\n";
+    }
+    out << "}\n";
+}
+
+// Private
+
+void CFG::buildBlocks() {
+    block_of_.resize(instructions_.size());
+    bool leader = true;
+    for (size_t i = 0; i < instructions_.size(); i++) {
+        if (leader || instructions_[i].type == LABEL) {
+            if (!blocks_.empty()) {
+                blocks_.back().end = i;
+            }
+            blocks_.push_back(Block{i, i});
+        }
+        block_of_[i] = blocks_.size() - 1;
+        switch (instructions_[i].type) {
+        case CALL: case JMP: case JZ: case JN: case RET: case END:
+            leader = true;
+            break;
+        default:
+            leader = false;
+        }
+    }
+    if (!blocks_.empty()) {
+        blocks_.back().end = instructions_.size();
+    }
+}
+
+void CFG::buildEdges() {
+    std::unordered_map<integer_t, size_t> labels;
+    for (const Block& block : blocks_) {
+        if (instructions_[block.start].type == LABEL) {
+            labels[instructions_[block.start].value] = block.start;
+        }
+    }
+    auto target = [&](integer_t label) {
+        std::unordered_map<integer_t, size_t>::const_iterator pc = labels.find(label);
+        return block_of_[pc == labels.end() ? 0 : pc->second];
+    };
+
+    succ_begin_.reserve(blocks_.size() + 1);
+    succ_.reserve(blocks_.size() + blocks_.size() / 4);
+    for (size_t b = 0; b < blocks_.size(); b++) {
+        succ_begin_.push_back(succ_.size());
+        const Instruction& last = instructions_[blocks_[b].end - 1];
+        size_t next = b + 1 < blocks_.size() ? b + 1 : EXIT;
+        switch (last.type) {
+        case JMP:
+            succ_.push_back(Edge{b, target(last.value), EDGE_JUMP});
+            break;
+        case JZ: case JN:
+            succ_.push_back(Edge{b, target(last.value), EDGE_TAKEN});
+            succ_.push_back(Edge{b, next, EDGE_NOT_TAKEN});
+            break;
+        case CALL:
+            succ_.push_back(Edge{b, target(last.value), EDGE_CALL});
+            succ_.push_back(Edge{b, next, EDGE_RETURN});
+            break;
+        case RET:
+            break;
+        case END:
+            succ_.push_back(Edge{b, EXIT, EDGE_EXIT});
+            break;
+        default:
+            succ_.push_back(Edge{b, next, EDGE_FALLTHROUGH});
+            break;
+        }
+    }
+    succ_begin_.push_back(succ_.size());
+
+    // Counting sort of the edges by target
+    pred_begin_.assign(blocks_.size() + 1, 0);
+    for (const Edge& edge : succ_) {
+        if (edge.to != EXIT) {
+            pred_begin_[edge.to + 1]++;
+        }
+    }
+    for (size_t b = 0; b < blocks_.size(); b++) {
+        pred_begin_[b + 1] += pred_begin_[b];
+    }
+    pred_.resize(pred_begin_[blocks_.size()]);
+    std::vector<size_t> fill(pred_begin_.begin(), pred_begin_.end() - 1);
+    for (const Edge& edge : succ_) {
+        if (edge.to != EXIT) {
+            pred_[fill[edge.to]++] = edge;
+        }
+    }
+}
+
+void CFG::findSubroutines() {
+    owner_.assign(blocks_.size(), NONE);
+    if (blocks_.empty()) {
+        return;
+    }
+    std::vector<size_t> subroutine_at(blocks_.size(), NONE);
+    for (const Edge& edge : succ_) {
+        if (edge.kind == EDGE_CALL) {
+            subroutine_at[edge.to] = 1; // Marked, numbered below
+        }
+    }
+    subroutine_at[0] = 0;
+    subroutines_.push_back(Subroutine{0, 0, std::vector<size_t>()});
+    for (size_t b = 1; b < blocks_.size(); b++) {
+        if (subroutine_at[b] != NONE) {
+            subroutine_at[b] = subroutines_.size();
+            subroutines_.push_back(Subroutine{b, instructions_[blocks_[b].start].value, std::vector<size_t>()});
+        }
+    }
+    for (const Edge& edge : succ_) {
+        if (edge.kind == EDGE_CALL) {
+            subroutines_[subroutine_at[edge.to]].calls.push_back(edge.from);
+        }
+    }
+
+    // Depth-first search of each subroutine for ownership and reverse
+    // postorder, with an explicit stack of blocks and successor positions
+    rpo_.reserve(blocks_.size());
+    std::vector<std::pair<size_t, size_t>> stack;
+    std::vector<size_t> postorder;
+    for (size_t s = 0; s < subroutines_.size(); s++) {
+        size_t entry = subroutines_[s].entry;
+        if (owner_[entry] != NONE) {
+            continue;
+        }
+        postorder.clear();
+        owner_[entry] = s;
+        stack.push_back(std::make_pair(entry, succ_begin_[entry]));
+        while (!stack.empty()) {
+            size_t b = stack.back().first;
+            size_t& e = stack.back().second;
+            if (e == succ_begin_[b + 1]) {
+                postorder.push_back(b);
+                stack.pop_back();
+                continue;
+            }
+            const Edge& edge = succ_[e++];
+            if (intraprocedural(edge) && owner_[edge.to] == NONE) {
+                owner_[edge.to] = s;
+                stack.push_back(std::make_pair(edge.to, succ_begin_[edge.to]));
+            }
+        }
+        rpo_.insert(rpo_.end(), postorder.rbegin(), postorder.rend());
+    }
+}
+
+// Lengauer-Tarjan with path compression, over a virtual root whose
+// successors are the subroutine entries. Vertices are numbered in
+// depth-first order, with 0 for the root.
+void CFG::computeDominators() {
+    idom_.assign(blocks_.size(), NONE);
+    dom_pre_.assign(blocks_.size(), 0);
+    dom_post_.assign(blocks_.size(), 0);
+    if (blocks_.empty()) {
+        return;
+    }
+
+    std::vector<bool> entry(blocks_.size(), false);
+    for (const Subroutine& subroutine : subroutines_) {
+        entry[subroutine.entry] = true;
+    }
+    std::vector<size_t> number(blocks_.size(), NONE);
+    std::vector<size_t> vertex(1, NONE);
+    std::vector<size_t> parent(1, NONE);
+    std::vector<std::pair<size_t, size_t>> stack;
+    for (const Subroutine& subroutine : subroutines_) {
+        if (number[subroutine.entry] != NONE) {
+            continue;
+        }
+        number[subroutine.entry] = vertex.size();
+        vertex.push_back(subroutine.entry);
+        parent.push_back(0);
+        stack.push_back(std::make_pair(subroutine.entry, succ_begin_[subroutine.entry]));
+        while (!stack.empty()) {
+            size_t b = stack.back().first;
+            size_t& e = stack.back().second;
+            if (e == succ_begin_[b + 1]) {
+                stack.pop_back();
+                continue;
+            }
+            const Edge& edge = succ_[e++];
+            if (intraprocedural(edge) && number[edge.to] == NONE) {
+                number[edge.to] = vertex.size();
+                vertex.push_back(edge.to);
+                parent.push_back(number[b]);
+                stack.push_back(std::make_pair(edge.to, succ_begin_[edge.to]));
+            }
+        }
+    }
+
+    size_t n = vertex.size();
+    std::vector<size_t> semi(n), label(n), ancestor(n, NONE), dom(n, 0);
+    std::vector<size_t> bucket_head(n, NONE), bucket_next(n, NONE);
+    for (size_t v = 0; v < n; v++) {
+        semi[v] = label[v] = v;
+    }
+    std::vector<size_t> path;
+    auto eval = [&](size_t v) {
+        if (ancestor[v] == NONE) {
+            return v;
+        }
+        for (size_t x = v; ancestor[ancestor[x]] != NONE; x = ancestor[x]) {
+            path.push_back(x);
+        }
+        while (!path.empty()) {
+            size_t x = path.back();
+            path.pop_back();
+            size_t a = ancestor[x];
+            if (semi[label[a]] < semi[label[x]]) {
+                label[x] = label[a];
+            }
+            ancestor[x] = ancestor[a];
+        }
+        return label[v];
+    };
+
+    for (size_t w = n - 1; w > 0; w--) {
+        size_t b = vertex[w];
+        if (entry[b]) {
+            semi[w] = 0; // The root is a predecessor
+        }
+        for (const Edge& edge : predecessors(b)) {
+            if (edge.kind == EDGE_CALL || number[edge.from] == NONE) {
+                continue;
+            }
+            size_t u = eval(number[edge.from]);
+            if (semi[u] < semi[w]) {
+                semi[w] = semi[u];
+            }
+        }
+        bucket_next[w] = bucket_head[semi[w]];
+        bucket_head[semi[w]] = w;
+        ancestor[w] = parent[w];
+        for (size_t v = bucket_head[parent[w]]; v != NONE; v = bucket_next[v]) {
+            size_t u = eval(v);
+            dom[v] = semi[u] < semi[v] ? u : parent[w];
+        }
+        bucket_head[parent[w]] = NONE;
+    }
+    for (size_t w = 1; w < n; w++) {
+        if (dom[w] != semi[w]) {
+            dom[w] = dom[dom[w]];
+        }
+        idom_[vertex[w]] = dom[w] == 0 ? NONE : vertex[dom[w]];
+    }
+
+    // Number the dominator tree in preorder and postorder
+    std::vector<size_t> child_head(n, NONE), child_next(n, NONE);
+    for (size_t w = n - 1; w > 0; w--) {
+        child_next[w] = child_head[dom[w]];
+        child_head[dom[w]] = w;
+    }
+    size_t pre = 0, post = 0;
+    std::vector<size_t> tree_stack(1, 0);
+    std::vector<size_t> next_child(child_head);
+    while (!tree_stack.empty()) {
+        size_t v = tree_stack.back();
+        if (next_child[v] != NONE) {
+            size_t c = next_child[v];
+            next_child[v] = child_next[c];
+            dom_pre_[vertex[c]] = pre++;
+            tree_stack.push_back(c);
+            continue;
+        }
+        if (v != 0) {
+            dom_post_[vertex[v]] = post++;
+        }
+        tree_stack.pop_back();
+    }
+}
+
+void CFG::findLoops() {
+    loop_of_.assign(blocks_.size(), NONE);
+    std::vector<size_t> visited(blocks_.size(), NONE);
+    std::vector<size_t> worklist;
+    for (size_t header : rpo_) {
+        std::vector<size_t> latches;
+        for (const Edge& edge : predecessors(header)) {
+            if (edge.kind != EDGE_CALL && dominates(header, edge.from)) {
+                latches.push_back(edge.from);
+            }
+        }
+        if (latches.empty()) {
+            continue;
+        }
+        size_t index = loops_.size();
+        loops_.push_back(Loop{header, NONE, latches, std::vector<size_t>(1, header)});
+        Loop& loop = loops_.back();
+        visited[header] = index;
+        for (size_t latch : latches) {
+            if (visited[latch] != index) {
+                visited[latch] = index;
+                loop.blocks.push_back(latch);
+                worklist.push_back(latch);
+            }
+        }
+        while (!worklist.empty()) {
+            size_t b = worklist.back();
+            worklist.pop_back();
+            for (const Edge& edge : predecessors(b)) {
+                if (edge.kind != EDGE_CALL && reachable(edge.from) && visited[edge.from] != index) {
+                    visited[edge.from] = index;
+                    loop.blocks.push_back(edge.from);
+                    worklist.push_back(edge.from);
+                }
+            }
+        }
+    }
+
+    // Natural loops with distinct headers are nested or disjoint, so larger
+    // loops come first and each loop's parent is the innermost loop already
+    // containing its header
+    std::stable_sort(loops_.begin(), loops_.end(), [](const Loop& a, const Loop& b) {
+        return a.blocks.size() > b.blocks.size();
+    });
+    for (size_t l = 0; l < loops_.size(); l++) {
+        loops_[l].parent = loop_of_[loops_[l].header];
+        for (size_t b : loops_[l].blocks) {
+            loop_of_[b] = l;
+        }
+    }
+}
+
+} // namespace WS
@@ -0,0 +1,159 @@
+#ifndef WS_CFG_H_
+#define WS_CFG_H_
+
+#include <ostream>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+enum EdgeKind {
+    EDGE_FALLTHROUGH, // Into the next block, which begins with a label
+    EDGE_JUMP,
+    EDGE_TAKEN,       // jz or jn
+    EDGE_NOT_TAKEN,
+    EDGE_CALL,        // To the entry of the called subroutine
+    EDGE_RETURN,      // From a call to the instruction after it, where the callee returns
+    EDGE_EXIT         // end
+};
+
+struct Edge {
+    size_t from;
+    size_t to; // CFG::EXIT for end, or when control runs off the end of the program
+    EdgeKind kind;
+};
+
+// Value that changes by the same amount on every iteration of a loop
+struct InductionVariable {
+    bool cell;       // A heap cell at a constant address, or a stack entry
+    integer_t where; // Address of the cell, or depth of the entry at the header
+    integer_t step;  // Added with wrapping
+};
+
+// Control flow graph of basic blocks. Blocks start at the first
+// instruction, at each label, and after each instruction that transfers
+// control, so each block ends in at most one control transfer.
+//
+// Labels resolve as in the VM: the last definition of a label wins, and
+// an undefined label refers to instruction 0. A block ending in ret has no
+// successors; control instead continues along the return edge of each call.
+//
+// Subroutines are the main program and the target of each call. Each block
+// belongs to the first subroutine that reaches it without following call
+// edges, with main first and the others in program order, since Whitespace
+// lets subroutines share code. Dominators are over the same intraprocedural
+// edges, so a subroutine entry dominates the blocks only it reaches. Loops
+// are natural loops of back edges to a dominating header; irreducible
+// cycles are not reported as loops.
+//
+// Induction variables follow one iteration of a loop symbolically from its
+// header. A stack entry is one when every back edge leaves the stack as
+// high as the header found it, with that entry plus a constant. A heap cell
+// is one when its only store in the loop, which runs once per iteration,
+// stores its value from the start of the iteration plus a constant. A loop
+// with a call, or that drops entries it found, has none.
+//
+// Construction is linear in the size of the program, apart from the
+// inverse Ackermann factor of the dominator computation and loop bodies
+// being walked once per enclosing loop. The instructions are referenced,
+// not copied, so they must outlive the CFG.
+class CFG {
+public:
+    static const size_t NONE = (size_t) -1;
+    static const size_t EXIT = (size_t) -2;
+
+    struct Block {
+        size_t start;
+        size_t end; // One past the last instruction
+    };
+
+    struct Subroutine {
+        size_t entry;              // Block
+        integer_t label;           // Unused for main
+        std::vector<size_t> calls; // Blocks ending in a call to it
+    };
+
+    struct Loop {
+        size_t header;
+        size_t parent;               // Innermost enclosing loop, or NONE
+        std::vector<size_t> latches; // Sources of back edges
+        std::vector<size_t> blocks;  // Including the header
+    };
+
+    // Range of edges for iteration with range-based for
+    class Edges {
+    public:
+        Edges(const Edge* begin, const Edge* end) : begin_(begin), end_(end) {}
+        const Edge* begin() const { return begin_; }
+        const Edge* end() const { return end_; }
+        size_t size() const { return end_ - begin_; }
+    private:
+        const Edge* begin_;
+        const Edge* end_;
+    };
+
+    explicit CFG(const std::vector<Instruction>& instructions);
+
+    size_t size() const { return blocks_.size(); }
+    const std::vector<Block>& blocks() const { return blocks_; }
+    const Block& block(size_t b) const { return blocks_[b]; }
+    size_t blockOf(size_t pc) const { return block_of_[pc]; }
+
+    Edges successors(size_t b) const {
+        return Edges(succ_.data() + succ_begin_[b], succ_.data() + succ_begin_[b + 1]);
+    }
+    Edges predecessors(size_t b) const {
+        return Edges(pred_.data() + pred_begin_[b], pred_.data() + pred_begin_[b + 1]);
+    }
+
+    // Subroutine 0 is the main program, entered at block 0
+    const std::vector<Subroutine>& subroutines() const { return subroutines_; }
+    size_t subroutineOf(size_t b) const { return owner_[b]; }
+    bool reachable(size_t b) const { return owner_[b] != NONE; }
+
+    // Reachable blocks in reverse postorder, subroutine by subroutine
+    const std::vector<size_t>& reversePostorder() const { return rpo_; }
+
+    // Immediate dominator, or NONE for subroutine entries and unreachable blocks
+    size_t idom(size_t b) const { return idom_[b]; }
+    bool dominates(size_t a, size_t b) const;
+
+    // Loops, outer loops before the loops nested in them
+    const std::vector<Loop>& loops() const { return loops_; }
+    // Innermost loop containing the block, or NONE
+    size_t loopOf(size_t b) const { return loop_of_[b]; }
+    size_t loopDepth(size_t b) const;
+    // Induction variables of a loop with nonzero steps, entries from the
+    // top of the stack down, then cells by address. Computed on each call,
+    // in time linear in the size of the loop unless it has nested loops.
+    std::vector<InductionVariable> inductionVariables(size_t loop) const;
+
+    void writeDot(std::ostream& out) const;
+
+private:
+    const std::vector<Instruction>& instructions_;
+    std::vector<Block> blocks_;
+    std::vector<size_t> block_of_;
+    std::vector<Edge> succ_;
+    std::vector<size_t> succ_begin_;
+    std::vector<Edge> pred_;
+    std::vector<size_t> pred_begin_;
+    std::vector<Subroutine> subroutines_;
+    std::vector<size_t> owner_;
+    std::vector<size_t> rpo_;
+    std::vector<size_t> idom_;
+    std::vector<size_t> dom_pre_;  // Dominator tree preorder and postorder
+    std::vector<size_t> dom_post_; // numbers, for constant time queries
+    std::vector<Loop> loops_;
+    std::vector<size_t> loop_of_;
+
+    void buildBlocks();
+    void buildEdges();
+    void findSubroutines();
+    void computeDominators();
+    void findLoops();
+};
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,85 @@
+#include "emitter.h"
+
+namespace WS {
+
+namespace {
+
+void emitUnsigned(std::ostream& out, unsigned_t value) {
+    int bit = 8 * sizeof(unsigned_t) - 1;
+    while (bit >= 0 && !((value >> bit) & 1)) {
+        bit--;
+    }
+    for (; bit >= 0; bit--) {
+        out.put((value >> bit) & 1 ? '\t' : ' ');
+    }
+    out.put('\n');
+}
+
+void emitInteger(std::ostream& out, integer_t value) {
+    if (value < 0) {
+        out.put('\t');
+        emitUnsigned(out, 0 - (unsigned_t) value);
+    }
+    else {
+        out.put(' ');
+        emitUnsigned(out, value);
+    }
+}
+
+} // namespace
+
+void emitWhitespace(std::ostream& out, const std::vector<Instruction>& instructions) {
+    for (const Instruction& instr : instructions) {
+        emitWhitespace(out, instr);
+    }
+}
+
+void emitWhitespace(std::ostream& out, const Instruction& instr) {
+    switch (instr.type) {
+    case PUSH:     out << "  "; emitInteger(out, instr.value); break;
+    case DUP:      out << " \n "; break;
+    case COPY:     out << " \t "; emitInteger(out, instr.value); break;
+    case SWAP:     out << " \n\t"; break;
+    case DROP:     out << " \n\n"; break;
+    case SLIDE:    out << " \t\n"; emitInteger(out, instr.value); break;
+
+    case ADD:      out << "\t   "; break;
+    case SUB:      out << "\t  \t"; break;
+    case MUL:      out << "\t  \n"; break;
+    case DIV:      out << "\t \t "; break;
+    case MOD:      out << "\t \t\t"; break;
+
+    case STORE:    out << "\t\t "; break;
+    case RETRIEVE: out << "\t\t\t"; break;
+
+    case LABEL:    out << "\n  "; emitUnsigned(out, instr.value); break;
+    case CALL:     out << "\n \t"; emitUnsigned(out, instr.value); break;
+    case JMP:      out << "\n \n"; emitUnsigned(out, instr.value); break;
+    case JZ:       out << "\n\t "; emitUnsigned(out, instr.value); break;
+    case JN:       out << "\n\t\t"; emitUnsigned(out, instr.value); break;
+    case RET:      out << "\n\t\n"; break;
+    case END:      out << "\n\n\n"; break;
+
+    case PRINTC:   out << "\t\n  "; break;
+    case PRINTI:   out << "\t\n \t"; break;
+    case READC:    out << "\t\n\t "; break;
+    case READI:    out << "\t\n\t\t"; break;
+
+    case DEBUG_PRINTSTACK:
+    case DEBUG_PRINTHEAP:
+    case ADDI:
+    case SHL:
+    case SHR:
+    case LOADVAR:
+    case STOREVAR:
+    case LOADCELL:
+    case STORECELL:
+    case WRITE:
+    case FASTDIV:
+    case FASTMOD:
+    case INVALID_INSTR:
+        throw "Instruction has no Whitespace encoding\n";
+    }
+}
+
+} // namespace WS
@@ -0,0 +1,16 @@
+#ifndef WS_EMITTER_H_
+#define WS_EMITTER_H_
+
+#include <ostream>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+// Write instructions as Whitespace source that Parser reads back unchanged
+void emitWhitespace(std::ostream& out, const std::vector<Instruction>& instructions);
+void emitWhitespace(std::ostream& out, const Instruction& instr);
+
+} // namespace WS
+
+#endif
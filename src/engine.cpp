@@ -0,0 +1,219 @@
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "engine.h"
+#include "forkserver.h"
+#include "opstats.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "regvm.h"
+#include "specializer.h"
+#include "vm.h"
+
+namespace WS {
+
+namespace {
+
+Execution runVM(VM& vm, std::ostringstream& out) {
+    Execution execution;
+    try {
+        vm.execute();
+    }
+    catch (const char* e) {
+        execution.error = e;
+    }
+    execution.output = out.str();
+    execution.stack = vm.getStack();
+    execution.heap = vm.getHeap();
+    return execution;
+}
+
+// A VM set up by the configure step before it runs on the input
+Execution runConfigured(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel,
+                        const std::function<void(VM&)>& configure) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    VM vm(program, in, out);
+    if (configure) {
+        configure(vm);
+    }
+    vm.setFuel(fuel);
+    return runVM(vm, out);
+}
+
+Execution runReference(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runConfigured(program, input, fuel, std::function<void(VM&)>());
+}
+
+// The VM with every observer attached, which takes the instrumented
+// dispatch loop and the hooks on control flow edges
+Execution runInstrumented(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    Profiler profiler(program);
+    OpStats opstats;
+    return runConfigured(program, input, fuel, [&](VM& vm) {
+        vm.setProfiler(&profiler);
+        vm.setOpStats(&opstats);
+    });
+}
+
+Execution runOptimized(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runReference(optimize(program, 1), input, fuel);
+}
+
+Execution runInterprocedural(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runReference(optimize(program, 2), input, fuel);
+}
+
+Execution runLoopOptimized(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runReference(optimize(program, 3), input, fuel);
+}
+
+Execution runRegisters(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    RegisterProgram registers = translateToRegisters(program);
+    std::istringstream in(input);
+    std::ostringstream out;
+    RegisterVM vm(registers, in, out);
+    vm.setFuel(fuel);
+    Execution execution;
+    try {
+        vm.execute();
+    }
+    catch (const char* e) {
+        execution.error = e;
+    }
+    execution.output = out.str();
+    execution.stack = vm.getStack();
+    execution.heap = vm.getHeap();
+    return execution;
+}
+
+// Register translation of the fused instructions and variables of -O3
+Execution runRegistersOptimized(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runRegisters(optimize(program, 3), input, fuel);
+}
+
+// The residual program of specializing to the first half of the input,
+// run on the rest of it. Materializing the known state can take more
+// instructions than computing it did, so the residual gets more fuel.
+Execution runSpecialized(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    Specialization specialization = specialize(program, input.substr(0, input.size() / 2), fuel ? fuel : MAX_STATIC_STEPS);
+    return runReference(specialization.program, input.substr(specialization.consumed), 4 * fuel);
+}
+
+// The program run ahead of time until its first read
+Execution runSupercompiled(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    Supercompilation supercompiled = supercompile(program, fuel ? fuel : MAX_STATIC_STEPS);
+    return runConfigured(supercompiled.program, input, 4 * fuel, [&](VM& vm) {
+        vm.setStrings(supercompiled.strings);
+    });
+}
+
+// Calls to pure subroutines memoized in a cache small enough that entries
+// are replaced
+Execution runMemoized(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runConfigured(program, input, fuel, [](VM& vm) { vm.setMemoization(16); });
+}
+
+// Heap in the smallest paged window, which with 4 KiB pages leaves
+// addresses from 2^20 on to the hash table
+Execution runPaged(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runConfigured(program, input, fuel, [](VM& vm) { vm.setPagedHeap(1); });
+}
+
+// Operand stack between guard pages, which is checked on other platforms
+Execution runGuarded(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runConfigured(program, input, fuel, [](VM& vm) { vm.setGuardedStack(GUARDED_STACK_CAPACITY); });
+}
+
+// Operand stack in segments of a few entries, so that most programs cross
+// them
+Execution runSegmented(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    return runConfigured(program, input, fuel, [](VM& vm) { vm.setStackSegment(4); });
+}
+
+// Checkpointed every few dozen instructions, and finished again from the
+// last snapshot by a VM that keeps its heap and stack differently. It
+// resumes into the output of the first run, which it writes over from the
+// position in the snapshot.
+Execution runResumed(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+#ifndef _WIN32
+    char path[] = "/tmp/respace-snapshot-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+    }
+#else
+    char path[] = "respace-engine.snapshot";
+#endif
+    Execution first = runConfigured(program, input, fuel, [&](VM& vm) { vm.setCheckpoint(path, 61); });
+    std::istringstream in(input);
+    std::ostringstream out(first.output);
+    VM vm(program, in, out);
+    vm.setPagedHeap(1);
+    vm.setStackSegment(4);
+    vm.setFuel(fuel);
+    // A run too short for a snapshot leaves the file empty, or missing.
+    // Any other failure to restore is an error of this engine.
+    if (std::ifstream(path, std::ios::binary | std::ios::ate).tellg() <= 0) {
+        std::remove(path);
+        return first;
+    }
+    try {
+        vm.restore(path);
+    }
+    catch (const char* e) {
+        std::remove(path);
+        Execution failed;
+        failed.error = e;
+        return failed;
+    }
+    std::remove(path);
+    return runVM(vm, out);
+}
+
+// Forked from the state at the first read, or the VM where fork is not
+// supported
+Execution runForked(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel) {
+    if (!ForkServer::supported()) {
+        return runReference(program, input, fuel);
+    }
+    return ForkServer(program, fuel, true).run(input);
+}
+
+} // namespace
+
+const std::vector<Engine>& engines() {
+    static const std::vector<Engine> all{
+        {"vm", runReference},
+        {"vm-instrumented", runInstrumented},
+        {"vm-O1", runOptimized},
+        {"vm-O2", runInterprocedural},
+        {"vm-O3", runLoopOptimized},
+        {"regvm", runRegisters},
+        {"regvm-O3", runRegistersOptimized},
+        {"vm-specialized", runSpecialized},
+        {"vm-supercompiled", runSupercompiled},
+        {"vm-memoized", runMemoized},
+        {"vm-paged", runPaged},
+        {"vm-guarded", runGuarded},
+        {"vm-segmented", runSegmented},
+        {"vm-resumed", runResumed},
+        {"vm-forked", runForked}
+    };
+    return all;
+}
+
+const Engine* findEngine(const std::string& name) {
+    for (const Engine& engine : engines()) {
+        if (name == engine.name) {
+            return &engine;
+        }
+    }
+    return NULL;
+}
+
+} // namespace WS
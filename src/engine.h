@@ -0,0 +1,42 @@
+#ifndef WS_ENGINE_H_
+#define WS_ENGINE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+// Observable result of running a program to completion or to a runtime error
+struct Execution {
+    std::string output;
+    std::vector<integer_t> stack;
+    std::map<integer_t, integer_t> heap;
+    std::string error; // Empty when the program ended normally
+
+    bool operator==(const Execution& other) const {
+        return output == other.output && stack == other.stack && heap == other.heap && error == other.error;
+    }
+    bool operator!=(const Execution& other) const {
+        return !(*this == other);
+    }
+};
+
+// An execution path for programs, such as the VM itself or the VM after an
+// optimization pass. Every engine must produce the same Execution as the
+// reference VM. A nonzero fuel bounds the number of instructions executed,
+// which differs between engines, so results are only comparable when the
+// reference did not run out of fuel.
+struct Engine {
+    const char* name;
+    Execution (*run)(const std::vector<Instruction>& program, const std::string& input, unsigned long long fuel);
+};
+
+// Every available engine, with the reference VM first
+const std::vector<Engine>& engines();
+const Engine* findEngine(const std::string& name);
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,191 @@
+#include <cerrno>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "forkserver.h"
+
+namespace WS {
+
+namespace {
+
+void appendWord(std::string& message, unsigned_t word) {
+    message.append((const char*) &word, sizeof(word));
+}
+
+void appendString(std::string& message, const std::string& string) {
+    appendWord(message, string.size());
+    message.append(string);
+}
+
+// An Execution and the instructions it took, as a child sends it
+std::string encode(const Execution& execution, unsigned long long instructions) {
+    std::string message;
+    appendWord(message, instructions);
+    appendString(message, execution.output);
+    appendString(message, execution.error);
+    appendWord(message, execution.stack.size());
+    for (integer_t value : execution.stack) {
+        appendWord(message, value);
+    }
+    appendWord(message, execution.heap.size());
+    for (const std::pair<const integer_t, integer_t>& entry : execution.heap) {
+        appendWord(message, entry.first);
+        appendWord(message, entry.second);
+    }
+    return message;
+}
+
+class Decoder {
+public:
+    explicit Decoder(const std::string& message) : message_(message), next_(0) {}
+
+    unsigned_t word() {
+        unsigned_t word;
+        check(sizeof(word));
+        message_.copy((char*) &word, sizeof(word), next_);
+        next_ += sizeof(word);
+        return word;
+    }
+    std::string string() {
+        unsigned_t size = word();
+        check(size);
+        next_ += size;
+        return message_.substr(next_ - size, size);
+    }
+
+private:
+    const std::string& message_;
+    size_t next_;
+
+    void check(unsigned_t bytes) {
+        if (bytes > message_.size() - next_) {
+            throw "Fork server child failed\n";
+        }
+    }
+};
+
+Execution decode(const std::string& message, unsigned long long& instructions) {
+    Decoder decoder(message);
+    Execution execution;
+    instructions = decoder.word();
+    execution.output = decoder.string();
+    execution.error = decoder.string();
+    for (unsigned_t count = decoder.word(); count > 0; count--) {
+        execution.stack.push_back((integer_t) decoder.word());
+    }
+    for (unsigned_t count = decoder.word(); count > 0; count--) {
+        integer_t address = (integer_t) decoder.word();
+        execution.heap.emplace_hint(execution.heap.end(), address, (integer_t) decoder.word());
+    }
+    return execution;
+}
+
+} // namespace
+
+ForkServer::ForkServer(const std::vector<Instruction>& program, unsigned long long fuel, bool heaps,
+                       const std::function<void(VM&)>& configure)
+    : vm_(program, in_, out_), heaps_(heaps), reads_(false), warmup_(0), last_(0) {
+#ifdef _WIN32
+    throw "Fork server is not supported on this platform\n";
+#endif
+    vm_.setFuel(fuel);
+    if (configure) {
+        configure(vm_);
+    }
+    try {
+        reads_ = vm_.executeUntilRead();
+    }
+    catch (const char* e) {
+        finished_.error = e;
+    }
+    warmup_ = vm_.getStats().instructions;
+    if (!reads_) {
+        finished_.output = out_.str();
+        finished_.stack = vm_.getStack();
+        if (heaps_) {
+            finished_.heap = vm_.getHeap();
+        }
+    }
+}
+
+bool ForkServer::supported() {
+#ifdef _WIN32
+    return false;
+#else
+    return true;
+#endif
+}
+
+Execution ForkServer::run(const std::string& input) {
+    last_ = 0;
+    if (!reads_) {
+        return finished_;
+    }
+    std::string message;
+#ifndef _WIN32
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw "Unable to fork\n";
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        throw "Unable to fork\n";
+    }
+    if (pid == 0) {
+        // The child never returns into the caller, and leaves the stdio
+        // buffers it shares with the parent unflushed
+        close(fds[0]);
+        try {
+            in_.str(input);
+            in_.clear();
+            Execution execution;
+            try {
+                vm_.execute();
+            }
+            catch (const char* e) {
+                execution.error = e;
+            }
+            execution.output = out_.str();
+            execution.stack = vm_.getStack();
+            if (heaps_) {
+                execution.heap = vm_.getHeap();
+            }
+            message = encode(execution, vm_.getStats().instructions - warmup_);
+            for (size_t written = 0; written < message.size();) {
+                ssize_t bytes = write(fds[1], message.data() + written, message.size() - written);
+                if (bytes < 0 && errno != EINTR) {
+                    _exit(1);
+                }
+                written += bytes > 0 ? bytes : 0;
+            }
+        }
+        catch (...) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    char buffer[1 << 16];
+    for (;;) {
+        ssize_t bytes = read(fds[0], buffer, sizeof(buffer));
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        message.append(buffer, bytes);
+    }
+    close(fds[0]);
+    int status = 0;
+    pid_t waited;
+    do {
+        waited = waitpid(pid, &status, 0);
+    } while (waited < 0 && errno == EINTR);
+    if (waited != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw "Fork server child failed\n";
+    }
+#endif
+    return decode(message, last_);
+}
+
+} // namespace WS
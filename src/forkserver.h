@@ -0,0 +1,53 @@
+#ifndef WS_FORKSERVER_H_
+#define WS_FORKSERVER_H_
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "engine.h"
+#include "instruction.h"
+#include "vm.h"
+
+namespace WS {
+
+// Runs a program once up to its first read, then forks a child from that
+// state for each input, so that the heap and stacks built before the read
+// are shared copy-on-write and each input only pays for the work that
+// depends on it. A child runs to the end of the program and sends its
+// Execution back over a pipe. A program that ends or fails before reading
+// has the same Execution for every input, and forks nothing. Copying the
+// final heap back takes time in its size rather than the input's, so it is
+// only part of the Execution when asked for. The VM is configured, as by
+// setting its heap or stacks, before the run up to the read, and every
+// child inherits that configuration. Only POSIX systems support it.
+class ForkServer {
+public:
+    ForkServer(const std::vector<Instruction>& program, unsigned long long fuel = 0, bool heaps = false,
+               const std::function<void(VM&)>& configure = std::function<void(VM&)>());
+    ForkServer(const ForkServer&) = delete;
+    ForkServer& operator=(const ForkServer&) = delete;
+
+    static bool supported();
+
+    Execution run(const std::string& input);
+
+    // Instructions executed before the first read, once
+    unsigned long long warmupInstructions() const { return warmup_; }
+    // Instructions executed after the first read by the last run
+    unsigned long long lastInstructions() const { return last_; }
+
+private:
+    std::istringstream in_;
+    std::ostringstream out_;
+    VM vm_;
+    bool heaps_;
+    bool reads_; // Whether the program reached a read
+    Execution finished_; // When it did not
+    unsigned long long warmup_;
+    unsigned long long last_;
+};
+
+} // namespace WS
+
+#endif
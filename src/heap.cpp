@@ -0,0 +1,87 @@
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "heap.h"
+
+namespace WS {
+
+namespace {
+
+size_t popcount(const std::vector<unsigned_t>& bits) {
+    size_t count = 0;
+    for (unsigned_t word : bits) {
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+} // namespace
+
+PagedHeap::PagedHeap(integer_t window)
+    : values_(NULL), present_(NULL), count_(0) {
+#ifdef _WIN32
+    throw "Paged heap is not supported on this platform\n";
+#else
+    page_bytes_ = (size_t) sysconf(_SC_PAGESIZE);
+    page_cells_ = page_bytes_ / sizeof(integer_t);
+    // Whole pages of present_, which cover 64 pages of values each
+    integer_t granule = (integer_t) (page_cells_ * 64 * 64);
+    if (window < granule) {
+        window = granule;
+    }
+    if (window > PAGED_HEAP_MAX_WINDOW) {
+        window = PAGED_HEAP_MAX_WINDOW;
+    }
+    window_ = (window + granule - 1) / granule * granule;
+    base_ = -(window_ / 2);
+
+    // Reserved without access or swap, so only committed pages take memory
+    void* values = mmap(NULL, window_ * sizeof(integer_t), PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void* present = mmap(NULL, window_ / 8, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (values == MAP_FAILED || present == MAP_FAILED) {
+        if (values != MAP_FAILED) munmap(values, window_ * sizeof(integer_t));
+        if (present != MAP_FAILED) munmap(present, window_ / 8);
+        throw "Unable to reserve the paged heap\n";
+    }
+    values_ = (integer_t*) values;
+    present_ = (unsigned_t*) present;
+    value_pages_.assign(window_ / page_cells_ / 64, 0);
+    present_pages_.assign(window_ / page_cells_ / 64 / 64, 0);
+#endif
+}
+
+PagedHeap::~PagedHeap() {
+#ifndef _WIN32
+    munmap(values_, window_ * sizeof(integer_t));
+    munmap(present_, window_ / 8);
+#endif
+}
+
+std::map<integer_t, integer_t> PagedHeap::cells() const {
+    std::map<integer_t, integer_t> cells;
+    each([&](integer_t address, integer_t value) { cells.emplace_hint(cells.end(), address, value); });
+    return cells;
+}
+
+size_t PagedHeap::bytes() const {
+    return (popcount(value_pages_) + popcount(present_pages_)) * page_bytes_ +
+           (value_pages_.size() + present_pages_.size()) * sizeof(unsigned_t) +
+           outside_.size() * (2 * sizeof(void*) + sizeof(std::unordered_map<integer_t, integer_t>::value_type)) +
+           outside_.bucket_count() * sizeof(void*);
+}
+
+// Private
+
+void PagedHeap::commit(void* region, size_t page, std::vector<unsigned_t>& pages) {
+#ifndef _WIN32
+    if (mprotect((char*) region + page * page_bytes_, page_bytes_, PROT_READ | PROT_WRITE) != 0) {
+        throw "Runtime Error: Out of memory\n";
+    }
+#endif
+    pages[page / 64] |= (unsigned_t) 1 << (page % 64);
+}
+
+} // namespace WS
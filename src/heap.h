@@ -0,0 +1,107 @@
+#ifndef WS_HEAP_H_
+#define WS_HEAP_H_
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const integer_t PAGED_HEAP_WINDOW = (integer_t) 1 << 32; // Default cells of address space reserved
+const integer_t PAGED_HEAP_MAX_WINDOW = (integer_t) 1 << 36; // Keeps the page bitmap small
+
+// Heap for programs that spread their addresses widely. A window of
+// addresses centered on 0 is reserved as virtual memory without access,
+// and each page of it is committed by the first store to a cell in it, so
+// memory grows with the pages in use rather than the range of addresses.
+// Loads from a page that was never stored to read 0 without committing it.
+// A cell exists once it is stored or loaded, as in the map of the VM, which
+// a bitmap reserved the same way records. Addresses outside the window
+// fall back to a hash table.
+class PagedHeap {
+public:
+    explicit PagedHeap(integer_t window = PAGED_HEAP_WINDOW);
+    ~PagedHeap();
+    PagedHeap(const PagedHeap&) = delete;
+    PagedHeap& operator=(const PagedHeap&) = delete;
+
+    // Value of a cell, creating it as 0
+    integer_t load(integer_t address) {
+        unsigned_t index = (unsigned_t) address - (unsigned_t) base_;
+        if (index >= (unsigned_t) window_) {
+            return outside_[address];
+        }
+        mark(index);
+        return committed(value_pages_, index / page_cells_) ? values_[index] : 0;
+    }
+    // Cell to store to, creating it and committing its page
+    integer_t& at(integer_t address) {
+        unsigned_t index = (unsigned_t) address - (unsigned_t) base_;
+        if (index >= (unsigned_t) window_) {
+            return outside_[address];
+        }
+        mark(index);
+        if (!committed(value_pages_, index / page_cells_)) {
+            commit(values_, index / page_cells_, value_pages_);
+        }
+        return values_[index];
+    }
+
+    // Calls visit with the address and value of each cell, those in the
+    // window in order of address, without copying them
+    template <typename Visit> void each(Visit visit) const;
+    std::map<integer_t, integer_t> cells() const;
+    size_t size() const { return count_ + outside_.size(); }
+    integer_t window() const { return window_; }
+    // Committed pages, page bitmaps, and estimated hash table nodes
+    size_t bytes() const;
+
+private:
+    integer_t window_;
+    integer_t base_;       // Address of the first cell in the window
+    size_t page_bytes_;
+    size_t page_cells_;    // Values in a page
+    integer_t* values_;
+    unsigned_t* present_;  // Bit per cell of the window
+    std::vector<unsigned_t> value_pages_;   // Bit per committed page of values
+    std::vector<unsigned_t> present_pages_; // Bit per committed page of present_
+    size_t count_;         // Cells in the window that exist
+    std::unordered_map<integer_t, integer_t> outside_;
+
+    static bool committed(const std::vector<unsigned_t>& pages, size_t page) {
+        return (pages[page / 64] >> (page % 64)) & 1;
+    }
+    // A page of present_ holds the bits of 64 pages of values
+    void mark(unsigned_t index) {
+        if (!committed(present_pages_, index / page_cells_ / 64)) {
+            commit(present_, index / page_cells_ / 64, present_pages_);
+        }
+        unsigned_t bit = (unsigned_t) 1 << (index % 64);
+        if (!(present_[index / 64] & bit)) {
+            present_[index / 64] |= bit;
+            count_++;
+        }
+    }
+    void commit(void* region, size_t page, std::vector<unsigned_t>& pages);
+};
+
+template <typename Visit> void PagedHeap::each(Visit visit) const {
+    size_t words = page_bytes_ / sizeof(unsigned_t);
+    for (size_t page = 0; page < present_pages_.size() * 64; page++) {
+        if (!committed(present_pages_, page)) continue;
+        for (size_t word = page * words; word < (page + 1) * words; word++) {
+            for (unsigned_t bits = present_[word]; bits; bits &= bits - 1) {
+                size_t index = word * 64 + __builtin_ctzll(bits);
+                visit(base_ + (integer_t) index, committed(value_pages_, index / page_cells_) ? values_[index] : 0);
+            }
+        }
+    }
+    for (const std::pair<const integer_t, integer_t>& entry : outside_) {
+        visit(entry.first, entry.second);
+    }
+}
+
+} // namespace WS
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef WS_CONSTANTS_H_
 #define WS_CONSTANTS_H_
 
+#include <cstring>
+
 namespace WS {
 
 typedef long long integer_t;
@@ -39,10 +41,83 @@ enum InstructionType {
     // Debugging in assembly only
     DEBUG_PRINTSTACK,
     DEBUG_PRINTHEAP,
+    // Internal to the optimizer, with no Whitespace encoding
+    ADDI,     //                # Add the argument to the top item on the stack
+    SHL,      //                # Multiply the top item on the stack by 2 to the power of the argument
+    SHR,      //                # Divide the top item on the stack by 2 to the power of the argument, as div rounds
+    LOADVAR,  //                # Push the variable given by the argument
+    STOREVAR, //                # Pop the top item on the stack into the variable given by the argument
+    LOADCELL, //                # Push the heap cell at the address given by the argument
+    STORECELL, //               # Pop the top item on the stack into the heap cell at the address given by the argument
+    WRITE,    //                # Output the string given by the argument from the strings of the program
+    FASTDIV,  //                  Integer division by a divisor known to be neither 0 nor -1
+    FASTMOD,  //                  Modulo by a divisor known to be neither 0 nor -1
     // Invalid Instruction
     INVALID_INSTR = -1
 };
 
+const int INSTRUCTION_TYPE_COUNT = FASTMOD + 1;
+
+// Assembly mnemonic of an instruction type
+inline const char* mnemonic(InstructionType type) {
+    switch (type) {
+    case PUSH:     return "push";
+    case DUP:      return "dup";
+    case COPY:     return "copy";
+    case SWAP:     return "swap";
+    case DROP:     return "drop";
+    case SLIDE:    return "slide";
+
+    case ADD:      return "add";
+    case SUB:      return "sub";
+    case MUL:      return "mul";
+    case DIV:      return "div";
+    case MOD:      return "mod";
+
+    case STORE:    return "store";
+    case RETRIEVE: return "retrieve";
+
+    case LABEL:    return "label";
+    case CALL:     return "call";
+    case JMP:      return "jmp";
+    case JZ:       return "jz";
+    case JN:       return "jn";
+    case RET:      return "ret";
+    case END:      return "end";
+
+    case PRINTC:   return "printc";
+    case PRINTI:   return "printi";
+    case READC:    return "readc";
+    case READI:    return "readi";
+
+    case DEBUG_PRINTSTACK: return "debug_printstack";
+    case DEBUG_PRINTHEAP:  return "debug_printheap";
+
+    case ADDI:     return "addi";
+    case SHL:      return "shl";
+    case SHR:      return "shr";
+    case LOADVAR:  return "loadvar";
+    case STOREVAR: return "storevar";
+    case LOADCELL: return "loadcell";
+    case STORECELL: return "storecell";
+    case WRITE:    return "write";
+    case FASTDIV:  return "fastdiv";
+    case FASTMOD:  return "fastmod";
+
+    case INVALID_INSTR: break;
+    }
+    return "invalid";
+}
+
+inline InstructionType parseMnemonic(const char* name) {
+    for (int type = 0; type < INSTRUCTION_TYPE_COUNT; type++) {
+        if (strcmp(name, mnemonic((InstructionType) type)) == 0) {
+            return (InstructionType) type;
+        }
+    }
+    return INVALID_INSTR;
+}
+
 struct Instruction {
     InstructionType type;
     integer_t value;
@@ -1,13 +1,50 @@
 #define _CRT_SECURE_NO_DEPRECATE // To use fopen in VS
+#ifndef _WIN32
+#include <signal.h>
+#endif
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
 #include <vector>
+#include "cfg.h"
+#include "forkserver.h"
 #include "instruction.h"
+#include "opstats.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "specializer.h"
 #include "vm.h"
 #include "binary.h"
 
 using namespace WS;
 
+struct Options {
+    const char* program = NULL;
+    const char* profile = NULL; // JSON output path when profiling
+    const char* samples = NULL; // Folded stacks output path when sampling
+    const char* opstats = NULL; // Opcode statistics file to merge into
+    const char* stats = NULL;   // Resource usage format, "text" or "json"
+    const char* cfg = NULL;     // Graphviz output path for the control flow graph
+    int optimization = 0;
+    unsigned long long supercompile = 0; // Steps to run ahead of time, or 0
+    size_t memoize = 0;         // Entries of the cache of pure calls, or 0
+    integer_t paged_heap = 0;   // Cells reserved for the paged heap, or 0
+    size_t guarded_stack = 0;   // Entries of the guarded operand stack, or 0
+    size_t call_depth = CALL_STACK_DEPTH;
+    const char* checkpoint = NULL; // Snapshot path, written periodically or on SIGUSR1
+    unsigned long long checkpoint_every = 0; // Instructions between snapshots, or 0
+    const char* resume = NULL;  // Snapshot to resume from
+    const char* fork_server = NULL; // File listing inputs to fork a run for each
+    unsigned long long fuel = 0; // Instructions a run may execute, or 0 for no limit
+};
+
 void assemble(const char* in, const char* out) {
     FILE* in_file = fopen(in, "r");
     FILE* out_file = fopen(out, "w");
@@ -56,6 +93,17 @@ void assemble(const char* in, const char* out) {
         case DEBUG_PRINTSTACK: fprintf(out_file, "\tdebug_printstack"); break;
         case DEBUG_PRINTHEAP:  fprintf(out_file, "\tdebug_printheap"); break;
 
+        case ADDI:     fprintf(out_file, "\taddi %lld", instr.value); break;
+        case SHL:      fprintf(out_file, "\tshl %lld", instr.value); break;
+        case SHR:      fprintf(out_file, "\tshr %lld", instr.value); break;
+        case LOADVAR:  fprintf(out_file, "\tloadvar %lld", instr.value); break;
+        case STOREVAR: fprintf(out_file, "\tstorevar %lld", instr.value); break;
+        case LOADCELL: fprintf(out_file, "\tloadcell %lld", instr.value); break;
+        case STORECELL: fprintf(out_file, "\tstorecell %lld", instr.value); break;
+        case WRITE:    fprintf(out_file, "\twrite %lld", instr.value); break;
+        case FASTDIV:  fprintf(out_file, "\tfastdiv"); break;
+        case FASTMOD:  fprintf(out_file, "\tfastmod"); break;
+
         case INVALID_INSTR: if (!parser.isEOF()) fprintf(out_file, "ERROR!"); break;
         }
         fputc('\n', out_file);
@@ -65,17 +113,196 @@ void assemble(const char* in, const char* out) {
     fclose(out_file);
 }
 
-void interpret(const char* in) {
+std::vector<Instruction> parseFile(const char* in, std::vector<SourcePosition>* positions = NULL) {
     FILE* in_file = fopen(in, "r");
+    if (!in_file) {
+        throw "Unable to open program\n";
+    }
     Parser parser(in_file);
     std::vector<Instruction> instructions;
     Instruction instr;
     while (parser.next(instr)) {
         instructions.push_back(instr);
+        if (positions) {
+            positions->push_back(parser.position());
+        }
     }
-    VM vm(instructions);
-    vm.execute();
     fclose(in_file);
+    return instructions;
+}
+
+void writeProfile(const Profiler& profiler, const char* path) {
+    std::cout.flush();
+    profiler.writeReport(std::cerr);
+    std::ofstream json(path);
+    profiler.writeJSON(json);
+    std::cerr << "\nProfile written to " << path << '\n';
+}
+
+void writeSamples(Sampler& sampler, const char* path) {
+    sampler.stop();
+    std::ofstream folded(path);
+    sampler.writeFolded(folded);
+    std::cerr << sampler.samples() << " samples (" << sampler.dropped() << " dropped) written to " << path << '\n';
+}
+
+void writeOpStats(OpStats& opstats, const char* path) {
+    std::ifstream previous(path);
+    opstats.load(previous);
+    previous.close();
+    std::ofstream out(path);
+    opstats.save(out);
+}
+
+void writeStats(const VMStats& stats, const char* format) {
+    std::cout.flush();
+    if (strcmp(format, "json") == 0) {
+        std::cerr << "{\"instructions\": " << stats.instructions
+                  << ", \"peak_stack\": " << stats.peak_stack
+                  << ", \"peak_call_depth\": " << stats.peak_call_depth
+                  << ", \"heap_cells\": " << stats.heap_cells
+                  << ", \"heap_bytes\": " << stats.heap_bytes
+                  << ", \"allocations\": " << stats.allocations
+                  << ", \"memo_hits\": " << stats.memo_hits
+                  << ", \"memo_misses\": " << stats.memo_misses
+                  << ", \"wall_seconds\": " << stats.wall_seconds << "}\n";
+        return;
+    }
+    std::cerr << "Instructions:    " << stats.instructions << '\n'
+              << "Peak stack:      " << stats.peak_stack << '\n'
+              << "Peak call depth: " << stats.peak_call_depth << '\n'
+              << "Heap cells:      " << stats.heap_cells << " (" << stats.heap_bytes << " bytes)\n"
+              << "Allocations:     " << stats.allocations << '\n'
+              << "Memoized calls:  " << stats.memo_hits << " hits, " << stats.memo_misses << " misses\n"
+              << "Wall time:       " << stats.wall_seconds << " s\n";
+}
+
+#ifndef _WIN32
+void handleCheckpointSignal(int) {
+    VM::requestCheckpoint();
+}
+#endif
+
+// Parses, supercompiles, and optimizes the program as the options ask
+std::vector<Instruction> loadProgram(const Options& options, std::vector<SourcePosition>& positions,
+                                     std::vector<std::string>& strings) {
+    std::vector<Instruction> instructions = parseFile(options.program, options.profile ? &positions : NULL);
+    if (options.supercompile) {
+        Supercompilation supercompiled = supercompile(instructions, options.supercompile);
+        instructions = supercompiled.program;
+        strings = supercompiled.strings;
+        positions.clear();
+    }
+    if (options.optimization > 0) {
+        // Optimized instructions no longer correspond to source positions
+        instructions = optimize(instructions, options.optimization);
+        positions.clear();
+    }
+    if (options.cfg) {
+        std::ofstream dot(options.cfg);
+        CFG(instructions).writeDot(dot);
+    }
+    return instructions;
+}
+
+// Applies the options that only change how the VM runs the program
+void configure(VM& vm, const Options& options, const std::vector<std::string>& strings) {
+    vm.setFuel(options.fuel);
+    vm.setStrings(strings);
+    vm.setMemoization(options.memoize);
+    vm.setPagedHeap(options.paged_heap);
+    vm.setGuardedStack(options.guarded_stack);
+    vm.setCallStackDepth(options.call_depth);
+}
+
+void interpret(const Options& options) {
+    std::vector<SourcePosition> positions;
+    std::vector<std::string> strings;
+    std::vector<Instruction> instructions = loadProgram(options, positions, strings);
+    VM vm(instructions);
+    configure(vm, options, strings);
+    if (options.checkpoint) {
+        vm.setCheckpoint(options.checkpoint, options.checkpoint_every);
+#ifndef _WIN32
+        struct sigaction action;
+        action.sa_handler = handleCheckpointSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+#endif
+    }
+    if (options.resume) {
+        vm.restore(options.resume);
+    }
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<Sampler> sampler;
+    std::unique_ptr<OpStats> opstats;
+    if (options.profile) {
+        profiler.reset(new Profiler(instructions, positions));
+        vm.setProfiler(profiler.get());
+    }
+    if (options.samples) {
+        sampler.reset(new Sampler(instructions));
+        vm.setSampler(sampler.get());
+        sampler->start();
+    }
+    if (options.opstats) {
+        opstats.reset(new OpStats());
+        vm.setOpStats(opstats.get());
+    }
+    auto finish = [&]() {
+        if (profiler) writeProfile(*profiler, options.profile);
+        if (sampler) writeSamples(*sampler, options.samples);
+        if (opstats) writeOpStats(*opstats, options.opstats);
+        if (options.stats) writeStats(vm.getStats(), options.stats);
+    };
+    try {
+        vm.execute();
+    }
+    catch (const char* e) {
+        finish();
+        throw;
+    }
+    finish();
+}
+
+// Runs the program once up to its first read, then forks it for each input
+// file listed one per line, writing the output of each to its path with
+// .out appended. Each child inherits the configured VM, but profiles,
+// samples, and snapshots taken in a child would be lost with it.
+void serve(const Options& options) {
+    if (options.profile || options.samples || options.opstats || options.checkpoint || options.resume) {
+        throw "--profile, --sample, --opstats, --checkpoint, and --resume cannot be used with --fork-server\n";
+    }
+    std::vector<SourcePosition> positions;
+    std::vector<std::string> strings;
+    std::vector<Instruction> instructions = loadProgram(options, positions, strings);
+    ForkServer server(instructions, options.fuel, false, [&](VM& vm) {
+        configure(vm, options, strings);
+    });
+    std::ifstream list(options.fork_server);
+    if (!list) {
+        throw "Unable to open input list\n";
+    }
+    std::string path;
+    while (std::getline(list, path)) {
+        if (path.empty()) continue;
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file) {
+            std::cerr << path << ": Unable to open input\n";
+            continue;
+        }
+        std::string input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        Execution execution = server.run(input);
+        std::ofstream((path + ".out").c_str(), std::ios::binary) << execution.output;
+        if (!execution.error.empty()) {
+            std::cerr << path << ": ERROR: " << execution.error;
+        }
+        if (options.stats) {
+            std::cerr << path << ": " << server.lastInstructions() << " instructions after "
+                      << server.warmupInstructions() << " shared\n";
+        }
+    }
 }
 
 void count(int min, int max) {
@@ -118,9 +345,98 @@ void fromBinary(const char* in, const char* out) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc > 1) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            options.profile = "respace-profile.json";
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            options.profile = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--sample") == 0) {
+            options.samples = "respace-samples.folded";
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            options.samples = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--opstats") == 0) {
+            options.opstats = "respace-opstats.txt";
+        }
+        else if (strncmp(argv[i], "--opstats=", 10) == 0) {
+            options.opstats = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = "text";
+        }
+        else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            options.stats = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "-O", 2) == 0) {
+            options.optimization = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        }
+        else if (strcmp(argv[i], "--supercompile") == 0) {
+            options.supercompile = MAX_STATIC_STEPS;
+        }
+        else if (strncmp(argv[i], "--supercompile=", 15) == 0) {
+            options.supercompile = strtoull(argv[i] + 15, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--memoize") == 0) {
+            options.memoize = MEMO_CACHE_SIZE;
+        }
+        else if (strncmp(argv[i], "--memoize=", 10) == 0) {
+            options.memoize = strtoull(argv[i] + 10, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--paged-heap") == 0) {
+            options.paged_heap = PAGED_HEAP_WINDOW;
+        }
+        else if (strncmp(argv[i], "--paged-heap=", 13) == 0) {
+            options.paged_heap = strtoll(argv[i] + 13, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--guarded-stack") == 0) {
+            options.guarded_stack = GUARDED_STACK_CAPACITY;
+        }
+        else if (strncmp(argv[i], "--guarded-stack=", 16) == 0) {
+            options.guarded_stack = strtoull(argv[i] + 16, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--fuel=", 7) == 0) {
+            options.fuel = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--call-depth=", 13) == 0) {
+            options.call_depth = strtoull(argv[i] + 13, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0) {
+            options.checkpoint = "respace.snapshot";
+        }
+        else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            options.checkpoint = argv[i] + 13;
+        }
+        else if (strncmp(argv[i], "--checkpoint-every=", 19) == 0) {
+            options.checkpoint_every = strtoull(argv[i] + 19, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--resume=", 9) == 0) {
+            options.resume = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--fork-server=", 14) == 0) {
+            options.fork_server = argv[i] + 14;
+        }
+        else if (strcmp(argv[i], "--cfg") == 0) {
+            options.cfg = "respace-cfg.dot";
+        }
+        else if (strncmp(argv[i], "--cfg=", 6) == 0) {
+            options.cfg = argv[i] + 6;
+        }
+        else {
+            options.program = argv[i];
+        }
+    }
+    if (options.program) {
         try {
-            interpret(argv[1]);
+            if (options.fork_server) {
+                serve(options);
+            }
+            else {
+                interpret(options);
+            }
         }
         catch (const char* e) {
             printf("ERROR: %s", e);
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <unordered_map>
+#include "memo.h"
+
+namespace WS {
+
+namespace {
+
+const int MAX_ROUNDS = 64; // Rounds of growing stack effects before checking them as they are
+
+// Entries an instruction reads below the top of the stack, and how it
+// changes the height, or false for anything that is not pure stack code
+bool stackUse(const Instruction& instr, long& reads, long& change) {
+    switch (instr.type) {
+    case LABEL:  reads = 0; change = 0; return true;
+    case PUSH:   reads = 0; change = 1; return true;
+    case DUP:    reads = 1; change = 1; return true;
+    case SWAP:   reads = 2; change = 0; return true;
+    // Drop does nothing on an empty stack, so it counts as a read to keep
+    // that from depending on entries below the arguments
+    case DROP:   reads = 1; change = -1; return true;
+    case COPY:
+        if (instr.value < 0) return false;
+        reads = (long) instr.value + 1; change = 1; return true;
+    case SLIDE:
+        if (instr.value < 0) return false;
+        reads = (long) instr.value + 1; change = -(long) instr.value; return true;
+    case ADD: case SUB: case MUL: case DIV: case MOD: case FASTDIV: case FASTMOD:
+        reads = 2; change = -1; return true;
+    case ADDI: case SHL: case SHR:
+        reads = 1; change = 0; return true;
+    default:
+        return false;
+    }
+}
+
+// Walks the instructions of a subroutine from its entry, without following
+// calls, given the stack effects of its callees
+class Walk {
+public:
+    bool pure = true;
+    bool complete = true; // False when a callee had no stack effect yet
+    bool returns = false;
+    long need = 0;
+    long delta = 0;
+
+    Walk(const std::vector<Instruction>& program, const std::unordered_map<integer_t, size_t>& labels,
+         const std::map<integer_t, PureSubroutine>& effects, bool optimistic)
+        : program_(program), labels_(labels), effects_(effects), optimistic_(optimistic) {}
+
+    void run(size_t entry) {
+        heights_[entry] = 0;
+        work_.push_back(entry);
+        while (pure && !work_.empty()) {
+            size_t pc = work_.back();
+            work_.pop_back();
+            follow(pc, heights_[pc]);
+        }
+    }
+
+private:
+    const std::vector<Instruction>& program_;
+    const std::unordered_map<integer_t, size_t>& labels_;
+    const std::map<integer_t, PureSubroutine>& effects_;
+    bool optimistic_;
+    std::unordered_map<size_t, long> heights_;
+    std::vector<size_t> work_;
+
+    void read(long reads, long height) {
+        if (reads - height > need) {
+            need = reads - height;
+        }
+    }
+
+    bool target(integer_t label, size_t& pc) {
+        std::unordered_map<integer_t, size_t>::const_iterator it = labels_.find(label);
+        if (it == labels_.end()) {
+            pure = false;
+            return false;
+        }
+        pc = it->second;
+        return true;
+    }
+
+    void reach(size_t pc, long height) {
+        std::unordered_map<size_t, long>::iterator it = heights_.find(pc);
+        if (it == heights_.end()) {
+            heights_[pc] = height;
+            work_.push_back(pc);
+        }
+        else if (it->second != height) {
+            pure = false;
+        }
+    }
+
+    // Runs straight-line code from pc until control leaves it
+    void follow(size_t pc, long height) {
+        while (pure) {
+            if (pc >= program_.size()) {
+                pure = false;
+                return;
+            }
+            const Instruction& instr = program_[pc];
+            long reads, change;
+            size_t next;
+            switch (instr.type) {
+            case CALL: {
+                if (!target(instr.value, next)) return;
+                std::map<integer_t, PureSubroutine>::const_iterator effect = effects_.find(instr.value);
+                if (effect == effects_.end()) {
+                    if (optimistic_) {
+                        complete = false;
+                    }
+                    else {
+                        pure = false;
+                    }
+                    return;
+                }
+                read(effect->second.args, height);
+                height += (long) effect->second.results - (long) effect->second.args;
+                break;
+            }
+            case JMP:
+                if (target(instr.value, next)) {
+                    reach(next, height);
+                }
+                return;
+            case JZ:
+            case JN:
+                read(1, height);
+                height--;
+                if (target(instr.value, next)) {
+                    reach(next, height);
+                    reach(pc + 1, height);
+                }
+                return;
+            case RET:
+                if (returns && delta != height) {
+                    pure = false;
+                }
+                returns = true;
+                delta = height;
+                return;
+            default:
+                if (!stackUse(instr, reads, change)) {
+                    pure = false;
+                    return;
+                }
+                read(reads, height);
+                height += change;
+                break;
+            }
+            pc++;
+            if (pc < program_.size() && program_[pc].type == LABEL) {
+                // Labels are reached along several paths, so they keep a height
+                reach(pc, height);
+                return;
+            }
+        }
+    }
+};
+
+} // namespace
+
+std::map<integer_t, PureSubroutine> findPureSubroutines(const std::vector<Instruction>& program) {
+    std::unordered_map<integer_t, size_t> labels;
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        if (program[pc].type == LABEL) {
+            labels[program[pc].value] = pc;
+        }
+    }
+    std::map<integer_t, bool> candidates; // Called labels, and whether they may still be pure
+    for (const Instruction& instr : program) {
+        if (instr.type == CALL && labels.count(instr.value)) {
+            candidates[instr.value] = true;
+        }
+    }
+
+    // Stack effects grow from the paths that return without recursing,
+    // assuming nothing about callees without an effect yet
+    std::map<integer_t, PureSubroutine> effects;
+    bool changed = true;
+    for (int round = 0; changed && round < MAX_ROUNDS; round++) {
+        changed = false;
+        for (std::pair<const integer_t, bool>& candidate : candidates) {
+            if (!candidate.second) continue;
+            Walk walk(program, labels, effects, true);
+            walk.run(labels[candidate.first]);
+            if (!walk.pure || (walk.complete && !walk.returns)) {
+                candidate.second = false;
+                effects.erase(candidate.first);
+                changed = true;
+            }
+            else if (walk.returns) {
+                PureSubroutine effect{(size_t) walk.need, (size_t) (walk.need + walk.delta)};
+                std::map<integer_t, PureSubroutine>::iterator it = effects.find(candidate.first);
+                if (it == effects.end() || it->second.args != effect.args || it->second.results != effect.results) {
+                    effects[candidate.first] = effect;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Then each effect must follow from the effects of its callees, or it
+    // is dropped, until they are consistent, so that by induction on the
+    // depth of calls every call that returns has its effect
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (std::map<integer_t, PureSubroutine>::iterator it = effects.begin(); it != effects.end();) {
+            Walk walk(program, labels, effects, false);
+            walk.run(labels[it->first]);
+            if (!walk.pure || !walk.returns || (size_t) walk.need != it->second.args ||
+                (size_t) (walk.need + walk.delta) != it->second.results) {
+                it = effects.erase(it);
+                changed = true;
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    return effects;
+}
+
+MemoCache::MemoCache(size_t entries) : entries_(entries ? entries : 1) {}
+
+const std::vector<integer_t>* MemoCache::find(integer_t label, const integer_t* args, size_t count) const {
+    const Entry& entry = entries_[slot(label, args, count)];
+    if (!entry.used || entry.label != label || entry.args.size() != count ||
+        !std::equal(entry.args.begin(), entry.args.end(), args)) {
+        return NULL;
+    }
+    return &entry.results;
+}
+
+void MemoCache::insert(integer_t label, const integer_t* args, size_t count,
+                       const integer_t* results, size_t result_count) {
+    Entry& entry = entries_[slot(label, args, count)];
+    entry.used = true;
+    entry.label = label;
+    entry.args.assign(args, args + count);
+    entry.results.assign(results, results + result_count);
+}
+
+// Private
+
+size_t MemoCache::slot(integer_t label, const integer_t* args, size_t count) const {
+    unsigned long long hash = 14695981039346656037ull ^ (unsigned long long) label;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ (unsigned long long) args[i]) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    hash *= 1099511628211ull;
+    return (size_t) (hash ^ (hash >> 32)) % entries_.size();
+}
+
+} // namespace WS
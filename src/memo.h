@@ -0,0 +1,57 @@
+#ifndef WS_MEMO_H_
+#define WS_MEMO_H_
+
+#include <map>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const size_t MEMO_CACHE_SIZE = 1 << 12; // Default entries of the call cache
+
+// Stack effect of a subroutine that only computes on the stack
+struct PureSubroutine {
+    size_t args;    // Entries below the top of the stack that it reads or pops
+    size_t results; // Entries that replace them on return
+};
+
+// Classifies the subroutines that calls resolve to as pure when, for any
+// stack with at least args entries, a call only replaces the top args
+// entries with results entries that depend on nothing else. A pure
+// subroutine has no I/O, heap access, variables, debug output, or end,
+// and does not run off the end of the program. Its stack height is the
+// same at each instruction however it is reached, and the same at each of
+// its rets, and it only calls pure subroutines, so recursion is resolved
+// to a fixed point. Errors within it, such as division by zero, depend
+// only on its arguments too. Labels defined more than once resolve to
+// their last definition, as in the VM, and undefined labels are impure.
+std::map<integer_t, PureSubroutine> findPureSubroutines(const std::vector<Instruction>& program);
+
+// Results of calls to pure subroutines by label and arguments. Each key
+// hashes to a single entry, which a later call with a different key
+// replaces, so the cache stays at a fixed number of entries.
+class MemoCache {
+public:
+    explicit MemoCache(size_t entries = MEMO_CACHE_SIZE);
+
+    // Results of an earlier call with these arguments, with the bottom of
+    // the stack first, or NULL
+    const std::vector<integer_t>* find(integer_t label, const integer_t* args, size_t count) const;
+    void insert(integer_t label, const integer_t* args, size_t count,
+                const integer_t* results, size_t result_count);
+
+private:
+    struct Entry {
+        bool used = false;
+        integer_t label = 0;
+        std::vector<integer_t> args;
+        std::vector<integer_t> results;
+    };
+    std::vector<Entry> entries_;
+
+    size_t slot(integer_t label, const integer_t* args, size_t count) const;
+};
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,119 @@
+#include <sstream>
+#include <string>
+#include "opstats.h"
+
+namespace WS {
+
+const int OpStats::N;
+const int OpStats::NONE;
+
+OpStats::OpStats() : singles_(N), pairs_(N * N), triples_(N * N * N), branches_((N + 1) * (N + 1) * 2 * 2) {}
+
+void OpStats::finish(size_t pc) {
+    if (branch_ >= 0) {
+        branches_[branch_ * 2 + (pc == last_pc_ + 1)]++;
+    }
+    runs_++;
+    last_pc_ = -2;
+    prev1_ = prev2_ = branch_ = -1;
+}
+
+unsigned long long OpStats::runs() const {
+    return runs_;
+}
+
+unsigned long long OpStats::count(InstructionType a) const {
+    return singles_[a];
+}
+
+unsigned long long OpStats::count(InstructionType a, InstructionType b) const {
+    return pairs_[a * N + b];
+}
+
+unsigned long long OpStats::count(InstructionType a, InstructionType b, InstructionType c) const {
+    return triples_[(a * N + b) * N + c];
+}
+
+unsigned long long OpStats::branches(int a, int b, InstructionType branch, bool taken) const {
+    return branches_[((a * (N + 1) + b) * 2 + (branch == JN)) * 2 + !taken];
+}
+
+void OpStats::load(std::istream& in) {
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind, name;
+        fields >> kind;
+        int n = kind == "op" ? 1 : kind == "pair" ? 2 : kind == "triple" || kind == "branch" ? 3 : 0;
+        if (kind == "runs") {
+            unsigned long long runs;
+            if (fields >> runs) runs_ += runs;
+            continue;
+        }
+        int ops[3];
+        bool valid = n > 0;
+        for (int i = 0; i < n && valid; i++) {
+            fields >> name;
+            ops[i] = name == "-" && kind == "branch" ? NONE : parseMnemonic(name.c_str());
+            valid = ops[i] != INVALID_INSTR;
+        }
+        unsigned long long a, b;
+        if (!valid || !(fields >> a)) {
+            continue;
+        }
+        if (kind == "op") {
+            singles_[ops[0]] += a;
+        }
+        else if (kind == "pair") {
+            pairs_[ops[0] * N + ops[1]] += a;
+        }
+        else if (kind == "triple") {
+            triples_[(ops[0] * N + ops[1]) * N + ops[2]] += a;
+        }
+        else if ((ops[2] == JZ || ops[2] == JN) && fields >> b) {
+            int pattern = (ops[0] * (N + 1) + ops[1]) * 2 + (ops[2] == JN);
+            branches_[pattern * 2] += a;
+            branches_[pattern * 2 + 1] += b;
+        }
+    }
+}
+
+void OpStats::save(std::ostream& out) const {
+    out << "runs " << runs_ << '\n';
+    for (int a = 0; a < N; a++) {
+        if (singles_[a]) {
+            out << "op " << mnemonic((InstructionType) a) << ' ' << singles_[a] << '\n';
+        }
+    }
+    for (int a = 0; a < N; a++) {
+        for (int b = 0; b < N; b++) {
+            if (pairs_[a * N + b]) {
+                out << "pair " << mnemonic((InstructionType) a) << ' ' << mnemonic((InstructionType) b)
+                    << ' ' << pairs_[a * N + b] << '\n';
+            }
+        }
+    }
+    for (int a = 0; a < N; a++) {
+        for (int b = 0; b < N; b++) {
+            for (int c = 0; c < N; c++) {
+                unsigned long long count = triples_[(a * N + b) * N + c];
+                if (count) {
+                    out << "triple " << mnemonic((InstructionType) a) << ' ' << mnemonic((InstructionType) b)
+                        << ' ' << mnemonic((InstructionType) c) << ' ' << count << '\n';
+                }
+            }
+        }
+    }
+    for (int pattern = 0; pattern < (N + 1) * (N + 1) * 2; pattern++) {
+        unsigned long long taken = branches_[pattern * 2], not_taken = branches_[pattern * 2 + 1];
+        if (taken + not_taken == 0) {
+            continue;
+        }
+        int a = pattern / 2 / (N + 1), b = pattern / 2 % (N + 1);
+        out << "branch " << (a == NONE ? "-" : mnemonic((InstructionType) a)) << ' '
+            << (b == NONE ? "-" : mnemonic((InstructionType) b)) << ' ' << (pattern % 2 ? "jn" : "jz")
+            << ' ' << taken << ' ' << not_taken << '\n';
+    }
+}
+
+} // namespace WS
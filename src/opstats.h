@@ -0,0 +1,76 @@
+#ifndef WS_OPSTATS_H_
+#define WS_OPSTATS_H_
+
+#include <istream>
+#include <ostream>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+// Dynamic frequencies of opcodes, opcode pairs and triples, and the two
+// opcodes leading up to each conditional branch with its direction. N-grams
+// only span instructions that are adjacent in the program and executed in
+// sequence, so each one is a candidate superinstruction. Statistics from
+// several runs are merged by loading the previous file before saving.
+class OpStats {
+public:
+    static const int N = INSTRUCTION_TYPE_COUNT;
+    static const int NONE = N; // No preceding instruction in a branch pattern
+
+    OpStats();
+
+    void record(size_t pc, InstructionType type) {
+        if (pc != last_pc_ + 1) {
+            if (branch_ >= 0) {
+                branches_[branch_ * 2]++; // Taken
+            }
+            prev1_ = prev2_ = -1;
+        }
+        else if (branch_ >= 0) {
+            branches_[branch_ * 2 + 1]++; // Not taken
+        }
+        branch_ = -1;
+        singles_[type]++;
+        if (prev1_ >= 0) {
+            pairs_[prev1_ * N + type]++;
+            if (prev2_ >= 0) {
+                triples_[(prev2_ * N + prev1_) * N + type]++;
+            }
+        }
+        if (type == JZ || type == JN) {
+            branch_ = ((prev2_ < 0 ? NONE : prev2_) * (N + 1) + (prev1_ < 0 ? NONE : prev1_)) * 2 + (type == JN);
+        }
+        prev2_ = prev1_;
+        prev1_ = type;
+        last_pc_ = pc;
+    }
+    // Close the run, attributing a final branch that fell off the program
+    void finish(size_t pc);
+
+    unsigned long long runs() const;
+    unsigned long long count(InstructionType a) const;
+    unsigned long long count(InstructionType a, InstructionType b) const;
+    unsigned long long count(InstructionType a, InstructionType b, InstructionType c) const;
+    // Executions of branch after a and b (or NONE) that were or were not taken
+    unsigned long long branches(int a, int b, InstructionType branch, bool taken) const;
+
+    void load(std::istream& in);
+    void save(std::ostream& out) const;
+
+private:
+    std::vector<unsigned long long> singles_;
+    std::vector<unsigned long long> pairs_;
+    std::vector<unsigned long long> triples_;
+    std::vector<unsigned long long> branches_; // Taken and not taken per pattern
+    unsigned long long runs_ = 0;
+
+    size_t last_pc_ = -2;
+    int prev1_ = -1;
+    int prev2_ = -1;
+    int branch_ = -1;
+};
+
+} // namespace WS
+
+#endif
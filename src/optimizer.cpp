@@ -0,0 +1,1107 @@
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include "cfg.h"
+#include "optimizer.h"
+#include "ranges.h"
+
+namespace WS {
+
+namespace {
+
+// Stack slots below the top that the folder keeps track of
+const size_t MAX_SLOTS = 64;
+
+bool isArithmetic(InstructionType type) {
+    return type == ADD || type == SUB || type == MUL || type == DIV || type == MOD || type == FASTDIV || type == FASTMOD;
+}
+
+bool endsBlock(InstructionType type) {
+    return type == CALL || type == JMP || type == JZ || type == JN || type == RET || type == END;
+}
+
+// Arithmetic with the wrapping behaviour of the VM. The divisor is nonzero.
+integer_t evaluate(InstructionType op, integer_t lhs, integer_t rhs) {
+    switch (op) {
+    case ADD: return (integer_t) ((unsigned_t) lhs + (unsigned_t) rhs);
+    case SUB: return (integer_t) ((unsigned_t) lhs - (unsigned_t) rhs);
+    case MUL: return (integer_t) ((unsigned_t) lhs * (unsigned_t) rhs);
+    case DIV: return rhs == -1 ? (integer_t) (0 - (unsigned_t) lhs) : lhs / rhs;
+    case MOD: return rhs == -1 ? 0 : lhs % rhs;
+    default:  return 0;
+    }
+}
+
+// Folds the straight-line stack code between barriers, which are control
+// flow, heap access, I/O, and any instruction that could fail. A segment of
+// symbolic instructions becomes a graph of values over the stack slots known
+// to exist at its start, so it cannot raise a runtime error, and is
+// replaced by regenerated code when that is shorter. Barriers are kept as
+// they are, so errors happen at the same instruction with the same stack.
+class BlockFolder {
+public:
+    explicit BlockFolder(std::vector<Instruction>& out) : out_(out) {
+        startSegment();
+    }
+
+    void instruction(const Instruction& instr) {
+        if (symbolic(instr)) {
+            segment_.push_back(instr);
+            return;
+        }
+        if ((instr.type == JZ || instr.type == JN) && foldBranch(instr)) {
+            return;
+        }
+        flush();
+        out_.push_back(instr);
+        // Only fallthrough reaches the instruction after a branch that is
+        // not a label, so the slots below the condition stay known
+        if (instr.type == LABEL || (endsBlock(instr.type) && instr.type != JZ && instr.type != JN)) {
+            slots_.clear();
+        }
+        else {
+            effect(instr);
+        }
+        startSegment();
+    }
+
+    void finish() {
+        flush();
+    }
+
+private:
+    struct Slot {
+        bool known;
+        integer_t constant;
+    };
+
+    struct Value {
+        InstructionType op; // PUSH for a constant, COPY for a slot, or arithmetic
+        bool known;         // Whether the value is the constant
+        integer_t constant;
+        size_t lhs;         // Operands for arithmetic, or the depth of the slot
+        size_t rhs;
+    };
+
+    std::vector<Instruction>& out_;
+    std::vector<Slot> slots_;       // Stack slots known to exist, bottom first
+    std::vector<Value> values_;
+    std::vector<size_t> stack_;     // Values on the stack, bottom first
+    std::vector<Instruction> segment_;
+
+    void startSegment() {
+        values_.clear();
+        stack_.clear();
+        segment_.clear();
+        for (size_t i = 0; i < slots_.size(); i++) {
+            const Slot& slot = slots_[i];
+            stack_.push_back(add(Value{COPY, slot.known, slot.constant, slots_.size() - 1 - i, 0}));
+        }
+    }
+
+    size_t add(const Value& value) {
+        values_.push_back(value);
+        return values_.size() - 1;
+    }
+
+    size_t constant(integer_t c) {
+        return add(Value{PUSH, true, c, 0, 0});
+    }
+
+    // Returns NONE for a division that might be by zero
+    size_t arithmetic(InstructionType op, size_t lhs, size_t rhs) {
+        const Value& l = values_[lhs];
+        const Value& r = values_[rhs];
+        if ((op == DIV || op == MOD) && (!r.known || r.constant == 0)) {
+            return CFG::NONE;
+        }
+        if (l.known && r.known) {
+            return constant(evaluate(op, l.constant, r.constant));
+        }
+        switch (op) {
+        case ADD:
+            if (r.known && r.constant == 0) return lhs;
+            if (l.known && l.constant == 0) return rhs;
+            break;
+        case SUB:
+            if (r.known && r.constant == 0) return lhs;
+            break;
+        case MUL:
+            if ((r.known && r.constant == 0) || (l.known && l.constant == 0)) return constant(0);
+            if (r.known && r.constant == 1) return lhs;
+            if (l.known && l.constant == 1) return rhs;
+            break;
+        case DIV:
+            if (r.constant == 1) return lhs;
+            break;
+        case MOD:
+            if (r.constant == 1 || r.constant == -1) return constant(0);
+            break;
+        default:
+            break;
+        }
+        return add(Value{op, false, 0, lhs, rhs});
+    }
+
+    // Applies a stack instruction to the value graph, or returns false if
+    // it is a barrier
+    bool symbolic(const Instruction& instr) {
+        size_t size = stack_.size();
+        switch (instr.type) {
+        case PUSH:
+            stack_.push_back(constant(instr.value));
+            return true;
+        case DUP:
+            if (size < 1) return false;
+            stack_.push_back(stack_.back());
+            return true;
+        case COPY:
+            if (instr.value < 0 || (unsigned_t) instr.value >= size) return false;
+            stack_.push_back(stack_[size - 1 - instr.value]);
+            return true;
+        case SWAP:
+            if (size < 2) return false;
+            std::swap(stack_[size - 1], stack_[size - 2]);
+            return true;
+        case DROP:
+            if (size < 1) return false;
+            stack_.pop_back();
+            return true;
+        case SLIDE:
+            if (instr.value < 0 || (unsigned_t) instr.value >= size) return false;
+            stack_.erase(stack_.end() - instr.value - 1, stack_.end() - 1);
+            return true;
+        case ADD: case SUB: case MUL: case DIV: case MOD: {
+            if (size < 2) return false;
+            size_t result = arithmetic(instr.type, stack_[size - 2], stack_[size - 1]);
+            if (result == CFG::NONE) return false;
+            stack_.resize(size - 2);
+            stack_.push_back(result);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // A branch on a constant becomes a jump or nothing, when the code for
+    // the segment without the condition is no longer than before
+    bool foldBranch(const Instruction& instr) {
+        if (stack_.empty() || !values_[stack_.back()].known) {
+            return false;
+        }
+        size_t top = stack_.back();
+        integer_t condition = values_[top].constant;
+        bool taken = instr.type == JZ ? condition == 0 : condition < 0;
+        stack_.pop_back();
+        std::vector<Instruction> code;
+        if (!regenerate(code) || code.size() + taken > segment_.size() + 1) {
+            stack_.push_back(top);
+            return false;
+        }
+        out_.insert(out_.end(), code.begin(), code.end());
+        if (taken) {
+            out_.push_back(Instruction(JMP, instr.value));
+        }
+        slots_.clear();
+        startSegment();
+        return true;
+    }
+
+    // Emits the segment as regenerated or original code, whichever is
+    // shorter, and records which slots are known afterwards
+    void flush() {
+        std::vector<Instruction> code;
+        if (!regenerate(code) || code.size() >= segment_.size()) {
+            code = segment_;
+        }
+        out_.insert(out_.end(), code.begin(), code.end());
+
+        size_t kept = unchangedSlots();
+        slots_.resize(kept);
+        for (size_t i = kept; i < stack_.size(); i++) {
+            const Value& value = values_[stack_[i]];
+            slots_.push_back(Slot{value.known, value.constant});
+        }
+        if (slots_.size() > MAX_SLOTS) {
+            slots_.erase(slots_.begin(), slots_.end() - MAX_SLOTS);
+        }
+    }
+
+    // Slots at the bottom of the segment that it leaves in place
+    size_t unchangedSlots() const {
+        size_t kept = 0;
+        while (kept < slots_.size() && kept < stack_.size() && stack_[kept] == kept) {
+            kept++;
+        }
+        return kept;
+    }
+
+    // Stack code computing the values on the stack from the slots at the
+    // start of the segment. Slots below the first changed one are left in
+    // place, and the ones above it removed, which is only possible with a
+    // single instruction when at most one value replaces them.
+    bool regenerate(std::vector<Instruction>& code) {
+        size_t kept = unchangedSlots();
+        size_t removed = slots_.size() - kept;
+        size_t results = stack_.size() - kept;
+        if (removed > 0 && results > 1) {
+            return false;
+        }
+        std::unordered_map<size_t, size_t> pushed; // Top-level values by height
+        size_t height = 0;
+        for (size_t i = kept; i < stack_.size(); i++) {
+            std::unordered_map<size_t, size_t>::const_iterator earlier = pushed.find(stack_[i]);
+            if (earlier != pushed.end()) {
+                copy(code, height - 1 - earlier->second);
+                height++;
+            }
+            else {
+                emit(code, stack_[i], height);
+            }
+            pushed[stack_[i]] = height - 1;
+        }
+        if (removed > 0 && results == 1) {
+            code.push_back(Instruction(SLIDE, removed));
+        }
+        for (size_t i = 0; removed > 0 && results == 0 && i < removed; i++) {
+            code.push_back(DROP);
+        }
+        return true;
+    }
+
+    void emit(std::vector<Instruction>& code, size_t id, size_t& height) {
+        const Value& value = values_[id];
+        if (value.known) {
+            code.push_back(Instruction(PUSH, value.constant));
+            height++;
+        }
+        else if (value.op == COPY) {
+            copy(code, value.lhs + height);
+            height++;
+        }
+        else {
+            emit(code, value.lhs, height);
+            emit(code, value.rhs, height);
+            code.push_back(value.op);
+            height--;
+        }
+    }
+
+    void copy(std::vector<Instruction>& code, size_t depth) {
+        code.push_back(depth == 0 ? Instruction(DUP) : Instruction(COPY, depth));
+    }
+
+    // Updates the known slots after a barrier that completed. Any operands
+    // it needed must have existed, and its results are unknown.
+    void effect(const Instruction& instr) {
+        size_t need = 0, pops = 0, pushes = 0;
+        switch (instr.type) {
+        case DUP:      need = 1; pushes = 1; break;
+        case COPY:     need = instr.value + 1; pushes = 1; break;
+        case SWAP:     need = pops = pushes = 2; break;
+        case DROP:     pops = slots_.empty() ? 0 : 1; break;
+        case SLIDE:    need = pops = instr.value + 1; pushes = 1; break;
+        case STORE:    need = pops = 2; break;
+        case RETRIEVE: case ADDI: case SHL: case SHR: need = pops = pushes = 1; break;
+        case LOADVAR: case LOADCELL: pushes = 1; break;
+        case PRINTC: case PRINTI: case READC: case READI: case JZ: case JN: case STOREVAR: case STORECELL:
+            need = pops = 1;
+            break;
+        default:
+            if (isArithmetic(instr.type)) {
+                need = pops = 2;
+                pushes = 1;
+            }
+            break;
+        }
+        size_t known = slots_.size();
+        size_t below = std::max(known, need) - pops;
+        size_t survivors = known > pops ? known - pops : 0;
+        std::vector<Slot> after(std::min(below - survivors, MAX_SLOTS), Slot{false, 0});
+        after.insert(after.end(), slots_.begin(), slots_.begin() + survivors);
+        after.insert(after.end(), pushes, Slot{false, 0});
+        if (after.size() > MAX_SLOTS) {
+            after.erase(after.begin(), after.end() - MAX_SLOTS);
+        }
+        slots_ = after;
+    }
+};
+
+// Label each jump resolves to, as in the VM: the last definition wins
+std::unordered_map<integer_t, size_t> labelDefinitions(const std::vector<Instruction>& program) {
+    std::unordered_map<integer_t, size_t> labels;
+    for (size_t i = 0; i < program.size(); i++) {
+        if (program[i].type == LABEL) {
+            labels[program[i].value] = i;
+        }
+    }
+    return labels;
+}
+
+bool isJump(InstructionType type) {
+    return type == CALL || type == JMP || type == JZ || type == JN;
+}
+
+// First label number that no instruction uses, or false when every one
+// after the largest is taken
+bool freshLabel(const std::vector<Instruction>& program, integer_t& fresh) {
+    integer_t largest = 0;
+    for (const Instruction& instr : program) {
+        if (instr.type == LABEL || isJump(instr.type)) {
+            largest = std::max(largest, instr.value);
+        }
+    }
+    if (largest == std::numeric_limits<integer_t>::max()) {
+        return false;
+    }
+    fresh = largest + 1;
+    return true;
+}
+
+// Blocks of a subroutine that can be copied to its call sites, in program
+// order, or none when it cannot be
+std::vector<size_t> inlineBody(const CFG& cfg, size_t s) {
+    std::vector<size_t> body;
+    std::vector<bool> seen(cfg.size(), false);
+    size_t size = 0;
+    size_t entry = cfg.subroutines()[s].entry;
+    seen[entry] = true;
+    body.push_back(entry);
+    for (size_t i = 0; i < body.size(); i++) {
+        size_t b = body[i];
+        size += cfg.block(b).end - cfg.block(b).start;
+        if (cfg.subroutineOf(b) != s || size > MAX_INLINE_SIZE) {
+            return std::vector<size_t>();
+        }
+        for (const Edge& edge : cfg.successors(b)) {
+            if (edge.kind == EDGE_CALL || (edge.to == CFG::EXIT && edge.kind != EDGE_EXIT)) {
+                return std::vector<size_t>();
+            }
+            if (edge.to != CFG::EXIT && !seen[edge.to]) {
+                seen[edge.to] = true;
+                body.push_back(edge.to);
+            }
+        }
+    }
+    std::sort(body.begin(), body.end());
+    return body;
+}
+
+// Exponent of a power of two from 2 to 2^62, or 0
+integer_t log2(integer_t value) {
+    integer_t shift = 0;
+    if (value < 2 || (value & (value - 1)) != 0) {
+        return 0;
+    }
+    while (value > 1) {
+        value >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+// Heap cells a loop may change, from the addresses of its stores and reads
+// as far as pushes and stack shuffles within each block determine them
+struct LoopWrites {
+    bool unknown; // A store to an unknown address, or a call
+    std::unordered_set<integer_t> cells;
+};
+
+LoopWrites loopWrites(const std::vector<Instruction>& program, const CFG& cfg, const CFG::Loop& loop) {
+    struct Known {
+        bool known;
+        integer_t value;
+    };
+    LoopWrites writes{false, std::unordered_set<integer_t>()};
+    for (size_t b : loop.blocks) {
+        std::vector<Known> stack;
+        auto pop = [&]() {
+            Known top{false, 0};
+            if (!stack.empty()) {
+                top = stack.back();
+                stack.pop_back();
+            }
+            return top;
+        };
+        auto write = [&](const Known& address) {
+            if (address.known) writes.cells.insert(address.value);
+            else writes.unknown = true;
+        };
+        for (size_t pc = cfg.block(b).start; pc < cfg.block(b).end; pc++) {
+            const Instruction& instr = program[pc];
+            size_t size = stack.size();
+            switch (instr.type) {
+            case PUSH:
+                stack.push_back(Known{true, instr.value});
+                break;
+            case DUP: case COPY:
+                if (instr.type == DUP || (instr.value >= 0 && (unsigned_t) instr.value < size)) {
+                    stack.push_back(size > 0 ? stack[size - 1 - (instr.type == COPY ? instr.value : 0)] : Known{false, 0});
+                }
+                else {
+                    stack.push_back(Known{false, 0});
+                }
+                break;
+            case SWAP: {
+                Known a = pop();
+                Known b = pop();
+                stack.push_back(a);
+                stack.push_back(b);
+                break;
+            }
+            case SLIDE: {
+                Known top = pop();
+                for (integer_t i = 0; i < instr.value; i++) {
+                    pop();
+                }
+                stack.push_back(top);
+                break;
+            }
+            case STORE:
+                pop();
+                write(pop());
+                break;
+            case READC: case READI:
+                write(pop());
+                break;
+            case STORECELL:
+                pop();
+                write(Known{true, instr.value});
+                break;
+            case CALL:
+                writes.unknown = true;
+                break;
+            case DROP: case PRINTC: case PRINTI: case STOREVAR: case JZ: case JN:
+                pop();
+                break;
+            case RETRIEVE: case ADDI: case SHL: case SHR:
+                pop();
+                stack.push_back(Known{false, 0});
+                break;
+            case LOADVAR: case LOADCELL:
+                stack.push_back(Known{false, 0});
+                break;
+            default:
+                if (isArithmetic(instr.type)) {
+                    pop();
+                    pop();
+                    stack.push_back(Known{false, 0});
+                }
+                break;
+            }
+        }
+    }
+    return writes;
+}
+
+// Whether the instructions strictly between the push of an address and the
+// heap access that takes it leave that stack entry alone, and cannot fail
+// while it is on the stack, so that the push can be removed and the access
+// given the address instead. Afterwards there must be depth entries above
+// the address, which are the value for a store.
+bool leavesAddress(const std::vector<Instruction>& program, size_t push, size_t access, integer_t depth) {
+    integer_t height = 0; // Entries above the address
+    for (size_t pc = push + 1; pc < access; pc++) {
+        const Instruction& instr = program[pc];
+        integer_t need = 0, pops = 0, pushes = 0;
+        switch (instr.type) {
+        case PUSH: case LOADVAR: case LOADCELL: pushes = 1; break;
+        case DUP:      need = 1; pushes = 1; break;
+        case COPY:     need = instr.value + 1; pushes = 1; break;
+        case SWAP:     need = pops = pushes = 2; break;
+        case SLIDE:    need = pops = instr.value + 1; pushes = 1; break;
+        case ADD: case SUB: case MUL: case FASTDIV: case FASTMOD: need = pops = 2; pushes = 1; break;
+        case STORE:    need = pops = 2; break;
+        case RETRIEVE: case ADDI: case SHL: case SHR: need = pops = pushes = 1; break;
+        case DROP: case PRINTC: case PRINTI: case READC: case READI: case STOREVAR: case STORECELL:
+            need = pops = 1;
+            break;
+        default:
+            return false; // Division, or an instruction that shows the stack
+        }
+        if ((instr.type == COPY || instr.type == SLIDE) && instr.value < 0) {
+            return false;
+        }
+        if (need > height) {
+            return false;
+        }
+        height += pushes - pops;
+    }
+    return height == depth;
+}
+
+// Block a jump or branch at the end of a block goes to
+size_t jumpTarget(const CFG& cfg, size_t b) {
+    for (const Edge& edge : cfg.successors(b)) {
+        if (edge.kind == EDGE_JUMP || edge.kind == EDGE_TAKEN) {
+            return edge.to;
+        }
+    }
+    return CFG::NONE;
+}
+
+} // namespace
+
+std::vector<Instruction> optimize(const std::vector<Instruction>& program, int level) {
+    std::vector<Instruction> optimized = program;
+    if (level <= 0) {
+        return optimized;
+    }
+    for (int pass = 0; pass < 16; pass++) {
+        std::vector<Instruction> next = optimized;
+        if (level >= 2) {
+            next = eliminateTailCalls(inlineSubroutines(next));
+        }
+        next = removeUnreachable(foldBlocks(removeUnreferencedLabels(next)));
+        if (next.size() == optimized.size() && std::equal(next.begin(), next.end(), optimized.begin(),
+                [](const Instruction& a, const Instruction& b) { return a.type == b.type && a.value == b.value; })) {
+            break;
+        }
+        optimized.swap(next);
+    }
+    if (level >= 3) {
+        optimized = removeUnreachable(narrowRanges(optimized));
+        optimized = reduceStrength(promoteCells(hoistInvariantLoads(optimized)));
+    }
+    return optimized;
+}
+
+std::vector<Instruction> foldBlocks(const std::vector<Instruction>& program) {
+    std::vector<Instruction> folded;
+    folded.reserve(program.size());
+    BlockFolder folder(folded);
+    for (const Instruction& instr : program) {
+        folder.instruction(instr);
+    }
+    folder.finish();
+    return folded;
+}
+
+std::vector<Instruction> removeUnreferencedLabels(const std::vector<Instruction>& program) {
+    std::unordered_map<integer_t, size_t> labels = labelDefinitions(program);
+    std::vector<bool> referenced(program.size(), false);
+    for (size_t i = 0; i < program.size(); i++) {
+        const Instruction& instr = program[i];
+        if (instr.type == CALL || instr.type == JMP || instr.type == JZ || instr.type == JN) {
+            std::unordered_map<integer_t, size_t>::const_iterator label = labels.find(instr.value);
+            if (label != labels.end()) {
+                referenced[label->second] = true;
+            }
+        }
+    }
+    std::vector<Instruction> kept;
+    kept.reserve(program.size());
+    for (size_t i = 0; i < program.size(); i++) {
+        const Instruction& instr = program[i];
+        if (instr.type == LABEL && !referenced[i]) {
+            continue;
+        }
+        // The jump is removed but not its target, which is only dropped
+        // by the next pass once nothing else references it
+        if (instr.type == JMP && i + 1 < program.size() && program[i + 1].type == LABEL) {
+            std::unordered_map<integer_t, size_t>::const_iterator label = labels.find(instr.value);
+            if (label != labels.end() && label->second == i + 1) {
+                continue;
+            }
+        }
+        kept.push_back(instr);
+    }
+    return kept;
+}
+
+std::vector<Instruction> narrowRanges(const std::vector<Instruction>& program) {
+    RangeAnalysis ranges(program);
+    std::vector<Instruction> narrowed;
+    narrowed.reserve(program.size());
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        const Instruction& instr = program[pc];
+        Range top;
+        if (!ranges.top(pc, top)) {
+            narrowed.push_back(instr);
+            continue;
+        }
+        if (instr.type == JZ || instr.type == JN) {
+            bool always = instr.type == JZ ? top.min == 0 && top.max == 0 : top.max < 0;
+            bool never = instr.type == JZ ? !top.contains(0) : top.min >= 0;
+            if (always || never) {
+                narrowed.push_back(DROP);
+                if (always) {
+                    narrowed.push_back(Instruction(JMP, instr.value));
+                }
+                continue;
+            }
+        }
+        if ((instr.type == DIV || instr.type == MOD) && !top.contains(0) && !top.contains(-1)) {
+            narrowed.push_back(instr.type == DIV ? FASTDIV : FASTMOD);
+            continue;
+        }
+        narrowed.push_back(instr);
+    }
+    return narrowed;
+}
+
+std::vector<Instruction> removeUnreachable(const std::vector<Instruction>& program) {
+    CFG cfg(program);
+    std::vector<bool> reachable(cfg.size(), false);
+    std::vector<size_t> worklist;
+    if (cfg.size() > 0) {
+        reachable[0] = true;
+        worklist.push_back(0);
+    }
+    while (!worklist.empty()) {
+        size_t b = worklist.back();
+        worklist.pop_back();
+        for (const Edge& edge : cfg.successors(b)) {
+            if (edge.to != CFG::EXIT && !reachable[edge.to]) {
+                reachable[edge.to] = true;
+                worklist.push_back(edge.to);
+            }
+        }
+    }
+    std::vector<Instruction> kept;
+    kept.reserve(program.size());
+    for (size_t b = 0; b < cfg.size(); b++) {
+        if (reachable[b]) {
+            kept.insert(kept.end(), program.begin() + cfg.block(b).start, program.begin() + cfg.block(b).end);
+        }
+    }
+    return kept;
+}
+
+std::vector<Instruction> inlineSubroutines(const std::vector<Instruction>& program) {
+    integer_t fresh;
+    if (!freshLabel(program, fresh)) {
+        return program;
+    }
+    CFG cfg(program);
+    std::vector<std::vector<size_t>> bodies(cfg.subroutines().size());
+    std::vector<size_t> callee(program.size(), CFG::NONE); // Subroutine inlined at each call
+    for (size_t s = 1; s < cfg.subroutines().size(); s++) {
+        bodies[s] = inlineBody(cfg, s);
+        if (!bodies[s].empty()) {
+            for (size_t b : cfg.subroutines()[s].calls) {
+                callee[cfg.block(b).end - 1] = s;
+            }
+        }
+    }
+
+    std::vector<Instruction> inlined;
+    inlined.reserve(program.size());
+    std::vector<integer_t> labels(cfg.size());
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        if (callee[pc] == CFG::NONE) {
+            inlined.push_back(program[pc]);
+            continue;
+        }
+        // Labels are renamed, so jumps in the copy stay within it
+        const std::vector<size_t>& body = bodies[callee[pc]];
+        for (size_t b : body) {
+            labels[b] = fresh++;
+        }
+        integer_t after = fresh++;
+        for (size_t b : body) {
+            const CFG::Block& block = cfg.block(b);
+            for (size_t i = block.start; i < block.end; i++) {
+                Instruction instr = program[i];
+                if (instr.type == LABEL) {
+                    instr.value = labels[b];
+                }
+                else if (instr.type == JMP || instr.type == JZ || instr.type == JN) {
+                    instr.value = labels[jumpTarget(cfg, b)];
+                }
+                else if (instr.type == RET) {
+                    instr = Instruction(JMP, after);
+                }
+                inlined.push_back(instr);
+            }
+        }
+        inlined.push_back(Instruction(LABEL, after));
+    }
+    return inlined;
+}
+
+std::vector<Instruction> eliminateTailCalls(const std::vector<Instruction>& program) {
+    const int MAX_HOPS = 8;
+    CFG cfg(program);
+    std::vector<Instruction> eliminated = program;
+    for (size_t b = 0; b < cfg.size(); b++) {
+        size_t call = cfg.block(b).end - 1;
+        if (program[call].type != CALL) {
+            continue;
+        }
+        // Follow the continuation through labels and jumps to a ret
+        size_t next = b + 1 < cfg.size() ? b + 1 : CFG::EXIT;
+        for (int hop = 0; hop < MAX_HOPS && next != CFG::EXIT; hop++) {
+            const CFG::Block& block = cfg.block(next);
+            size_t pc = block.start;
+            while (pc < block.end && program[pc].type == LABEL) {
+                pc++;
+            }
+            if (pc == block.end) {
+                next = next + 1 < cfg.size() ? next + 1 : CFG::EXIT;
+            }
+            else if (program[pc].type == JMP) {
+                next = jumpTarget(cfg, next);
+            }
+            else {
+                if (program[pc].type == RET) {
+                    eliminated[call].type = JMP;
+                }
+                break;
+            }
+        }
+    }
+    return eliminated;
+}
+
+std::vector<Instruction> hoistInvariantLoads(const std::vector<Instruction>& program) {
+    std::vector<Instruction> hoisted = program;
+    integer_t var = 0;
+    for (const Instruction& instr : program) {
+        if (instr.type == LOADVAR || instr.type == STOREVAR) {
+            var = std::max(var, instr.value + 1);
+        }
+    }
+    // Each round hoists out of one loop, outer loops first, and so out of
+    // every loop nested in it
+    for (int round = 0; round < 64; round++) {
+        integer_t fresh;
+        if (!freshLabel(hoisted, fresh)) {
+            break;
+        }
+        CFG cfg(hoisted);
+        bool changed = false;
+        for (const CFG::Loop& loop : cfg.loops()) {
+            const CFG::Block& header = cfg.block(loop.header);
+            if (hoisted[header.start].type != LABEL) {
+                continue;
+            }
+            bool jumps_back = true;
+            std::vector<bool> in_loop(cfg.size(), false);
+            for (size_t b : loop.blocks) {
+                in_loop[b] = true;
+            }
+            for (const Edge& edge : cfg.predecessors(loop.header)) {
+                if (in_loop[edge.from] && edge.kind != EDGE_JUMP && edge.kind != EDGE_TAKEN) {
+                    jumps_back = false;
+                }
+            }
+            if (!jumps_back) {
+                continue;
+            }
+            // Loads at the start of the header run on entry to the loop, so
+            // loading them once before it creates the same heap cells
+            LoopWrites writes = loopWrites(hoisted, cfg, loop);
+            std::vector<integer_t> cells;
+            for (size_t pc = header.start + 1; pc + 1 < header.end; pc += 2) {
+                if (hoisted[pc].type != PUSH || hoisted[pc + 1].type != RETRIEVE) {
+                    break;
+                }
+                if (!writes.unknown && !writes.cells.count(hoisted[pc].value) &&
+                    std::find(cells.begin(), cells.end(), hoisted[pc].value) == cells.end()) {
+                    cells.push_back(hoisted[pc].value);
+                }
+            }
+
+            // Expressions of constants, those cells, and variables the loop
+            // never stores, built with arithmetic that cannot fail, are
+            // computed once before the loop too. A callee could store any
+            // variable.
+            std::unordered_set<integer_t> stored;
+            bool calls = false;
+            for (size_t b : loop.blocks) {
+                for (size_t pc = cfg.block(b).start; pc < cfg.block(b).end; pc++) {
+                    if (hoisted[pc].type == STOREVAR) stored.insert(hoisted[pc].value);
+                    calls |= hoisted[pc].type == CALL;
+                }
+            }
+            auto leaf = [&](size_t pc, size_t end, bool& invariant) -> size_t {
+                const Instruction& instr = hoisted[pc];
+                if (instr.type == PUSH && pc + 1 < end && hoisted[pc + 1].type == RETRIEVE) {
+                    if (std::find(cells.begin(), cells.end(), instr.value) == cells.end()) {
+                        return 0;
+                    }
+                    invariant = true;
+                    return 2;
+                }
+                if (instr.type == LOADVAR) {
+                    if (calls || stored.count(instr.value)) {
+                        return 0;
+                    }
+                    invariant = true;
+                    return 1;
+                }
+                return instr.type == PUSH ? 1 : 0;
+            };
+            struct Expression {
+                size_t end;
+                integer_t var;
+            };
+            std::unordered_map<size_t, Expression> expressions; // By first instruction
+            std::vector<size_t> order;
+            for (size_t b : loop.blocks) {
+                size_t end = cfg.block(b).end;
+                for (size_t pc = cfg.block(b).start; pc < end; pc++) {
+                    bool invariant = false;
+                    size_t next = pc + leaf(pc, end, invariant);
+                    size_t operations = 0;
+                    while (next > pc && next < end) {
+                        InstructionType op = hoisted[next].type;
+                        bool operand = false;
+                        size_t length = leaf(next, end, operand);
+                        if (op == ADDI || op == SHL || op == SHR) {
+                            next++;
+                        }
+                        else if (length > 0 && next + length < end &&
+                                 (hoisted[next + length].type == ADD || hoisted[next + length].type == SUB ||
+                                  hoisted[next + length].type == MUL)) {
+                            next += length + 1;
+                            invariant |= operand;
+                        }
+                        else {
+                            break;
+                        }
+                        operations++;
+                    }
+                    // Expressions of constants alone are left to folding
+                    if (operations > 0 && invariant) {
+                        expressions[pc] = Expression{next, 0};
+                        order.push_back(pc);
+                        pc = next - 1;
+                    }
+                }
+            }
+            if (cells.empty() && expressions.empty()) {
+                continue;
+            }
+
+            // The preheader takes the label of the header, so only the back
+            // edges, which are jumps from within the loop, go to the header
+            integer_t label = hoisted[header.start].value;
+            integer_t body = fresh;
+            std::vector<integer_t> vars(cells.size());
+            std::vector<Instruction> next;
+            next.reserve(hoisted.size() + 4 * cells.size());
+            for (size_t b = 0; b < cfg.size(); b++) {
+                const CFG::Block& block = cfg.block(b);
+                if (b == loop.header) {
+                    next.push_back(Instruction(LABEL, label));
+                    for (size_t i = 0; i < cells.size(); i++) {
+                        vars[i] = var++;
+                        next.push_back(Instruction(PUSH, cells[i]));
+                        next.push_back(RETRIEVE);
+                        next.push_back(Instruction(STOREVAR, vars[i]));
+                    }
+                    for (size_t start : order) {
+                        Expression& expression = expressions[start];
+                        expression.var = var++;
+                        for (size_t pc = start; pc < expression.end; pc++) {
+                            if (hoisted[pc].type == PUSH && hoisted[pc + 1].type == RETRIEVE) {
+                                size_t cell = std::find(cells.begin(), cells.end(), hoisted[pc].value) - cells.begin();
+                                next.push_back(Instruction(LOADVAR, vars[cell]));
+                                pc++;
+                            }
+                            else {
+                                next.push_back(hoisted[pc]);
+                            }
+                        }
+                        next.push_back(Instruction(STOREVAR, expression.var));
+                    }
+                }
+                for (size_t pc = block.start; pc < block.end; pc++) {
+                    Instruction instr = hoisted[pc];
+                    std::unordered_map<size_t, Expression>::const_iterator expression = expressions.find(pc);
+                    if (expression != expressions.end()) {
+                        next.push_back(Instruction(LOADVAR, expression->second.var));
+                        pc = expression->second.end - 1;
+                        continue;
+                    }
+                    if (in_loop[b]) {
+                        if (pc == header.start) {
+                            instr.value = body;
+                        }
+                        else if ((instr.type == JMP || instr.type == JZ || instr.type == JN) && instr.value == label) {
+                            instr.value = body;
+                        }
+                        else if (instr.type == PUSH && pc + 1 < block.end && hoisted[pc + 1].type == RETRIEVE) {
+                            std::vector<integer_t>::const_iterator cell = std::find(cells.begin(), cells.end(), instr.value);
+                            if (cell != cells.end()) {
+                                next.push_back(Instruction(LOADVAR, vars[cell - cells.begin()]));
+                                pc++;
+                                continue;
+                            }
+                        }
+                    }
+                    next.push_back(instr);
+                }
+            }
+            hoisted.swap(next);
+            changed = true;
+            break;
+        }
+        if (!changed) {
+            break;
+        }
+    }
+    return hoisted;
+}
+
+std::vector<Instruction> promoteCells(const std::vector<Instruction>& program) {
+    struct Known {
+        bool known;
+        integer_t value;
+        size_t push; // Push that put this entry on the stack, or NONE for a copy
+    };
+    CFG cfg(program);
+    std::vector<size_t> address_push(program.size(), CFG::NONE);
+    std::unordered_map<integer_t, bool> promotable;
+    for (size_t b = 0; b < cfg.size(); b++) {
+        std::vector<Known> stack;
+        auto pop = [&]() {
+            Known top{false, 0, CFG::NONE};
+            if (!stack.empty()) {
+                top = stack.back();
+                stack.pop_back();
+            }
+            return top;
+        };
+        // Any access at an address that is not a constant could reach any
+        // cell, so none can be promoted
+        bool unknown = false;
+        auto access = [&](size_t pc, const Known& address, integer_t depth) {
+            if (!address.known) {
+                unknown = true;
+            }
+            else if (program[pc].type != READC && program[pc].type != READI &&
+                     address.push != CFG::NONE && leavesAddress(program, address.push, pc, depth)) {
+                address_push[pc] = address.push;
+                promotable.insert(std::make_pair(address.value, true));
+            }
+            else {
+                promotable[address.value] = false;
+            }
+        };
+        for (size_t pc = cfg.block(b).start; pc < cfg.block(b).end; pc++) {
+            const Instruction& instr = program[pc];
+            size_t size = stack.size();
+            switch (instr.type) {
+            case PUSH:
+                stack.push_back(Known{true, instr.value, pc});
+                break;
+            case DUP: case COPY: {
+                Known copy{false, 0, CFG::NONE};
+                if (instr.type == DUP || (instr.value >= 0 && (unsigned_t) instr.value < size)) {
+                    if (size > 0) {
+                        copy = stack[size - 1 - (instr.type == COPY ? instr.value : 0)];
+                        copy.push = CFG::NONE;
+                    }
+                }
+                stack.push_back(copy);
+                break;
+            }
+            case SWAP: {
+                Known a = pop();
+                Known b = pop();
+                stack.push_back(a);
+                stack.push_back(b);
+                break;
+            }
+            case SLIDE: {
+                Known top = pop();
+                for (integer_t i = 0; i < instr.value; i++) {
+                    pop();
+                }
+                stack.push_back(top);
+                break;
+            }
+            case STORE: {
+                pop();
+                Known address = pop();
+                access(pc, address, 1);
+                break;
+            }
+            case RETRIEVE: {
+                Known address = pop();
+                access(pc, address, 0);
+                stack.push_back(Known{false, 0, CFG::NONE});
+                break;
+            }
+            case READC: case READI:
+                access(pc, pop(), 0);
+                break;
+            case DROP: case PRINTC: case PRINTI: case STOREVAR: case STORECELL: case JZ: case JN:
+                pop();
+                break;
+            case ADDI: case SHL: case SHR:
+                pop();
+                stack.push_back(Known{false, 0, CFG::NONE});
+                break;
+            case LOADVAR: case LOADCELL:
+                stack.push_back(Known{false, 0, CFG::NONE});
+                break;
+            default:
+                if (isArithmetic(instr.type)) {
+                    pop();
+                    pop();
+                    stack.push_back(Known{false, 0, CFG::NONE});
+                }
+                break;
+            }
+        }
+        if (unknown) {
+            return program;
+        }
+    }
+
+    // Each promoted access drops the push of its address, and every access
+    // to a promoted cell is promoted, so the heap map never holds it
+    std::vector<bool> removed(program.size(), false);
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        if (address_push[pc] != CFG::NONE && promotable[program[address_push[pc]].value]) {
+            removed[address_push[pc]] = true;
+        }
+    }
+    std::vector<Instruction> promoted;
+    promoted.reserve(program.size());
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        const Instruction& instr = program[pc];
+        if (removed[pc]) {
+            continue;
+        }
+        if (address_push[pc] != CFG::NONE && removed[address_push[pc]]) {
+            promoted.push_back(Instruction(instr.type == STORE ? STORECELL : LOADCELL, program[address_push[pc]].value));
+        }
+        else {
+            promoted.push_back(instr);
+        }
+    }
+    return promoted;
+}
+
+std::vector<Instruction> reduceStrength(const std::vector<Instruction>& program) {
+    std::vector<Instruction> reduced;
+    reduced.reserve(program.size());
+    for (size_t pc = 0; pc < program.size(); pc++) {
+        const Instruction& instr = program[pc];
+        if (instr.type == PUSH && pc + 1 < program.size()) {
+            InstructionType op = program[pc + 1].type;
+            integer_t shift = log2(instr.value);
+            if (op == ADD || op == SUB) {
+                reduced.push_back(Instruction(ADDI, op == ADD ? instr.value : (integer_t) (0 - (unsigned_t) instr.value)));
+                pc++;
+                continue;
+            }
+            if ((op == MUL || op == DIV || op == FASTDIV) && shift) {
+                reduced.push_back(Instruction(op == MUL ? SHL : SHR, shift));
+                pc++;
+                continue;
+            }
+        }
+        reduced.push_back(instr);
+    }
+    return reduced;
+}
+
+} // namespace WS
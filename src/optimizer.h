@@ -0,0 +1,84 @@
+#ifndef WS_OPTIMIZER_H_
+#define WS_OPTIMIZER_H_
+
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const int MAX_OPTIMIZATION_LEVEL = 3;
+const size_t MAX_INLINE_SIZE = 16;
+
+// Rewrites a program between the parser and the VM. Level 0 returns it
+// unchanged. Level 1 folds each basic block and removes unreferenced labels
+// and unreachable blocks, repeating until nothing changes. Level 2 also
+// inlines subroutines and eliminates tail calls on each pass. Optimized
+// programs produce the same output, final stack, final heap, and runtime
+// errors as the original, though they execute fewer instructions and may
+// use less of the call stack. Level 3 then narrows ranges, hoists
+// loop-invariant heap loads, promotes heap cells, and reduces strength,
+// which introduces internal instructions that have no Whitespace encoding.
+std::vector<Instruction> optimize(const std::vector<Instruction>& program, int level);
+
+// Builds a value graph of the stack operations in each basic block, in
+// which constants fold, copies propagate, and dead values disappear, then
+// regenerates stack code for it wherever that is shorter. Conditional
+// branches on constants become jumps or fall through.
+std::vector<Instruction> foldBlocks(const std::vector<Instruction>& program);
+
+// Removes labels that no jump or call resolves to, including all but the
+// last definition of a duplicated label, and jumps to the next instruction
+std::vector<Instruction> removeUnreferencedLabels(const std::vector<Instruction>& program);
+
+// Replaces each call to a subroutine of at most MAX_INLINE_SIZE
+// instructions that makes no calls of its own with a copy of its body, in
+// which each ret jumps past the copy. Subroutines sharing code with others
+// or running off the end of the program are not inlined. Inlining repeats
+// across passes, so callers become leaves once their callees are inlined.
+std::vector<Instruction> inlineSubroutines(const std::vector<Instruction>& program);
+
+// Replaces each call followed by a ret, possibly through labels and jumps,
+// with a jump to the subroutine, which returns to the caller's caller
+// itself. Self tail recursion thereby becomes a loop in constant call stack.
+std::vector<Instruction> eliminateTailCalls(const std::vector<Instruction>& program);
+
+// Loads each heap cell that a loop cannot store to, and that is loaded
+// at the start of its header, into a variable before the loop, and
+// replaces its loads within the loop with the variable. A loop with a
+// call, or with a store or read whose address is not a constant, keeps
+// its loads. Arithmetic that cannot fail on constant pushes, those cells,
+// and variables the loop never stores is likewise computed into a
+// variable before the loop, so each such expression costs the loop one
+// loadvar.
+std::vector<Instruction> hoistInvariantLoads(const std::vector<Instruction>& program);
+
+// Promotes the heap cells of a program in which every store, retrieve, and
+// read has a constant address, as far as pushes and stack shuffles within
+// each block determine it. Each access to a cell becomes loadcell or
+// storecell when its address is pushed in the same block and the
+// instructions in between leave it alone, and a cell is promoted only when
+// all of its accesses are, so the VM keeps it in a slot apart from the
+// heap map and getHeap merges it back in.
+std::vector<Instruction> promoteCells(const std::vector<Instruction>& program);
+
+// Replaces constant operands with fused instructions: push and add or sub
+// with addi, as in the step of a counting loop, and push and mul or div
+// by a power of two with a shift. Since the constant divisor is nonzero,
+// none of them can fail except by underflow, which leaves the stack as
+// the instructions it replaces would.
+std::vector<Instruction> reduceStrength(const std::vector<Instruction>& program);
+
+// Uses the value ranges of RangeAnalysis to decide branches, which become
+// a drop, and a jump when taken, and to replace divisions and modulos by a
+// divisor that is neither 0 nor -1 with fastdiv and fastmod, which skip
+// those checks in the VM and need no stack flush in register code. Only
+// instructions whose operand is known to exist are changed, so underflow
+// still fails at the same instruction.
+std::vector<Instruction> narrowRanges(const std::vector<Instruction>& program);
+
+// Removes blocks not reachable from the first instruction along any edge
+std::vector<Instruction> removeUnreachable(const std::vector<Instruction>& program);
+
+} // namespace WS
+
+#endif
@@ -6,8 +6,9 @@ namespace WS {
 Parser::Parser(FILE* stream) : stream_(stream) {}
 
 Instruction Parser::next() {
-    char c;
-    switch (c = nextChar()) {
+    char c = nextChar();
+    instr_position_ = char_position_;
+    switch (c) {
     case ' ': return parseStack();     // [Space]      Stack Manipulation
     case '\t':
         switch (c = nextChar()) {
@@ -37,6 +38,11 @@ bool Parser::isEOF() const {
     return isEOF_;
 }
 
+// Position of the first character of the most recently parsed instruction
+SourcePosition Parser::position() const {
+    return instr_position_;
+}
+
 // Private
 
 Instruction Parser::parseStack() {
@@ -143,8 +149,10 @@ char Parser::nextChar() {
         switch (c = getc(stream_)) {
         case ' ':
         case '\t':
+            char_position_ = SourcePosition(line_, col_);
             return c;
         case '\n':
+            char_position_ = SourcePosition(line_, col_);
             line_++;
             col_ = 0;
             return c;
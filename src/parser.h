@@ -14,6 +14,13 @@ struct ParseException {
     ParseException(const char* what, size_t line, size_t col) : what(what), line(line), col(col) {}
 };
 
+struct SourcePosition {
+    size_t line;
+    size_t col;
+
+    SourcePosition(size_t line = 0, size_t col = 0) : line(line), col(col) {}
+};
+
 class Parser {
 public:
     Parser(FILE* stream);
@@ -21,11 +28,14 @@ public:
     Instruction next();
     bool next(Instruction& instr);
     bool isEOF() const;
+    SourcePosition position() const;
 
 private:
     FILE* stream_;
     size_t line_ = 1;
     size_t col_ = 0;
+    SourcePosition char_position_;
+    SourcePosition instr_position_;
     bool isEOF_ = false;
 
     Instruction parseStack();
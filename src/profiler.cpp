@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <iomanip>
+#include "profiler.h"
+
+namespace WS {
+
+Profiler::Profiler(const std::vector<Instruction>& instructions, const std::vector<SourcePosition>& positions)
+    : instructions_(instructions), positions_(positions), block_of_(instructions.size()) {
+    // A block starts at the beginning, at each label, and after each
+    // instruction that transfers control
+    bool leader = true;
+    for (size_t i = 0; i < instructions_.size(); i++) {
+        if (leader || instructions_[i].type == LABEL) {
+            if (!blocks_.empty()) {
+                blocks_.back().end = i;
+            }
+            blocks_.push_back(Block{i, i, 0, 0, 0, 0, 0});
+        }
+        block_of_[i] = blocks_.size() - 1;
+        switch (instructions_[i].type) {
+        case CALL: case JMP: case JZ: case JN: case RET: case END:
+            leader = true;
+            break;
+        default:
+            leader = false;
+        }
+    }
+    if (!blocks_.empty()) {
+        blocks_.back().end = instructions_.size();
+    }
+}
+
+unsigned long long Profiler::executed() const {
+    return executed_;
+}
+
+void Profiler::writeReport(std::ostream& out) const {
+    std::vector<size_t> sorted = sortedBlocks();
+    out << "Profile: " << executed_ << " instructions executed in " << blocks_.size() << " blocks\n";
+
+    out << "\nBlocks by executions:\n";
+    out << std::setw(14) << "count" << std::setw(8) << "instrs" << std::setw(6) << "%" << "  location\n";
+    for (size_t i : sorted) {
+        const Block& block = blocks_[i];
+        if (block.count == 0) {
+            break;
+        }
+        unsigned long long instrs = block.count * (block.end - block.start);
+        out << std::setw(14) << block.count << std::setw(8) << (block.end - block.start)
+            << std::setw(6) << std::fixed << std::setprecision(1) << (100.0 * instrs / executed_) << "  ";
+        writeLocation(out, block.start);
+        out << '\n';
+    }
+
+    out << "\nBranches:\n";
+    out << std::setw(14) << "taken" << std::setw(14) << "not taken" << "  location\n";
+    for (size_t i : sorted) {
+        const Block& block = blocks_[i];
+        if (block.taken + block.not_taken == 0) {
+            continue;
+        }
+        const Instruction& instr = instructions_[block.end - 1];
+        out << std::setw(14) << block.taken << std::setw(14) << block.not_taken << "  "
+            << (instr.type == JZ ? "jz" : "jn") << " label_" << instr.value << " at ";
+        writeLocation(out, block.end - 1);
+        out << '\n';
+    }
+
+    out << "\nCalls:\n";
+    out << std::setw(14) << "calls" << std::setw(14) << "inclusive" << "  location\n";
+    for (size_t i : sorted) {
+        const Block& block = blocks_[i];
+        if (block.calls == 0) {
+            continue;
+        }
+        out << std::setw(14) << block.calls << std::setw(14) << block.inclusive << "  ";
+        writeLocation(out, block.start);
+        out << '\n';
+    }
+}
+
+void Profiler::writeJSON(std::ostream& out) const {
+    out << "{\n  \"instructions\": " << executed_ << ",\n  \"blocks\": [";
+    bool first = true;
+    for (size_t i : sortedBlocks()) {
+        const Block& block = blocks_[i];
+        out << (first ? "\n" : ",\n") << "    {\"start\": " << block.start << ", \"end\": " << block.end;
+        if (block.start < positions_.size()) {
+            out << ", \"line\": " << positions_[block.start].line << ", \"col\": " << positions_[block.start].col;
+        }
+        if (instructions_[block.start].type == LABEL) {
+            out << ", \"label\": " << instructions_[block.start].value;
+        }
+        out << ", \"count\": " << block.count;
+        if (block.taken + block.not_taken > 0) {
+            out << ", \"taken\": " << block.taken << ", \"not_taken\": " << block.not_taken;
+        }
+        if (block.calls > 0) {
+            out << ", \"calls\": " << block.calls << ", \"inclusive\": " << block.inclusive;
+        }
+        out << '}';
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Private
+
+// Block indices ordered by descending execution count, then by position
+std::vector<size_t> Profiler::sortedBlocks() const {
+    std::vector<size_t> sorted(blocks_.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        sorted[i] = i;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [this](size_t a, size_t b) {
+        return blocks_[a].count > blocks_[b].count;
+    });
+    return sorted;
+}
+
+void Profiler::writeLocation(std::ostream& out, size_t pc) const {
+    if (pc < positions_.size()) {
+        out << 'L' << positions_[pc].line << ":C" << positions_[pc].col << ' ';
+    }
+    out << "pc " << pc;
+    if (instructions_[pc].type == LABEL) {
+        out << " label_" << instructions_[pc].value;
+    }
+}
+
+} // namespace WS
@@ -0,0 +1,80 @@
+#ifndef WS_PROFILER_H_
+#define WS_PROFILER_H_
+
+#include <ostream>
+#include <vector>
+#include "instruction.h"
+#include "parser.h"
+
+namespace WS {
+
+// Counts basic block executions, branch directions, and subroutine calls.
+// The VM only notifies the profiler on control flow edges, so the cost is
+// per block rather than per instruction.
+class Profiler {
+public:
+    Profiler(const std::vector<Instruction>& instructions,
+             const std::vector<SourcePosition>& positions = std::vector<SourcePosition>());
+
+    // Control is at a label, either by falling into it or by a jump
+    void enterBlock(size_t pc) {
+        Block& block = blocks_[block_of_[pc]];
+        block.count++;
+        executed_ += block.end - block.start;
+    }
+    // Control fell through a branch or returned from a call to pc. Labels
+    // count themselves, so those are skipped.
+    void resumeBlock(size_t pc) {
+        if (pc < instructions_.size() && instructions_[pc].type != LABEL) {
+            enterBlock(pc);
+        }
+    }
+    void branch(size_t pc, bool taken) {
+        Block& block = blocks_[block_of_[pc]];
+        if (taken) block.taken++; else block.not_taken++;
+    }
+    void call(size_t target) {
+        size_t block = block_of_[target];
+        blocks_[block].calls++;
+        frames_.push_back(Frame{block, executed_});
+    }
+    void ret() {
+        if (!frames_.empty()) {
+            blocks_[frames_.back().block].inclusive += executed_ - frames_.back().executed;
+            frames_.pop_back();
+        }
+    }
+
+    unsigned long long executed() const;
+    void writeReport(std::ostream& out) const;
+    void writeJSON(std::ostream& out) const;
+
+private:
+    struct Block {
+        size_t start;
+        size_t end;
+        unsigned long long count;
+        unsigned long long taken;
+        unsigned long long not_taken;
+        unsigned long long calls;
+        unsigned long long inclusive;
+    };
+    struct Frame {
+        size_t block;
+        unsigned long long executed;
+    };
+
+    std::vector<Instruction> instructions_;
+    std::vector<SourcePosition> positions_;
+    std::vector<size_t> block_of_;
+    std::vector<Block> blocks_;
+    std::vector<Frame> frames_;
+    unsigned long long executed_ = 0;
+
+    std::vector<size_t> sortedBlocks() const;
+    void writeLocation(std::ostream& out, size_t pc) const;
+};
+
+} // namespace WS
+
+#endif
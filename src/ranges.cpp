@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include "cfg.h"
+#include "ranges.h"
+
+namespace WS {
+
+namespace {
+
+const integer_t MIN = std::numeric_limits<integer_t>::min();
+const integer_t MAX = std::numeric_limits<integer_t>::max();
+const Range FULL{MIN, MAX};
+
+const size_t MAX_SLOTS = 16;     // Entries below the top of the stack with a range
+const int WIDEN_AFTER = 4;       // Changes to the entry of a block before its ranges widen
+const int WIDEN_HEAP_AFTER = 4;  // Passes that change the heap before its ranges widen
+
+Range hull(const Range& a, const Range& b) {
+    return Range{std::min(a.min, b.min), std::max(a.max, b.max)};
+}
+
+// Bounds that grew since the last change jump to the end of the range, so
+// that loops converge
+Range widen(const Range& before, const Range& after) {
+    return Range{after.min < before.min ? MIN : after.min, after.max > before.max ? MAX : after.max};
+}
+
+bool add(integer_t a, integer_t b, integer_t& sum) {
+    if ((b > 0 && a > MAX - b) || (b < 0 && a < MIN - b)) {
+        return false;
+    }
+    sum = a + b;
+    return true;
+}
+
+bool subtract(integer_t a, integer_t b, integer_t& difference) {
+    if ((b < 0 && a > MAX + b) || (b > 0 && a < MIN + b)) {
+        return false;
+    }
+    difference = a - b;
+    return true;
+}
+
+bool multiply(integer_t a, integer_t b, integer_t& product) {
+    if (a == 0 || b == 0) {
+        product = 0;
+        return true;
+    }
+    if ((a == -1 && b == MIN) || (b == -1 && a == MIN) ||
+        (a > 0 ? (b > 0 ? a > MAX / b : b < MIN / a) : (b > 0 ? a < MIN / b : a < MAX / b))) {
+        return false;
+    }
+    product = a * b;
+    return true;
+}
+
+// Sums and differences are monotonic in each operand, so they are bounded
+// by the ends of the operand ranges unless one of those wraps around
+Range addRanges(const Range& a, const Range& b) {
+    Range sum;
+    if (!add(a.min, b.min, sum.min) || !add(a.max, b.max, sum.max)) {
+        return FULL;
+    }
+    return sum;
+}
+
+Range subtractRanges(const Range& a, const Range& b) {
+    Range difference;
+    if (!subtract(a.min, b.max, difference.min) || !subtract(a.max, b.min, difference.max)) {
+        return FULL;
+    }
+    return difference;
+}
+
+Range multiplyRanges(const Range& a, const Range& b) {
+    integer_t corners[4];
+    if (!multiply(a.min, b.min, corners[0]) || !multiply(a.min, b.max, corners[1]) ||
+        !multiply(a.max, b.min, corners[2]) || !multiply(a.max, b.max, corners[3])) {
+        return FULL;
+    }
+    return Range{*std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4)};
+}
+
+// Quotients are monotonic in the dividend, and in the divisor on either
+// side of zero, so each side is bounded by its corners. A zero divisor
+// fails, and only the minimum divided by -1 wraps around.
+Range divideRanges(const Range& a, const Range& b) {
+    if (b.contains(-1) && a.min == MIN) {
+        return FULL;
+    }
+    bool any = false;
+    Range quotient = FULL;
+    auto corners = [&](integer_t low, integer_t high) {
+        integer_t values[4] = {a.min / low, a.min / high, a.max / low, a.max / high};
+        Range side{*std::min_element(values, values + 4), *std::max_element(values, values + 4)};
+        quotient = any ? hull(quotient, side) : side;
+        any = true;
+    };
+    if (b.max >= 1) {
+        corners(std::max<integer_t>(b.min, 1), b.max);
+    }
+    if (b.min <= -1) {
+        corners(b.min, std::min<integer_t>(b.max, -1));
+    }
+    return quotient;
+}
+
+// A remainder is between the dividend and zero, and smaller in magnitude
+// than the divisor. Modulo -1 is 0.
+Range moduloRanges(const Range& a, const Range& b) {
+    if (b.min == 0 && b.max == 0) {
+        return FULL;
+    }
+    unsigned_t low = b.min < 0 ? 0 - (unsigned_t) b.min : (unsigned_t) b.min;
+    unsigned_t high = b.max < 0 ? 0 - (unsigned_t) b.max : (unsigned_t) b.max;
+    integer_t bound = (integer_t) std::min<unsigned_t>(std::max(low, high) - 1, (unsigned_t) MAX);
+    return Range{a.min >= 0 ? 0 : std::max(a.min, -bound), a.max <= 0 ? 0 : std::min(a.max, bound)};
+}
+
+Range powerOfTwo(integer_t shift) {
+    return Range{(integer_t) 1 << shift, (integer_t) 1 << shift};
+}
+
+// Ranges of the entries near the top of the stack, with the top at the
+// back. Each entry is known to exist.
+struct State {
+    bool reached;
+    std::vector<Range> stack;
+};
+
+// Interprets a block at a time on ranges, and the heap as it goes
+class RangeInterpreter {
+public:
+    std::map<integer_t, Range> cells;
+    bool stored = false;
+    Range unknown{0, 0};
+    bool heap_changed = false;
+    bool widen_heap = false;
+
+    void step(const Instruction& instr, std::vector<Range>& stack) {
+        stack_ = &stack;
+        switch (instr.type) {
+        case PUSH:
+            push(Range{instr.value, instr.value});
+            break;
+        case DUP:
+            ensure(1);
+            push(stack.back());
+            break;
+        case COPY:
+            if (instr.value < 0) {
+                stack.clear(); // Fails
+                break;
+            }
+            push((unsigned_t) instr.value < stack.size() ? stack[stack.size() - 1 - instr.value] : FULL);
+            break;
+        case SWAP:
+            ensure(2);
+            std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+            break;
+        case DROP:
+            if (!stack.empty()) {
+                stack.pop_back();
+            }
+            break;
+        case SLIDE: {
+            if (instr.value < 0) {
+                stack.clear();
+                break;
+            }
+            Range top = pop();
+            stack.resize((unsigned_t) instr.value < stack.size() ? stack.size() - instr.value : 0);
+            push(top);
+            break;
+        }
+
+        case ADD: case SUB: case MUL: case DIV: case MOD: case FASTDIV: case FASTMOD: {
+            Range b = pop();
+            Range a = pop();
+            push(arithmetic(instr.type, a, b));
+            break;
+        }
+        case ADDI:
+            push(addRanges(pop(), Range{instr.value, instr.value}));
+            break;
+        case SHL: case SHR: {
+            Range a = pop();
+            if (instr.value < 0 || instr.value >= 63) {
+                push(FULL);
+            }
+            else {
+                push(instr.type == SHL ? multiplyRanges(a, powerOfTwo(instr.value)) : divideRanges(a, powerOfTwo(instr.value)));
+            }
+            break;
+        }
+
+        case STORE: {
+            Range value = pop();
+            store(pop(), value);
+            break;
+        }
+        case RETRIEVE:
+            push(retrieve(pop()));
+            break;
+        case READC:
+            store(pop(), Range{-1, 255});
+            break;
+        case READI:
+            store(pop(), FULL);
+            break;
+        case LOADCELL:
+            push(retrieve(Range{instr.value, instr.value}));
+            break;
+        case STORECELL:
+            store(Range{instr.value, instr.value}, pop());
+            break;
+        case LOADVAR:
+            push(FULL);
+            break;
+
+        case PRINTC: case PRINTI: case STOREVAR: case JZ: case JN:
+            pop();
+            break;
+        case INVALID_INSTR:
+            stack.clear();
+            break;
+        default:
+            break; // Control flow and output that leave the stack alone
+        }
+    }
+
+private:
+    std::vector<Range>* stack_;
+
+    // The instruction reads this many entries, so they exist once it has
+    // succeeded
+    void ensure(size_t count) {
+        if (stack_->size() < count) {
+            stack_->insert(stack_->begin(), count - stack_->size(), FULL);
+        }
+    }
+
+    void push(const Range& range) {
+        stack_->push_back(range);
+        if (stack_->size() > MAX_SLOTS) {
+            stack_->erase(stack_->begin());
+        }
+    }
+
+    Range pop() {
+        ensure(1);
+        Range top = stack_->back();
+        stack_->pop_back();
+        return top;
+    }
+
+    Range arithmetic(InstructionType type, const Range& a, const Range& b) {
+        switch (type) {
+        case ADD: return addRanges(a, b);
+        case SUB: return subtractRanges(a, b);
+        case MUL: return multiplyRanges(a, b);
+        case DIV: case FASTDIV: return divideRanges(a, b);
+        default:  return moduloRanges(a, b);
+        }
+    }
+
+    Range retrieve(const Range& address) {
+        Range value = stored ? hull(Range{0, 0}, unknown) : Range{0, 0};
+        if (address.min == address.max) {
+            std::map<integer_t, Range>::const_iterator cell = cells.find(address.min);
+            return cell == cells.end() ? value : hull(value, cell->second);
+        }
+        for (const std::pair<const integer_t, Range>& cell : cells) {
+            value = hull(value, cell.second);
+        }
+        return value;
+    }
+
+    void store(const Range& address, const Range& value) {
+        Range* into = &unknown;
+        if (address.min == address.max) {
+            into = &cells.insert(std::make_pair(address.min, Range{0, 0})).first->second;
+        }
+        else if (!stored) {
+            stored = true;
+            unknown = value;
+            heap_changed = true;
+            return;
+        }
+        Range joined = hull(*into, value);
+        if (joined.min != into->min || joined.max != into->max) {
+            *into = widen_heap ? widen(*into, joined) : joined;
+            heap_changed = true;
+        }
+    }
+};
+
+} // namespace
+
+bool Range::full() const {
+    return min == MIN && max == MAX;
+}
+
+RangeAnalysis::RangeAnalysis(const std::vector<Instruction>& program)
+    : tops_(program.size(), Top{false, FULL}), stored_(false), unknown_(Range{0, 0}) {
+    CFG cfg(program);
+    std::vector<State> entries(cfg.size(), State{false, std::vector<Range>()});
+    std::vector<int> changes(cfg.size(), 0);
+    RangeInterpreter interpreter;
+    std::deque<size_t> work;
+    for (const CFG::Subroutine& subroutine : cfg.subroutines()) {
+        if (subroutine.entry != CFG::NONE && subroutine.entry < cfg.size()) {
+            entries[subroutine.entry].reached = true;
+            work.push_back(subroutine.entry);
+        }
+    }
+
+    // Joins a state into the entry of a block, keeping the entries that
+    // both have
+    auto join = [&](size_t b, const std::vector<Range>& stack) {
+        State& entry = entries[b];
+        if (!entry.reached) {
+            entry.reached = true;
+            entry.stack = stack;
+            work.push_back(b);
+            return;
+        }
+        size_t size = std::min(entry.stack.size(), stack.size());
+        std::vector<Range> joined(entry.stack.end() - size, entry.stack.end());
+        bool changed = size != entry.stack.size();
+        for (size_t i = 0; i < size; i++) {
+            Range range = hull(joined[i], stack[stack.size() - size + i]);
+            if (changes[b] >= WIDEN_AFTER) {
+                range = widen(joined[i], range);
+            }
+            changed |= range.min != joined[i].min || range.max != joined[i].max;
+            joined[i] = range;
+        }
+        if (changed) {
+            entry.stack.swap(joined);
+            changes[b]++;
+            work.push_back(b);
+        }
+    };
+    auto run = [&](size_t b, bool record) {
+        std::vector<Range> stack = entries[b].stack;
+        for (size_t pc = cfg.block(b).start; pc < cfg.block(b).end; pc++) {
+            if (record) {
+                tops_[pc] = stack.empty() ? Top{false, FULL} : Top{true, stack.back()};
+            }
+            interpreter.step(program[pc], stack);
+        }
+        return stack;
+    };
+
+    // Stores feed retrieves anywhere in the program, so the blocks are
+    // interpreted again until the heap stops changing
+    for (int pass = 0;; pass++) {
+        interpreter.heap_changed = false;
+        interpreter.widen_heap = pass >= WIDEN_HEAP_AFTER;
+        while (!work.empty()) {
+            size_t b = work.front();
+            work.pop_front();
+            std::vector<Range> stack = run(b, false);
+            for (const Edge& edge : cfg.successors(b)) {
+                if (edge.to == CFG::EXIT) {
+                    continue;
+                }
+                // The callee and the code after a call start with the
+                // stack left by other code
+                join(edge.to, edge.kind == EDGE_CALL || edge.kind == EDGE_RETURN ? std::vector<Range>() : stack);
+            }
+        }
+        if (!interpreter.heap_changed) {
+            break;
+        }
+        for (size_t b = 0; b < cfg.size(); b++) {
+            if (entries[b].reached) {
+                work.push_back(b);
+            }
+        }
+    }
+    for (size_t b = 0; b < cfg.size(); b++) {
+        if (entries[b].reached) {
+            run(b, true);
+        }
+    }
+    cells_ = interpreter.cells;
+    stored_ = interpreter.stored;
+    unknown_ = interpreter.unknown;
+}
+
+bool RangeAnalysis::top(size_t pc, Range& range) const {
+    range = tops_[pc].range;
+    return tops_[pc].known;
+}
+
+Range RangeAnalysis::cell(integer_t address) const {
+    Range value = stored_ ? hull(Range{0, 0}, unknown_) : Range{0, 0};
+    std::map<integer_t, Range>::const_iterator cell = cells_.find(address);
+    return cell == cells_.end() ? value : hull(value, cell->second);
+}
+
+} // namespace WS
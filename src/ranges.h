@@ -0,0 +1,53 @@
+#ifndef WS_RANGES_H_
+#define WS_RANGES_H_
+
+#include <map>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+// Inclusive interval of integers
+struct Range {
+    integer_t min;
+    integer_t max;
+
+    bool contains(integer_t value) const { return min <= value && value <= max; }
+    bool full() const;
+};
+
+// Intervals of the values in stack slots and heap cells, by abstract
+// interpretation over the CFG. At each instruction, the entries near the
+// top of the stack that are known to exist have a range; calls and
+// subroutine entries forget the stack. The heap is flow-insensitive: each
+// cell at a constant address has the range of every value stored or read
+// into it, including the 0 it starts as, and stores and reads at other
+// addresses widen every cell. Arithmetic that may wrap around has the full
+// range, and ranges that keep growing around a loop are widened to it.
+//
+// Operations that fail end execution, so the ranges after an instruction
+// hold only for executions in which it succeeded.
+class RangeAnalysis {
+public:
+    explicit RangeAnalysis(const std::vector<Instruction>& program);
+
+    // Whether the top of the stack exists before the instruction at pc,
+    // whenever it is reached, and its range if so
+    bool top(size_t pc, Range& range) const;
+    // Range of the heap cell at an address
+    Range cell(integer_t address) const;
+
+private:
+    struct Top {
+        bool known;
+        Range range;
+    };
+    std::vector<Top> tops_;
+    std::map<integer_t, Range> cells_;
+    bool stored_; // Whether anything was stored at an address that is not constant
+    Range unknown_; // Values stored at such addresses
+};
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,713 @@
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include "cfg.h"
+#include "regvm.h"
+
+namespace WS {
+
+namespace {
+
+const integer_t STACK_ONLY = std::numeric_limits<integer_t>::max();
+const size_t HALTED = (size_t) -1;
+
+Operand immediate(integer_t value) {
+    return Operand{true, value};
+}
+
+Operand slot(integer_t offset) {
+    return Operand{false, offset};
+}
+
+bool foldable(InstructionType type, integer_t divisor) {
+    return (type != DIV && type != MOD) || divisor != 0;
+}
+
+integer_t fold(InstructionType type, integer_t a, integer_t b) {
+    switch (type) {
+    case ADD: return (integer_t) ((unsigned_t) a + (unsigned_t) b);
+    case SUB: return (integer_t) ((unsigned_t) a - (unsigned_t) b);
+    case MUL: return (integer_t) ((unsigned_t) a * (unsigned_t) b);
+    case DIV: return b == -1 ? (integer_t) (0 - (unsigned_t) a) : a / b;
+    default:  return b == -1 ? 0 : a % b;
+    }
+}
+
+RegisterOp arithmetic(InstructionType type) {
+    switch (type) {
+    case ADD: return REG_ADD;
+    case SUB: return REG_SUB;
+    case MUL: return REG_MUL;
+    case DIV: return REG_DIV;
+    default:  return REG_MOD;
+    }
+}
+
+// Symbolic stack of one block. Each entry is the operand that holds the
+// value at that position: an immediate, the slot at its own position once
+// it is in stack order, or any other slot it was copied or moved from.
+// Positions are relative to the entry height, and the entries below it are
+// added as the block reads them.
+class BlockTranslator {
+public:
+    BlockTranslator(std::vector<RegisterInstruction>& code) : code_(code), low_(0), frame_(0) {}
+
+    // Returns false when the block must always run as stack code
+    bool translate(const std::vector<Instruction>& instructions, RegisterBlock& block) {
+        for (size_t pc = block.start; pc < block.end; pc++) {
+            const Instruction& instr = instructions[pc];
+            switch (instr.type) {
+            case PUSH:
+                entries_.push_back(immediate(instr.value));
+                break;
+            case DUP:
+                ensure(1);
+                entries_.push_back(entries_.back());
+                break;
+            case COPY:
+                if (instr.value < 0) {
+                    return false;
+                }
+                ensure(instr.value + 1);
+                entries_.push_back(entries_[entries_.size() - instr.value - 1]);
+                break;
+            case SWAP:
+                ensure(2);
+                std::swap(entries_[entries_.size() - 1], entries_[entries_.size() - 2]);
+                break;
+            case DROP:
+                ensure(1);
+                entries_.pop_back();
+                break;
+            case SLIDE:
+                if (instr.value < 0) {
+                    return false;
+                }
+                ensure(instr.value + 1);
+                entries_.erase(entries_.end() - instr.value - 1, entries_.end() - 1);
+                break;
+
+            case ADD: case SUB: case MUL: case DIV: case MOD:
+                translateArithmetic(instr.type);
+                break;
+            case FASTDIV: case FASTMOD:
+                translateArithmetic(instr.type == FASTDIV ? DIV : MOD, false);
+                break;
+            case ADDI:
+                ensure(1);
+                entries_.push_back(immediate(instr.value));
+                translateArithmetic(ADD);
+                break;
+            case SHL: case SHR:
+                ensure(1);
+                entries_.push_back(immediate((integer_t) 1 << instr.value));
+                translateArithmetic(instr.type == SHL ? MUL : DIV);
+                break;
+
+            case STORE: {
+                ensure(2);
+                Operand value = pop();
+                Operand address = pop();
+                emit(REG_STORE, 0, address, value);
+                break;
+            }
+            case RETRIEVE: {
+                ensure(1);
+                integer_t dst = height() - 1;
+                if (aliased(dst, 1)) {
+                    flush();
+                }
+                Operand address = pop();
+                emit(REG_RETRIEVE, dst, address, immediate(0));
+                entries_.push_back(slot(dst));
+                break;
+            }
+
+            case LOADVAR: {
+                integer_t dst = height();
+                if (aliased(dst, 0)) {
+                    flush();
+                }
+                emit(REG_LOADVAR, dst, immediate(instr.value), immediate(0));
+                entries_.push_back(slot(dst));
+                break;
+            }
+            case STOREVAR:
+                ensure(1);
+                emit(REG_STOREVAR, 0, immediate(instr.value), pop());
+                break;
+            // Promoted heap cells stay in the heap map, at a constant address
+            case LOADCELL: {
+                integer_t dst = height();
+                if (aliased(dst, 0)) {
+                    flush();
+                }
+                emit(REG_RETRIEVE, dst, immediate(instr.value), immediate(0));
+                entries_.push_back(slot(dst));
+                break;
+            }
+            case STORECELL:
+                ensure(1);
+                emit(REG_STORE, 0, immediate(instr.value), pop());
+                break;
+
+            case PRINTC: case PRINTI: case READC: case READI:
+                ensure(1);
+                emit(instr.type == PRINTC ? REG_PRINTC : instr.type == PRINTI ? REG_PRINTI :
+                     instr.type == READC ? REG_READC : REG_READI, 0, pop(), immediate(0));
+                break;
+
+            case LABEL:
+                break;
+            case JMP:
+                flush();
+                emitTransfer(REG_JMP, block.target, block.next);
+                break;
+            case JZ: case JN:
+                translateBranch(instr.type, block);
+                break;
+            case CALL:
+                flush();
+                emitTransfer(REG_CALL, block.target, block.next);
+                break;
+            case RET:
+                flush();
+                emitTransfer(REG_RET, REG_EXIT, REG_EXIT);
+                break;
+            case END:
+                flush();
+                emitTransfer(REG_END, REG_EXIT, REG_EXIT);
+                break;
+
+            default:
+                return false;
+            }
+        }
+        const Instruction& last = instructions[block.end - 1];
+        if (last.type != JMP && last.type != JZ && last.type != JN && last.type != CALL &&
+            last.type != RET && last.type != END) {
+            flush();
+            emitTransfer(REG_JMP, block.next, REG_EXIT);
+        }
+        block.need = -low_;
+        block.frame = frame_;
+        return true;
+    }
+
+private:
+    std::vector<RegisterInstruction>& code_;
+    std::deque<Operand> entries_;
+    integer_t low_;   // Position of the first entry
+    integer_t frame_; // One past the highest slot used
+
+    struct Move {
+        integer_t dst;
+        Operand src;
+    };
+
+    integer_t height() const {
+        return low_ + (integer_t) entries_.size();
+    }
+
+    Operand& entry(integer_t position) {
+        return entries_[position - low_];
+    }
+
+    // Makes the top n positions known, reading them from the stack below
+    void ensure(integer_t n) {
+        while (height() - n < low_) {
+            low_--;
+            entries_.push_front(slot(low_));
+        }
+    }
+
+    Operand pop() {
+        Operand top = entries_.back();
+        entries_.pop_back();
+        return top;
+    }
+
+    // Whether a slot is read by an entry other than the top n
+    bool aliased(integer_t dst, integer_t n) {
+        for (integer_t position = low_; position < height() - n; position++) {
+            const Operand& src = entry(position);
+            if (!src.immediate && src.value == dst) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A division that the optimizer proved cannot fail is not checked
+    void translateArithmetic(InstructionType type, bool checked = true) {
+        ensure(2);
+        Operand rhs = entry(height() - 1);
+        Operand lhs = entry(height() - 2);
+        if (lhs.immediate && rhs.immediate && foldable(type, rhs.value)) {
+            entries_.pop_back();
+            entries_.back() = immediate(fold(type, lhs.value, rhs.value));
+            return;
+        }
+        // A division that fails leaves the stack as the VM would, without
+        // its operands
+        bool fails = checked && (type == DIV || type == MOD) && !(rhs.immediate && rhs.value != 0);
+        integer_t dst = height() - 2;
+        if (fails || aliased(dst, 2)) {
+            flush();
+        }
+        rhs = pop();
+        lhs = pop();
+        emit(arithmetic(type), dst, lhs, rhs, dst);
+        entries_.push_back(slot(dst));
+    }
+
+    void translateBranch(InstructionType type, const RegisterBlock& block) {
+        ensure(1);
+        Operand condition = entry(height() - 1);
+        if (condition.immediate) {
+            entries_.pop_back();
+            flush();
+            bool taken = type == JZ ? condition.value == 0 : condition.value < 0;
+            emitTransfer(REG_JMP, taken ? block.target : block.next, REG_EXIT);
+            return;
+        }
+        // Bringing the rest of the stack into order must not overwrite the
+        // condition first
+        integer_t position = condition.value;
+        if (position >= low_ && position < height() - 1 &&
+            (entry(position).immediate || entry(position).value != position)) {
+            flush();
+            condition = entry(height() - 1);
+        }
+        entries_.pop_back();
+        flush();
+        RegisterInstruction instr{type == JZ ? REG_JZ : REG_JN, 0, condition, immediate(0), block.target, block.next, height()};
+        code_.push_back(instr);
+    }
+
+    // Moves every entry to the slot at its position, as a parallel move
+    void flush() {
+        std::vector<Move> moves;
+        for (integer_t position = low_; position < height(); position++) {
+            const Operand& src = entry(position);
+            if (src.immediate || src.value != position) {
+                moves.push_back(Move{position, src});
+            }
+        }
+        integer_t temp = std::max(frame_, height());
+        while (!moves.empty()) {
+            bool progress = false;
+            for (size_t i = 0; i < moves.size();) {
+                if (read(moves, moves[i].dst)) {
+                    i++;
+                    continue;
+                }
+                emit(REG_MOV, moves[i].dst, moves[i].src, immediate(0));
+                moves.erase(moves.begin() + i);
+                progress = true;
+            }
+            if (!progress) {
+                // Every remaining move overwrites a slot another one reads,
+                // so they form cycles, and one is broken through a temporary
+                integer_t dst = moves[0].dst;
+                emit(REG_MOV, temp, slot(dst), immediate(0));
+                for (Move& move : moves) {
+                    if (!move.src.immediate && move.src.value == dst) {
+                        move.src = slot(temp);
+                    }
+                }
+            }
+        }
+        for (integer_t position = low_; position < height(); position++) {
+            entry(position) = slot(position);
+        }
+    }
+
+    static bool read(const std::vector<Move>& moves, integer_t dst) {
+        for (const Move& move : moves) {
+            if (!move.src.immediate && move.src.value == dst) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void emit(RegisterOp op, integer_t dst, Operand a, Operand b, integer_t height = 0) {
+        if (op == REG_MOV || op == REG_RETRIEVE || op == REG_LOADVAR || (op >= REG_ADD && op <= REG_MOD)) {
+            frame_ = std::max(frame_, dst + 1);
+        }
+        code_.push_back(RegisterInstruction{op, dst, a, b, REG_EXIT, REG_EXIT, height});
+    }
+
+    void emitTransfer(RegisterOp op, size_t target, size_t next) {
+        frame_ = std::max(frame_, height());
+        code_.push_back(RegisterInstruction{op, 0, immediate(0), immediate(0), target, next, height()});
+    }
+};
+
+} // namespace
+
+RegisterProgram translateToRegisters(const std::vector<Instruction>& program) {
+    RegisterProgram result;
+    result.instructions = program;
+    CFG cfg(result.instructions);
+    for (size_t b = 0; b < cfg.size(); b++) {
+        RegisterBlock block{cfg.block(b).start, cfg.block(b).end, result.code.size(), 0, 0, REG_EXIT, REG_EXIT};
+        for (const Edge& edge : cfg.successors(b)) {
+            if (edge.kind == EDGE_NOT_TAKEN || edge.kind == EDGE_RETURN || edge.kind == EDGE_FALLTHROUGH) {
+                block.next = edge.to;
+            }
+            else if (edge.kind != EDGE_EXIT) {
+                block.target = edge.to;
+            }
+        }
+        BlockTranslator translator(result.code);
+        if (!translator.translate(result.instructions, block)) {
+            result.code.resize(block.code);
+            block.need = STACK_ONLY;
+        }
+        result.blocks.push_back(block);
+    }
+    return result;
+}
+
+RegisterVM::RegisterVM(const RegisterProgram& program, std::istream& in, std::ostream& out)
+    : program_(program), sp_(0), bp_(0), in_(in), out_(out), dispatches_(0), fuel_(0) {
+    for (const Instruction& instr : program_.instructions) {
+        if ((instr.type == LOADVAR || instr.type == STOREVAR) && (size_t) instr.value >= vars_.size()) {
+            vars_.resize(instr.value + 1);
+        }
+    }
+}
+
+void RegisterVM::execute() {
+    if (program_.blocks.empty()) {
+        return;
+    }
+    size_t pc = enter(0);
+    if (pc == HALTED) {
+        return;
+    }
+    const RegisterInstruction* code = program_.code.data();
+    integer_t* base = stack_.data() + bp_;
+    auto value = [&](const Operand& operand) {
+        return operand.immediate ? operand.value : base[operand.value];
+    };
+    for (;;) {
+        if (fuel_ && dispatches_ >= fuel_) {
+            throw "Runtime Error: Out of fuel\n";
+        }
+        dispatches_++;
+        const RegisterInstruction& instr = code[pc];
+        size_t block;
+        switch (instr.op) {
+        case REG_MOV:
+            base[instr.dst] = value(instr.a);
+            pc++;
+            continue;
+        case REG_ADD:
+            base[instr.dst] = value(instr.a) + value(instr.b);
+            pc++;
+            continue;
+        case REG_SUB:
+            base[instr.dst] = value(instr.a) - value(instr.b);
+            pc++;
+            continue;
+        case REG_MUL:
+            base[instr.dst] = value(instr.a) * value(instr.b);
+            pc++;
+            continue;
+        case REG_DIV: case REG_MOD: {
+            integer_t a = value(instr.a);
+            integer_t b = value(instr.b);
+            if (b == 0) {
+                sp_ = bp_ + instr.height;
+                throw "Runtime Error: Division by zero\n";
+            }
+            base[instr.dst] = instr.op == REG_DIV ? (b == -1 ? (integer_t) (0 - (unsigned_t) a) : a / b)
+                                                  : (b == -1 ? 0 : a % b);
+            pc++;
+            continue;
+        }
+        case REG_STORE:
+            heap_[value(instr.a)] = value(instr.b);
+            pc++;
+            continue;
+        case REG_RETRIEVE:
+            base[instr.dst] = heap_[value(instr.a)];
+            pc++;
+            continue;
+        case REG_LOADVAR:
+            base[instr.dst] = vars_[instr.a.value];
+            pc++;
+            continue;
+        case REG_STOREVAR:
+            vars_[instr.a.value] = value(instr.b);
+            pc++;
+            continue;
+        case REG_PRINTC:
+            out_.put((char) value(instr.a));
+            pc++;
+            continue;
+        case REG_PRINTI:
+            out_ << value(instr.a);
+            pc++;
+            continue;
+        case REG_READC:
+            heap_[value(instr.a)] = (integer_t) in_.get();
+            pc++;
+            continue;
+        case REG_READI: {
+            integer_t integer = 0;
+            in_ >> integer;
+            heap_[value(instr.a)] = integer;
+            pc++;
+            continue;
+        }
+        case REG_JMP:
+            block = instr.target;
+            break;
+        case REG_JZ:
+            block = value(instr.a) == 0 ? instr.target : instr.next;
+            break;
+        case REG_JN:
+            block = value(instr.a) < 0 ? instr.target : instr.next;
+            break;
+        case REG_CALL:
+            call_stack_.push(instr.next);
+            block = instr.target;
+            break;
+        case REG_RET:
+            sp_ = bp_ + instr.height;
+            block = call_stack_.pop();
+            break;
+        case REG_END:
+            sp_ = bp_ + instr.height;
+            return;
+        }
+        sp_ = bp_ + instr.height;
+        pc = enter(block);
+        if (pc == HALTED) {
+            return;
+        }
+        base = stack_.data() + bp_;
+    }
+}
+
+std::vector<integer_t> RegisterVM::getStack() const {
+    return std::vector<integer_t>(stack_.begin(), stack_.begin() + sp_);
+}
+
+std::map<integer_t, integer_t> RegisterVM::getHeap() const {
+    return heap_;
+}
+
+void RegisterVM::setFuel(unsigned long long fuel) {
+    fuel_ = fuel;
+}
+
+void RegisterVM::setStrings(const std::vector<std::string>& strings) {
+    strings_ = strings;
+}
+
+// Private
+
+// Runs blocks as stack code until one can run as register code, and
+// returns its first instruction
+size_t RegisterVM::enter(size_t block) {
+    while (block != REG_EXIT) {
+        const RegisterBlock& b = program_.blocks[block];
+        if ((integer_t) sp_ >= b.need) {
+            bp_ = sp_;
+            size_t frame = bp_ + (size_t) b.frame;
+            if (stack_.size() < frame) {
+                stack_.resize(std::max(frame, 2 * stack_.size()));
+            }
+            return b.code;
+        }
+        block = runStackBlock(block);
+    }
+    return HALTED;
+}
+
+// Runs a block with the semantics of the VM and returns the next block
+size_t RegisterVM::runStackBlock(size_t block) {
+    const RegisterBlock& b = program_.blocks[block];
+    for (size_t pc = b.start; pc < b.end; pc++) {
+        if (fuel_ && dispatches_ >= fuel_) {
+            throw "Runtime Error: Out of fuel\n";
+        }
+        dispatches_++;
+        const Instruction& instr = program_.instructions[pc];
+        switch (instr.type) {
+        case PUSH:
+            push(instr.value);
+            break;
+        case DUP:
+            push(top());
+            break;
+        case COPY:
+            if (instr.value < 0) {
+                throw "Runtime Error: Index cannot be negative\n";
+            }
+            if ((unsigned_t) instr.value >= sp_) {
+                throw "Runtime Error: Stack underflow\n";
+            }
+            push(stack_[sp_ - instr.value - 1]);
+            break;
+        case SWAP: {
+            integer_t a = pop();
+            integer_t b = pop();
+            push(a);
+            push(b);
+            break;
+        }
+        case DROP:
+            if (sp_ >= 1) {
+                sp_--;
+            }
+            break;
+        case SLIDE:
+            if (instr.value < 0) {
+                throw "Runtime Error: Count cannot be negative\n";
+            }
+            if ((unsigned_t) instr.value >= sp_) {
+                throw "Runtime Error: Stack underflow\n";
+            }
+            stack_[sp_ - instr.value - 1] = stack_[sp_ - 1];
+            sp_ -= instr.value;
+            break;
+
+        case ADDI:
+            push(fold(ADD, pop(), instr.value));
+            break;
+        case SHL:
+            push(fold(MUL, pop(), (integer_t) 1 << instr.value));
+            break;
+        case SHR:
+            push(fold(DIV, pop(), (integer_t) 1 << instr.value));
+            break;
+        case LOADVAR:
+            push(vars_[instr.value]);
+            break;
+        case STOREVAR:
+            vars_[instr.value] = pop();
+            break;
+        case LOADCELL:
+            push(heap_[instr.value]);
+            break;
+        case STORECELL:
+            heap_[instr.value] = pop();
+            break;
+        case WRITE:
+            out_.write(strings_[instr.value].data(), strings_[instr.value].size());
+            break;
+        case FASTDIV: case FASTMOD: {
+            integer_t a = pop();
+            integer_t b = pop();
+            push(fold(instr.type == FASTDIV ? DIV : MOD, b, a));
+            break;
+        }
+
+        case ADD: case SUB: case MUL: case DIV: case MOD: {
+            integer_t a = pop();
+            integer_t b = pop();
+            if ((instr.type == DIV || instr.type == MOD) && a == 0) {
+                throw "Runtime Error: Division by zero\n";
+            }
+            push(fold(instr.type, b, a));
+            break;
+        }
+
+        case STORE: {
+            integer_t value = pop();
+            integer_t address = pop();
+            heap_[address] = value;
+            break;
+        }
+        case RETRIEVE: {
+            integer_t address = pop();
+            push(heap_[address]);
+            break;
+        }
+
+        case LABEL:
+            break;
+        case CALL:
+            call_stack_.push(b.next);
+            return b.target;
+        case JMP:
+            return b.target;
+        case JZ:
+            return pop() == 0 ? b.target : b.next;
+        case JN:
+            return pop() < 0 ? b.target : b.next;
+        case RET:
+            return call_stack_.pop();
+        case END:
+            return REG_EXIT;
+
+        case PRINTC:
+            out_.put((char) pop());
+            break;
+        case PRINTI:
+            out_ << pop();
+            break;
+        case READC: {
+            integer_t address = pop();
+            heap_[address] = (integer_t) in_.get();
+            break;
+        }
+        case READI: {
+            integer_t integer = 0;
+            in_ >> integer;
+            heap_[pop()] = integer;
+            break;
+        }
+
+        case DEBUG_PRINTSTACK:
+            out_.put('[');
+            for (size_t i = 0; i < sp_; i++) {
+                out_ << ' ' << stack_[i];
+            }
+            out_ << " ]\n";
+            break;
+        case DEBUG_PRINTHEAP: {
+            const char* separator = " ";
+            out_.put('{');
+            for (const std::pair<const integer_t, integer_t>& cell : heap_) {
+                out_ << separator << cell.first << ": " << cell.second;
+                separator = ", ";
+            }
+            out_ << " }\n";
+            break;
+        }
+
+        case INVALID_INSTR:
+            throw "Invalid instruction!";
+        }
+    }
+    return b.next;
+}
+
+void RegisterVM::push(integer_t value) {
+    if (sp_ == stack_.size()) {
+        stack_.resize(std::max((size_t) 16, 2 * stack_.size()));
+    }
+    stack_[sp_++] = value;
+}
+
+integer_t RegisterVM::pop() {
+    integer_t value = top();
+    sp_--;
+    return value;
+}
+
+integer_t RegisterVM::top() {
+    if (sp_ < 1) {
+        throw "Runtime Error: Stack underflow\n";
+    }
+    return stack_[sp_ - 1];
+}
+
+} // namespace WS
@@ -0,0 +1,129 @@
+#ifndef WS_REGVM_H_
+#define WS_REGVM_H_
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "instruction.h"
+#include "stack.h"
+
+namespace WS {
+
+enum RegisterOp {
+    REG_MOV,      // dst = a
+    REG_ADD,      // dst = a + b
+    REG_SUB,      // dst = a - b
+    REG_MUL,      // dst = a * b
+    REG_DIV,      // dst = a / b
+    REG_MOD,      // dst = a % b
+    REG_STORE,    // heap[a] = b
+    REG_RETRIEVE, // dst = heap[a]
+    REG_PRINTC,   // Output the character a
+    REG_PRINTI,   // Output the number a
+    REG_READC,    // Read a character into heap[a]
+    REG_READI,    // Read a number into heap[a]
+    REG_LOADVAR,  // dst = vars[a]
+    REG_STOREVAR, // vars[a] = b
+    REG_JMP,      // Enter block target
+    REG_JZ,       // Enter block target if a is zero, else block next
+    REG_JN,       // Enter block target if a is negative, else block next
+    REG_CALL,     // Enter block target, returning to block next
+    REG_RET,
+    REG_END
+};
+
+// A register or an immediate. Registers are stack slots relative to the
+// height of the stack when the block was entered, so the values a block
+// takes from the stack are at negative offsets.
+struct Operand {
+    bool immediate;
+    integer_t value;
+};
+
+// Three-address instruction. Each control transfer, and each division that
+// can fail, also sets the stack height relative to the block entry.
+struct RegisterInstruction {
+    RegisterOp op;
+    integer_t dst;
+    Operand a;
+    Operand b;
+    size_t target;
+    size_t next;
+    integer_t height;
+};
+
+struct RegisterBlock {
+    size_t start;    // Stack instructions, run instead when the block could underflow
+    size_t end;
+    size_t code;     // First register instruction
+    integer_t need;  // Stack entries the block reads below its entry height
+    integer_t frame; // Slots the block uses above its entry height
+    size_t target;   // Successor by a jump, taken branch, or call
+    size_t next;     // Successor by falling through, or returning from a call
+};
+
+// Register form of a stack program, with the original instructions kept
+// for the blocks that take the stack path
+struct RegisterProgram {
+    std::vector<Instruction> instructions;
+    std::vector<RegisterBlock> blocks;
+    std::vector<RegisterInstruction> code;
+};
+
+const size_t REG_EXIT = (size_t) -2; // Block that ends the program
+
+// Translates each basic block from stack code to register code. Pushes,
+// dups, copies, swaps, drops, and slides only rename the values that live
+// in the stack slots and emit nothing, constants become immediates, and
+// the slots are only brought back into stack order at the end of the
+// block, before a call, and before a division that can fail, so the stack
+// is exact wherever control can leave the block.
+RegisterProgram translateToRegisters(const std::vector<Instruction>& program);
+
+// Runs register code with the same output, final stack, final heap, and
+// runtime errors as the VM. A block is only entered in register form when
+// the stack is deep enough for every value it reads. Otherwise it runs its
+// stack instructions one at a time, so it fails at the same instruction as
+// the VM would, or drops from an empty stack as the VM does.
+class RegisterVM {
+public:
+    RegisterVM(const RegisterProgram& program, std::istream& in, std::ostream& out);
+
+    void execute();
+
+    std::vector<integer_t> getStack() const;
+    std::map<integer_t, integer_t> getHeap() const;
+    // Register instructions and stack instructions executed
+    unsigned long long getDispatches() const { return dispatches_; }
+
+    // Stop with a runtime error once this many instructions have been
+    // dispatched, or never when 0
+    void setFuel(unsigned long long fuel);
+    // Strings output by write instructions
+    void setStrings(const std::vector<std::string>& strings);
+
+private:
+    const RegisterProgram& program_;
+    std::vector<integer_t> stack_; // Slots, of which the first sp_ are the stack
+    size_t sp_;
+    size_t bp_;
+    std::map<integer_t, integer_t> heap_;
+    std::vector<integer_t> vars_;
+    ReturnStack call_stack_; // Blocks to return to
+    std::vector<std::string> strings_;
+    std::istream& in_;
+    std::ostream& out_;
+    unsigned long long dispatches_;
+    unsigned long long fuel_;
+
+    size_t enter(size_t block);
+    size_t runStackBlock(size_t block);
+    void push(integer_t value);
+    integer_t pop();
+    integer_t top();
+};
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,173 @@
+#include <cerrno>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+#include "sampler.h"
+
+namespace WS {
+
+namespace {
+
+Sampler* active_sampler = NULL;
+
+#ifndef _WIN32
+struct sigaction old_action;
+
+void handleProfSignal(int) {
+    int saved_errno = errno;
+    if (active_sampler) {
+        active_sampler->sample();
+    }
+    errno = saved_errno;
+}
+#endif
+
+} // namespace
+
+const size_t Sampler::MAX_DEPTH;
+const size_t Sampler::RING_CAPACITY;
+const size_t Sampler::TRUNCATED;
+const integer_t Sampler::TRUNCATED_FRAME;
+
+Sampler::Sampler(const std::vector<Instruction>& instructions, unsigned hz)
+    : instructions_(instructions), label_at_(instructions.size()), hz_(hz),
+      head_(0), tail_(0), dropped_(0) {
+    integer_t label = -1;
+    for (size_t i = 0; i < instructions_.size(); i++) {
+        if (instructions_[i].type == LABEL) {
+            label = instructions_[i].value;
+        }
+        label_at_[i] = label;
+    }
+}
+
+Sampler::~Sampler() {
+    stop();
+}
+
+void Sampler::track(const size_t* pc, const ReturnStack* calls) {
+    pc_ = pc;
+    calls_ = calls;
+}
+
+void Sampler::start() {
+#ifdef _WIN32
+    throw "Sampling profiler is not supported on this platform\n";
+#else
+    if (running_ || !pc_ || !calls_) {
+        return;
+    }
+    ring_.resize(RING_CAPACITY);
+    active_sampler = this;
+    struct sigaction action;
+    action.sa_handler = handleProfSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &old_action);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz_;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+    running_ = true;
+#endif
+}
+
+void Sampler::stop() {
+#ifndef _WIN32
+    if (!running_) {
+        return;
+    }
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &old_action, NULL);
+    active_sampler = NULL;
+    running_ = false;
+    drain();
+#endif
+}
+
+// Called from the signal handler. Each record is the frame count, flagged
+// when outer frames were left out, the program counter, then the return
+// addresses from outermost to innermost. Deep calls keep their innermost
+// frames, which are the ones nearest to where the time is spent.
+void Sampler::sample() {
+    size_t depth = calls_->size();
+    std::atomic_signal_fence(std::memory_order_acquire);
+    size_t frames = depth < MAX_DEPTH ? depth : MAX_DEPTH;
+    const size_t* calls = calls_->data() + (depth - frames);
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    if (RING_CAPACITY - (head - tail) < frames + 2) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const size_t mask = RING_CAPACITY - 1;
+    ring_[head++ & mask] = frames | (depth > frames ? TRUNCATED : 0);
+    ring_[head++ & mask] = *pc_;
+    for (size_t i = 0; i < frames; i++) {
+        ring_[head++ & mask] = calls[i];
+    }
+    head_.store(head, std::memory_order_release);
+}
+
+void Sampler::drain() {
+    const size_t mask = RING_CAPACITY - 1;
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    std::vector<integer_t> stack;
+    while (tail != head) {
+        size_t frames = ring_[tail++ & mask];
+        size_t pc = ring_[tail++ & mask];
+        stack.clear();
+        if (frames & TRUNCATED) {
+            stack.push_back(TRUNCATED_FRAME);
+            frames &= ~TRUNCATED;
+        }
+        for (size_t i = 0; i < frames; i++) {
+            size_t call = ring_[tail++ & mask];
+            stack.push_back(call < instructions_.size() ? instructions_[call].value : -1);
+        }
+        integer_t leaf = labelAt(pc);
+        if (stack.empty() || stack.back() != leaf) {
+            stack.push_back(leaf);
+        }
+        stacks_[stack]++;
+        samples_++;
+    }
+    tail_.store(tail, std::memory_order_release);
+}
+
+unsigned long long Sampler::samples() const {
+    return samples_;
+}
+
+unsigned long long Sampler::dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+integer_t Sampler::labelAt(size_t pc) const {
+    return pc < label_at_.size() ? label_at_[pc] : -1;
+}
+
+void Sampler::writeFolded(std::ostream& out) const {
+    std::map<std::vector<integer_t>, unsigned long long>::const_iterator iter;
+    for (iter = stacks_.begin(); iter != stacks_.end(); ++iter) {
+        out << "main";
+        for (integer_t label : iter->first) {
+            if (label == TRUNCATED_FRAME) {
+                out << ";[truncated]";
+                continue;
+            }
+            if (label < 0) {
+                continue;
+            }
+            out << ";label_" << label;
+        }
+        out << ' ' << iter->second << '\n';
+    }
+}
+
+} // namespace WS
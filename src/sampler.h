@@ -0,0 +1,71 @@
+#ifndef WS_SAMPLER_H_
+#define WS_SAMPLER_H_
+
+#include <atomic>
+#include <map>
+#include <ostream>
+#include <vector>
+#include "instruction.h"
+#include "stack.h"
+
+namespace WS {
+
+// Statistical profiler that samples the program counter and call stack of a
+// running VM from a SIGPROF handler. Samples are written into a lock-free
+// ring buffer and aggregated by label into folded stacks, as consumed by
+// flamegraph tools. Calls deeper than MAX_DEPTH keep their innermost
+// frames below a [truncated] root frame.
+class Sampler {
+public:
+    static const size_t MAX_DEPTH = 256;
+
+    Sampler(const std::vector<Instruction>& instructions, unsigned hz = 1000);
+    ~Sampler();
+
+    // Follow the program counter and call stack of an engine, which the
+    // signal handler reads as they are. Must be called before start.
+    void track(const size_t* pc, const ReturnStack* calls);
+    void start();
+    void stop();
+
+    // Drain the ring buffer once it is half full
+    void poll() {
+        if (head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed) > RING_CAPACITY / 2) {
+            drain();
+        }
+    }
+
+    void sample();
+    void drain();
+
+    unsigned long long samples() const;
+    unsigned long long dropped() const;
+    // Label enclosing pc, or -1 before the first label
+    integer_t labelAt(size_t pc) const;
+    void writeFolded(std::ostream& out) const;
+
+private:
+    static const size_t RING_CAPACITY = 1 << 20; // Words, a power of two
+    static const size_t TRUNCATED = (size_t) 1 << 63; // Flag on the frame count of a record
+    static const integer_t TRUNCATED_FRAME = -((integer_t) 1 << 62); // Label of the [truncated] frame
+
+    std::vector<Instruction> instructions_;
+    std::vector<integer_t> label_at_; // pc to enclosing label
+    unsigned hz_;
+    bool running_ = false;
+
+    const size_t* pc_ = NULL;
+    const ReturnStack* calls_ = NULL;
+
+    std::vector<size_t> ring_;
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    std::atomic<unsigned long long> dropped_;
+
+    std::map<std::vector<integer_t>, unsigned long long> stacks_;
+    unsigned long long samples_ = 0;
+};
+
+} // namespace WS
+
+#endif
@@ -0,0 +1,96 @@
+#include <cstdio>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "snapshot.h"
+
+namespace WS {
+
+unsigned_t programHash(const std::vector<Instruction>& instructions, const std::vector<std::string>& strings) {
+    unsigned_t hash = 14695981039346656037ull;
+    auto mix = [&](unsigned_t value) {
+        hash = (hash ^ value) * 1099511628211ull;
+        hash ^= hash >> 29;
+    };
+    for (const Instruction& instr : instructions) {
+        mix((unsigned_t) instr.type);
+        mix((unsigned_t) instr.value);
+    }
+    for (const std::string& string : strings) {
+        mix(string.size());
+        for (char c : string) {
+            mix((unsigned char) c);
+        }
+    }
+    return hash;
+}
+
+void SnapshotWriter::flush() {
+    if (count_ > 0) {
+        out_.write((const char*) buffer_, count_ * sizeof(unsigned_t));
+        count_ = 0;
+    }
+}
+
+SnapshotReader::SnapshotReader(const char* path) : data_(NULL), size_(0), next_(0), bytes_(0) {
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw "Unable to open snapshot\n";
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        throw "Unable to open snapshot\n";
+    }
+    bytes_ = (size_t) status.st_size;
+    if (bytes_ > 0) {
+        // Pages are read as the VM reaches them, and only once
+        void* data = mmap(NULL, bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw "Unable to open snapshot\n";
+        }
+        madvise(data, bytes_, MADV_SEQUENTIAL);
+        data_ = (const unsigned_t*) data;
+    }
+    else {
+        close(fd);
+    }
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        throw "Unable to open snapshot\n";
+    }
+    unsigned_t word;
+    while (fread(&word, sizeof(word), 1, file) == 1) {
+        copy_.push_back(word);
+    }
+    fclose(file);
+    data_ = copy_.data();
+    bytes_ = copy_.size() * sizeof(unsigned_t);
+#endif
+    size_ = bytes_ / sizeof(unsigned_t);
+}
+
+SnapshotReader::~SnapshotReader() {
+#ifndef _WIN32
+    if (data_) {
+        munmap((void*) data_, bytes_);
+    }
+#endif
+}
+
+const unsigned_t* SnapshotReader::words(unsigned_t count) {
+    if (count > size_ - next_) {
+        throw "Snapshot is truncated\n";
+    }
+    const unsigned_t* words = data_ + next_;
+    next_ += count;
+    return words;
+}
+
+} // namespace WS
@@ -0,0 +1,77 @@
+#ifndef WS_SNAPSHOT_H_
+#define WS_SNAPSHOT_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const unsigned_t SNAPSHOT_MAGIC = 0x50414e5343505352ull; // "RSPCSNAP" in little-endian order
+const unsigned_t SNAPSHOT_VERSION = 2;
+const size_t SNAPSHOT_BUFFER_WORDS = 1 << 13;
+
+// A snapshot of a VM is a sequence of 64-bit words in the byte order of
+// the machine that wrote it:
+//   magic, version, program hash,
+//   pc, instructions executed, peak stack, peak call depth,
+//   characters of input read (-2 once input failed),
+//   output position (-1 when unknown),
+//   stack size, entries from the bottom,
+//   call depth, return addresses from the outermost call,
+//   variable count, variables,
+//   heap cells, then an address and value for each cell.
+// Every field is a word, so the arrays of a snapshot mapped into memory are
+// aligned and read in place.
+
+// Hash of a program and its precomputed strings, so that a snapshot is only
+// resumed by the program that took it
+unsigned_t programHash(const std::vector<Instruction>& instructions, const std::vector<std::string>& strings);
+
+// Writes words to a stream through a fixed buffer, so that a large heap is
+// streamed as it is visited rather than copied first
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(std::ostream& out) : out_(out), count_(0) {}
+    ~SnapshotWriter() { flush(); }
+
+    void word(unsigned_t value) {
+        if (count_ == SNAPSHOT_BUFFER_WORDS) {
+            flush();
+        }
+        buffer_[count_++] = value;
+    }
+    void flush();
+
+private:
+    std::ostream& out_;
+    unsigned_t buffer_[SNAPSHOT_BUFFER_WORDS];
+    size_t count_;
+};
+
+// Snapshot file mapped into memory and read a word or an array at a time,
+// each checked against the end of the file
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const char* path);
+    ~SnapshotReader();
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    unsigned_t word() { return *words(1); }
+    // Next count words, in place
+    const unsigned_t* words(unsigned_t count);
+    bool atEnd() const { return next_ == size_; }
+
+private:
+    const unsigned_t* data_;
+    size_t size_; // In words
+    size_t next_;
+    size_t bytes_;
+    std::vector<unsigned_t> copy_; // Where the file cannot be mapped
+};
+
+} // namespace WS
+
+#endif
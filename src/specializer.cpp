@@ -0,0 +1,582 @@
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+#include <sstream>
+#include "specializer.h"
+
+namespace WS {
+
+namespace {
+
+// Result of arithmetic as the VM computes it, for a nonzero divisor
+integer_t fold(InstructionType op, integer_t lhs, integer_t rhs) {
+    switch (op) {
+    case ADD: return (integer_t) ((unsigned_t) lhs + (unsigned_t) rhs);
+    case SUB: return (integer_t) ((unsigned_t) lhs - (unsigned_t) rhs);
+    case MUL: return (integer_t) ((unsigned_t) lhs * (unsigned_t) rhs);
+    case DIV: return rhs == -1 ? (integer_t) (0 - (unsigned_t) lhs) : lhs / rhs;
+    case MOD: return rhs == -1 ? 0 : lhs % rhs;
+    default:  return 0;
+    }
+}
+
+// A stack entry or heap cell. Real entries are on the residual stack, and
+// real cells hold their value in the residual heap, while the others only
+// exist in the abstract state until they are materialized. Dynamic values
+// are always real.
+struct Value {
+    bool known;
+    integer_t value;
+    bool real;
+};
+
+struct State {
+    size_t pc;
+    std::vector<Value> stack;         // Pending entries are all above the real ones
+    std::map<integer_t, Value> heap;  // Cells that have been accessed at a known address
+    bool heap_dynamic;                // A store or read at a dynamic address may have written any cell
+    std::vector<size_t> calls;        // Instructions of the calls to return past
+    size_t input;                     // Position in the known input
+};
+
+class Specializer {
+public:
+    Specializer(const std::vector<Instruction>& program, const std::string& input, unsigned long long steps, bool suspend)
+        : program_(program), input_(input), steps_(steps), suspend_(suspend), next_label_(0), fixed_(false), consumed_(0),
+          variant_counts_(program.size() + 1, 0) {}
+
+    // Resolves labels as the VM does, or returns false if the program
+    // cannot be specialized
+    bool init() {
+        integer_t max_label = -1;
+        for (size_t pc = 0; pc < program_.size(); pc++) {
+            const Instruction& instr = program_[pc];
+            if (instr.type >= ADDI || instr.type == INVALID_INSTR) {
+                return false;
+            }
+            if (instr.type == LABEL) {
+                labels_[instr.value] = pc;
+            }
+            if (instr.type == LABEL || instr.type == CALL || instr.type == JMP || instr.type == JZ || instr.type == JN) {
+                max_label = std::max(max_label, instr.value);
+            }
+        }
+        if (max_label == std::numeric_limits<integer_t>::max()) {
+            return false;
+        }
+        next_label_ = max_label + 1;
+        return true;
+    }
+
+    std::vector<Instruction> run() {
+        specializePath(State{0, std::vector<Value>(), std::map<integer_t, Value>(), false, std::vector<size_t>(), 0});
+        while (!work_.empty()) {
+            Variant variant = work_.front();
+            work_.pop_front();
+            residual_.push_back(Instruction(LABEL, variant.label));
+            if (variant.general) {
+                generalize(variant.state);
+            }
+            else {
+                specializePath(variant.state);
+            }
+        }
+        // Generalized states continue in the original program, labeled
+        // where they enter it. Undefined labels resolve to its start rather
+        // than the start of the residual program.
+        if (!original_labels_.empty()) {
+            integer_t start = originalLabel(0);
+            for (size_t pc = 0; pc <= program_.size(); pc++) {
+                std::map<size_t, integer_t>::const_iterator label = original_labels_.find(pc);
+                if (label != original_labels_.end()) {
+                    residual_.push_back(Instruction(LABEL, label->second));
+                }
+                if (pc < program_.size()) {
+                    Instruction instr = program_[pc];
+                    if ((instr.type == CALL || instr.type == JMP || instr.type == JZ || instr.type == JN) && !labels_.count(instr.value)) {
+                        instr.value = start;
+                    }
+                    residual_.push_back(instr);
+                }
+            }
+        }
+        // Output collected ahead of time comes before any residual code,
+        // which only starts once the first dynamic value exists
+        if (!output_.empty()) {
+            residual_.insert(residual_.begin(), Instruction(WRITE, 0));
+        }
+        return residual_;
+    }
+
+    size_t consumed() const { return consumed_; }
+    const std::string& output() const { return output_; }
+
+private:
+    struct Variant {
+        State state;
+        integer_t label;
+        bool general;
+    };
+
+    const std::vector<Instruction>& program_;
+    const std::string& input_;
+    unsigned long long steps_;
+    bool suspend_;       // Whether to stop at the first read and collect the output before it
+    std::string output_;
+    std::map<integer_t, size_t> labels_;
+    integer_t next_label_;
+    std::vector<Instruction> residual_;
+    bool fixed_;      // Whether the residual program reads the input from consumed_ on
+    size_t consumed_;
+    std::map<std::vector<integer_t>, integer_t> variants_; // Labels of specialized states
+    std::vector<size_t> variant_counts_;
+    std::deque<Variant> work_;
+    std::map<size_t, integer_t> original_labels_;
+
+    // Evaluates from a state until the path ends
+    void specializePath(State s) {
+        while (step(s)) {}
+    }
+
+    bool step(State& s) {
+        if (steps_ == 0 || residual_.size() >= MAX_RESIDUAL_SIZE) {
+            generalize(s);
+            return false;
+        }
+        steps_--;
+        if (s.pc >= program_.size()) {
+            finish(s);
+            return false;
+        }
+        const Instruction& instr = program_[s.pc];
+        std::vector<Value>& stack = s.stack;
+        size_t size = stack.size();
+        switch (instr.type) {
+        case PUSH:
+            stack.push_back(Value{true, instr.value, false});
+            break;
+        case DUP: case COPY: {
+            integer_t n = instr.type == COPY ? instr.value : 0;
+            if (n < 0 || (unsigned_t) n >= size) {
+                generalize(s);
+                return false;
+            }
+            Value copy = stack[size - 1 - n];
+            if (copy.known) {
+                stack.push_back(Value{true, copy.value, false});
+            }
+            else {
+                materialize(s);
+                residual_.push_back(instr);
+                stack.push_back(Value{false, 0, true});
+            }
+            break;
+        }
+        case SWAP:
+            if (size < 2) {
+                generalize(s);
+                return false;
+            }
+            if (stack[size - 2].real) {
+                materialize(s);
+                residual_.push_back(instr);
+            }
+            std::swap(stack[size - 1], stack[size - 2]);
+            break;
+        case DROP:
+            if (size > 0) {
+                pop(s);
+            }
+            break;
+        case SLIDE:
+            if (instr.value < 0 || (unsigned_t) instr.value >= size) {
+                generalize(s);
+                return false;
+            }
+            if (stack[size - 1 - instr.value].real) {
+                materialize(s);
+                residual_.push_back(instr);
+            }
+            stack.erase(stack.end() - instr.value - 1, stack.end() - 1);
+            break;
+
+        case ADD: case SUB: case MUL: case DIV: case MOD: {
+            if (size < 2) {
+                generalize(s);
+                return false;
+            }
+            Value rhs = stack[size - 1];
+            Value lhs = stack[size - 2];
+            bool divides = instr.type == DIV || instr.type == MOD;
+            if (divides && rhs.known && rhs.value == 0) {
+                generalize(s);
+                return false;
+            }
+            if (lhs.known && rhs.known) {
+                pop(s);
+                pop(s);
+                stack.push_back(Value{true, fold(instr.type, lhs.value, rhs.value), false});
+                break;
+            }
+            // A dynamic divisor may be zero, which stops the program with
+            // the heap as it is
+            if (divides && !rhs.known) {
+                flushHeap(s);
+            }
+            materialize(s);
+            residual_.push_back(instr);
+            stack.pop_back();
+            stack.back() = Value{false, 0, true};
+            break;
+        }
+
+        case STORE: {
+            if (size < 2) {
+                generalize(s);
+                return false;
+            }
+            Value value = stack[size - 1];
+            Value address = stack[size - 2];
+            if (address.known && value.known) {
+                pop(s);
+                pop(s);
+                s.heap[address.value] = Value{true, value.value, false};
+            }
+            else if (address.known) {
+                materialize(s);
+                residual_.push_back(instr);
+                stack.resize(size - 2);
+                s.heap[address.value] = Value{false, 0, true};
+            }
+            else {
+                flushHeap(s);
+                materialize(s);
+                residual_.push_back(instr);
+                stack.resize(size - 2);
+                forgetHeap(s);
+            }
+            break;
+        }
+        case RETRIEVE: {
+            if (size < 1) {
+                generalize(s);
+                return false;
+            }
+            Value address = stack[size - 1];
+            if (!address.known) {
+                flushHeap(s);
+                materialize(s);
+                residual_.push_back(instr);
+                stack.back() = Value{false, 0, true};
+                break;
+            }
+            // Retrieving creates the cell, which is zero unless a dynamic
+            // write may have reached it
+            std::map<integer_t, Value>::iterator cell = s.heap.find(address.value);
+            if (cell == s.heap.end()) {
+                cell = s.heap.insert(std::make_pair(address.value, s.heap_dynamic ? Value{false, 0, true} : Value{true, 0, false})).first;
+            }
+            if (cell->second.known) {
+                integer_t value = cell->second.value;
+                pop(s);
+                stack.push_back(Value{true, value, false});
+            }
+            else {
+                materialize(s);
+                residual_.push_back(instr);
+                stack.back() = Value{false, 0, true};
+            }
+            break;
+        }
+
+        case READC: case READI: {
+            if (size < 1 || suspend_) {
+                generalize(s);
+                return false;
+            }
+            Value address = stack[size - 1];
+            integer_t value;
+            if (address.known && readKnown(s, instr.type, value)) {
+                pop(s);
+                s.heap[address.value] = Value{true, value, false};
+                break;
+            }
+            fixInput(s);
+            if (address.known) {
+                materialize(s);
+                residual_.push_back(instr);
+                stack.pop_back();
+                s.heap[address.value] = Value{false, 0, true};
+            }
+            else {
+                flushHeap(s);
+                materialize(s);
+                residual_.push_back(instr);
+                stack.pop_back();
+                forgetHeap(s);
+            }
+            break;
+        }
+
+        case PRINTC: case PRINTI: {
+            if (size < 1) {
+                generalize(s);
+                return false;
+            }
+            Value value = stack[size - 1];
+            if (suspend_ && value.known && residual_.empty()) {
+                pop(s);
+                if (instr.type == PRINTC) {
+                    output_ += (char) value.value;
+                }
+                else {
+                    std::ostringstream number;
+                    number << value.value;
+                    output_ += number.str();
+                }
+                break;
+            }
+            if (value.known) {
+                pop(s);
+                residual_.push_back(Instruction(PUSH, value.value));
+            }
+            else {
+                stack.pop_back();
+            }
+            residual_.push_back(instr);
+            break;
+        }
+
+        case LABEL:
+            break;
+        case CALL:
+            s.calls.push_back(s.pc);
+            s.pc = target(instr.value);
+            return true;
+        case JMP:
+            s.pc = target(instr.value);
+            return true;
+        case RET:
+            if (s.calls.empty()) {
+                generalize(s);
+                return false;
+            }
+            s.pc = s.calls.back() + 1;
+            s.calls.pop_back();
+            return true;
+        case END:
+            finish(s);
+            return false;
+
+        case JZ: case JN: {
+            if (size < 1) {
+                generalize(s);
+                return false;
+            }
+            Value condition = stack[size - 1];
+            if (condition.known) {
+                pop(s);
+                bool taken = instr.type == JZ ? condition.value == 0 : condition.value < 0;
+                s.pc = taken ? target(instr.value) : s.pc + 1;
+                return true;
+            }
+            materialize(s);
+            stack.pop_back();
+            State taken = s;
+            taken.pc = target(instr.value);
+            residual_.push_back(Instruction(instr.type, variant(taken)));
+            s.pc++;
+            // The fall through continues here, unless it was specialized
+            // before or has too many copies
+            std::vector<integer_t> key = stateKey(s);
+            std::map<std::vector<integer_t>, integer_t>::const_iterator known = variants_.find(key);
+            if (known != variants_.end()) {
+                residual_.push_back(Instruction(JMP, known->second));
+                return false;
+            }
+            if (variant_counts_[s.pc] >= MAX_VARIANTS) {
+                generalize(s);
+                return false;
+            }
+            variant_counts_[s.pc]++;
+            integer_t label = next_label_++;
+            variants_[key] = label;
+            residual_.push_back(Instruction(LABEL, label));
+            return true;
+        }
+
+        default:
+            // Debugging instructions show the whole state
+            generalize(s);
+            return false;
+        }
+        s.pc++;
+        return true;
+    }
+
+    // Label of the code specialized to a state, queueing it if it is new
+    integer_t variant(const State& s) {
+        std::vector<integer_t> key = stateKey(s);
+        std::map<std::vector<integer_t>, integer_t>::const_iterator known = variants_.find(key);
+        if (known != variants_.end()) {
+            return known->second;
+        }
+        integer_t label = next_label_++;
+        bool general = variant_counts_[s.pc] >= MAX_VARIANTS;
+        if (!general) {
+            variant_counts_[s.pc]++;
+            variants_[key] = label;
+        }
+        work_.push_back(Variant{s, label, general});
+        return label;
+    }
+
+    // Identifies a state at a dynamic branch, where the stack is all real
+    std::vector<integer_t> stateKey(const State& s) {
+        std::vector<integer_t> key;
+        key.push_back(s.pc);
+        key.push_back(fixed_ ? -1 : (integer_t) s.input);
+        key.push_back(s.heap_dynamic);
+        key.push_back(s.calls.size());
+        key.insert(key.end(), s.calls.begin(), s.calls.end());
+        key.push_back(s.stack.size());
+        for (const Value& entry : s.stack) {
+            key.push_back(entry.known);
+            key.push_back(entry.value);
+        }
+        for (const std::pair<const integer_t, Value>& cell : s.heap) {
+            key.push_back(cell.first);
+            key.push_back(cell.second.known);
+            key.push_back(cell.second.value);
+            key.push_back(cell.second.real);
+        }
+        return key;
+    }
+
+    // Reads a character, or a number that ends within the known input
+    bool readKnown(State& s, InstructionType type, integer_t& value) {
+        if (fixed_ || s.input >= input_.size()) {
+            return false;
+        }
+        if (type == READC) {
+            value = (unsigned char) input_[s.input++];
+            return true;
+        }
+        std::istringstream in(input_.substr(s.input));
+        value = 0;
+        in >> value;
+        if (in.fail() || in.eof()) {
+            return false;
+        }
+        s.input += (size_t) in.tellg();
+        return true;
+    }
+
+    // The residual program reads the input from here on
+    void fixInput(const State& s) {
+        if (!fixed_) {
+            fixed_ = true;
+            consumed_ = s.input;
+        }
+    }
+
+    // Removes the top entry, which is dropped at run time if it is real
+    void pop(State& s) {
+        if (s.stack.back().real) {
+            residual_.push_back(DROP);
+        }
+        s.stack.pop_back();
+    }
+
+    void materialize(State& s) {
+        for (Value& entry : s.stack) {
+            if (!entry.real) {
+                residual_.push_back(Instruction(PUSH, entry.value));
+                entry.real = true;
+            }
+        }
+    }
+
+    void flushHeap(State& s) {
+        for (std::pair<const integer_t, Value>& cell : s.heap) {
+            if (!cell.second.real) {
+                residual_.push_back(Instruction(PUSH, cell.first));
+                residual_.push_back(Instruction(PUSH, cell.second.value));
+                residual_.push_back(STORE);
+                cell.second.real = true;
+            }
+        }
+    }
+
+    // After a write at a dynamic address, which must follow flushHeap
+    void forgetHeap(State& s) {
+        for (std::pair<const integer_t, Value>& cell : s.heap) {
+            cell.second = Value{false, 0, true};
+        }
+        s.heap_dynamic = true;
+    }
+
+    void finish(State& s) {
+        fixInput(s);
+        materialize(s);
+        flushHeap(s);
+        residual_.push_back(END);
+    }
+
+    // Makes the whole state real and continues in the original program.
+    // Each frame of the call stack becomes a call that returns to a jump
+    // past the original call.
+    void generalize(State& s) {
+        fixInput(s);
+        materialize(s);
+        flushHeap(s);
+        for (size_t call : s.calls) {
+            integer_t frame = next_label_++;
+            residual_.push_back(Instruction(CALL, frame));
+            residual_.push_back(Instruction(JMP, originalLabel(call + 1)));
+            residual_.push_back(Instruction(LABEL, frame));
+        }
+        residual_.push_back(Instruction(JMP, originalLabel(s.pc)));
+    }
+
+    // Instruction a label resolves to, where an undefined label is the start
+    size_t target(integer_t label) const {
+        std::map<integer_t, size_t>::const_iterator pc = labels_.find(label);
+        return pc == labels_.end() ? 0 : pc->second;
+    }
+
+    integer_t originalLabel(size_t pc) {
+        std::map<size_t, integer_t>::const_iterator label = original_labels_.find(pc);
+        if (label != original_labels_.end()) {
+            return label->second;
+        }
+        return original_labels_[pc] = next_label_++;
+    }
+};
+
+} // namespace
+
+Specialization specialize(const std::vector<Instruction>& program, const std::string& input, unsigned long long steps) {
+    Specializer specializer(program, input, steps, false);
+    if (!specializer.init()) {
+        return Specialization{program, 0};
+    }
+    std::vector<Instruction> residual = specializer.run();
+    return Specialization{residual, specializer.consumed()};
+}
+
+Supercompilation supercompile(const std::vector<Instruction>& program, unsigned long long fuel) {
+    Specializer specializer(program, "", fuel, true);
+    if (!specializer.init()) {
+        return Supercompilation{program, std::vector<std::string>()};
+    }
+    std::vector<Instruction> residual = specializer.run();
+    std::vector<std::string> strings;
+    if (!specializer.output().empty()) {
+        strings.push_back(specializer.output());
+    }
+    return Supercompilation{residual, strings};
+}
+
+} // namespace WS
@@ -0,0 +1,66 @@
+#ifndef WS_SPECIALIZER_H_
+#define WS_SPECIALIZER_H_
+
+#include <string>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const size_t MAX_RESIDUAL_SIZE = 1 << 16;            // Residual instructions before generalizing
+const unsigned long long MAX_STATIC_STEPS = 1 << 24; // Instructions evaluated before generalizing
+const size_t MAX_VARIANTS = 8;                       // Specialized copies of one instruction
+
+// A program specialized to a known prefix of its input
+struct Specialization {
+    std::vector<Instruction> program;
+    size_t consumed; // Characters of the prefix that were folded, which the residual program does not read
+};
+
+// Partially evaluates a program against a known prefix of its input. The
+// program runs on an abstract state, in which stack entries and heap cells
+// are either known constants or dynamic values that only exist at run time,
+// and reads from the prefix fold into constants. Whatever can be computed
+// from constants, including branches, calls, and returns, leaves no code
+// behind, so an interpreter given a known program has its dispatch
+// resolved. Only instructions on dynamic values are emitted into the
+// residual program, along with the pushes and stores that bring the known
+// values into the real stack and heap before they are needed.
+//
+// A dynamic branch specializes both of its successors, and a successor
+// reached again with the same abstract state jumps to its earlier copy,
+// so loops over dynamic values become loops in the residual program. Code
+// growth is bounded by at most MAX_VARIANTS copies of each instruction,
+// MAX_RESIDUAL_SIZE instructions, and the given number of steps, after
+// which the state is materialized, including the call stack, and control
+// continues in a copy of the original program. The same happens before
+// any instruction that would fail, so runtime errors leave the same stack
+// and heap.
+//
+// Running the residual program on the input after the first consumed
+// characters produces the same output, final stack, final heap, and
+// runtime errors as running the program on the whole input. Programs with
+// instructions internal to the optimizer are returned unchanged, with
+// nothing consumed.
+Specialization specialize(const std::vector<Instruction>& program, const std::string& input,
+                          unsigned long long steps = MAX_STATIC_STEPS);
+
+// A program whose output before its first read was computed ahead of time
+struct Supercompilation {
+    std::vector<Instruction> program;
+    std::vector<std::string> strings; // Output by the write instructions of the program
+};
+
+// Runs a program ahead of time until its first read, a runtime error, or
+// the given number of steps, as specialize does with no known input. The
+// output up to there becomes a single write at the start of the program,
+// followed by pushes and stores that set up the stack and heap, calls
+// that set up the call stack, and a jump to the rest of the original
+// program. A program that never reads collapses to the write and the
+// final stack and heap. Programs with instructions internal to the
+// optimizer are returned unchanged.
+Supercompilation supercompile(const std::vector<Instruction>& program, unsigned long long fuel = MAX_STATIC_STEPS);
+
+} // namespace WS
+
+#endif
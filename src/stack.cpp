@@ -0,0 +1,128 @@
+#ifdef __linux__
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "stack.h"
+
+namespace WS {
+
+namespace {
+
+#ifdef __linux__
+GuardedStack* armed_stack = NULL;
+struct sigaction old_action;
+
+// Faults elsewhere restore the previous handler and return, so the
+// faulting instruction runs again and is handled as if this were not here
+void handleSegvSignal(int, siginfo_t* info, void*) {
+    if (armed_stack && armed_stack->guards(info->si_addr)) {
+        siglongjmp(armed_stack->trap, 1);
+    }
+    sigaction(SIGSEGV, &old_action, NULL);
+}
+#endif
+
+} // namespace
+
+GuardedStack::GuardedStack(size_t capacity)
+    : region_(NULL), region_bytes_(0), page_bytes_(0), base_(NULL), limit_(NULL), outer_(NULL), overflowed_(false) {
+#ifndef __linux__
+    throw "Guarded stack is not supported on this platform\n";
+#else
+    page_bytes_ = (size_t) sysconf(_SC_PAGESIZE);
+    size_t bytes = (capacity * sizeof(integer_t) + page_bytes_ - 1) / page_bytes_ * page_bytes_;
+    if (bytes == 0) {
+        bytes = page_bytes_;
+    }
+    region_bytes_ = bytes + 2 * page_bytes_;
+    void* region = mmap(NULL, region_bytes_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        throw "Unable to reserve the guarded stack\n";
+    }
+    region_ = (char*) region;
+    if (mprotect(region_ + page_bytes_, bytes, PROT_READ | PROT_WRITE) != 0) {
+        munmap(region_, region_bytes_);
+        throw "Unable to reserve the guarded stack\n";
+    }
+    base_ = (integer_t*) (region_ + page_bytes_);
+    limit_ = (integer_t*) (region_ + page_bytes_ + bytes);
+#endif
+}
+
+GuardedStack::~GuardedStack() {
+#ifdef __linux__
+    if (armed_stack == this) {
+        disarm();
+    }
+    munmap(region_, region_bytes_);
+#endif
+}
+
+bool GuardedStack::supported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+void GuardedStack::arm() {
+#ifdef __linux__
+    outer_ = armed_stack;
+    if (!outer_) {
+        struct sigaction action;
+        action.sa_sigaction = handleSegvSignal;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &old_action);
+    }
+    armed_stack = this;
+#endif
+}
+
+void GuardedStack::disarm() {
+#ifdef __linux__
+    armed_stack = outer_;
+    if (!armed_stack) {
+        sigaction(SIGSEGV, &old_action, NULL);
+    }
+#endif
+}
+
+bool GuardedStack::guards(const void* address) {
+    const char* byte = (const char*) address;
+    if (byte >= region_ && byte < region_ + page_bytes_) {
+        overflowed_ = false;
+        return true;
+    }
+    if (byte >= (const char*) limit_ && byte < region_ + region_bytes_) {
+        overflowed_ = true;
+        return true;
+    }
+    return false;
+}
+
+void SegmentedStack::spill(std::vector<integer_t>& stack) {
+    segments_.push_back(std::vector<integer_t>(stack.begin(), stack.begin() + entries_));
+    stack.erase(stack.begin(), stack.begin() + entries_);
+    size_ += entries_;
+}
+
+void SegmentedStack::fill(std::vector<integer_t>& stack) {
+    stack.assign(segments_.back().begin(), segments_.back().end());
+    drop();
+}
+
+void SegmentedStack::drop() {
+    segments_.pop_back();
+    size_ -= entries_;
+}
+
+void SegmentedStack::appendTo(std::vector<integer_t>& stack) const {
+    for (const std::vector<integer_t>& segment : segments_) {
+        stack.insert(stack.end(), segment.begin(), segment.end());
+    }
+}
+
+} // namespace WS
@@ -0,0 +1,128 @@
+#ifndef WS_STACK_H_
+#define WS_STACK_H_
+
+#ifdef __linux__
+#include <setjmp.h>
+#endif
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "instruction.h"
+
+namespace WS {
+
+const size_t GUARDED_STACK_CAPACITY = 1 << 24; // Default entries of a guarded stack
+const size_t STACK_SEGMENT_ENTRIES = 1 << 19;  // Default entries of a segment of a large stack
+const size_t CALL_STACK_DEPTH = 1 << 20;       // Default maximum depth of calls
+
+// Bottom of an operand stack too large to keep in one vector, in segments
+// of a fixed number of entries, so that it grows without copying what is
+// already there. Every segment is full. The top of the stack stays in a
+// vector, which spills its bottom entries into a new segment when it grows
+// to two segments, and takes back the top segment when it runs empty.
+class SegmentedStack {
+public:
+    explicit SegmentedStack(size_t segment_entries = STACK_SEGMENT_ENTRIES)
+        : entries_(segment_entries), size_(0) {}
+
+    size_t size() const { return size_; }
+    size_t segments() const { return segments_.size(); }
+    size_t segmentEntries() const { return entries_; }
+    // Entry by its index from the bottom of the stack
+    integer_t at(size_t index) const { return segments_[index / entries_][index % entries_]; }
+
+    // Moves the bottom segment's worth of entries of a vector into a new
+    // segment on top
+    void spill(std::vector<integer_t>& stack);
+    // Moves the top segment into an empty vector
+    void fill(std::vector<integer_t>& stack);
+    // Removes the top segment
+    void drop();
+    void appendTo(std::vector<integer_t>& stack) const;
+
+private:
+    size_t entries_;
+    size_t size_;
+    std::vector<std::vector<integer_t>> segments_;
+};
+
+// Return addresses of calls in one array allocated up front, so that a
+// call or return only compares the depth with an end of it. A signal
+// handler may read it as it is, since each entry is written before the
+// depth that includes it.
+class ReturnStack {
+public:
+    explicit ReturnStack(size_t max_depth = CALL_STACK_DEPTH)
+        : entries_(new size_t[max_depth]), max_depth_(max_depth), depth_(0) {}
+
+    void push(size_t address) {
+        if (depth_ == max_depth_) {
+            throw "Runtime Error: Call stack overflow\n";
+        }
+        entries_[depth_] = address;
+        std::atomic_signal_fence(std::memory_order_release);
+        depth_ = depth_ + 1;
+    }
+    size_t pop() {
+        if (depth_ == 0) {
+            throw "Runtime Error: Call stack underflow\n";
+        }
+        depth_ = depth_ - 1;
+        return entries_[depth_];
+    }
+
+    size_t size() const { return depth_; }
+    bool empty() const { return depth_ == 0; }
+    size_t maxDepth() const { return max_depth_; }
+    // Entries from the outermost call on
+    const size_t* data() const { return entries_.get(); }
+
+private:
+    std::unique_ptr<size_t[]> entries_;
+    size_t max_depth_;
+    volatile size_t depth_;
+};
+
+// Operand stack in a region of virtual memory between two pages without
+// access, so that popping below the bottom or pushing past the top faults
+// instead of being checked. While armed, a SIGSEGV handler catches faults
+// on either guard page and jumps back to the sigsetjmp of trap. Pages are
+// committed by the kernel as the stack first reaches them. Only Linux
+// supports it.
+class GuardedStack {
+public:
+    explicit GuardedStack(size_t capacity = GUARDED_STACK_CAPACITY);
+    ~GuardedStack();
+    GuardedStack(const GuardedStack&) = delete;
+    GuardedStack& operator=(const GuardedStack&) = delete;
+
+    static bool supported();
+
+    integer_t* base() const { return base_; }
+    // Just past the last entry, rounded up to a whole page
+    integer_t* limit() const { return limit_; }
+
+    void arm();
+    void disarm();
+    // Whether the last trap was on the page above the limit
+    bool overflowed() const { return overflowed_; }
+    // Called from the signal handler with the faulting address
+    bool guards(const void* address);
+
+#ifdef __linux__
+    sigjmp_buf trap;
+#endif
+
+private:
+    char* region_;
+    size_t region_bytes_;
+    size_t page_bytes_;
+    integer_t* base_;
+    integer_t* limit_;
+    GuardedStack* outer_; // Armed by an enclosing run, and armed again on disarm
+    volatile bool overflowed_;
+};
+
+} // namespace WS
+
+#endif
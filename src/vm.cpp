@@ -1,6 +1,11 @@
 #define _CRT_SECURE_NO_WARNINGS // To use fscanf in VS
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
 #include <vector>
-#include <stack>
 #include <map>
 #include "vm.h"
 
@@ -9,50 +14,301 @@
 
 namespace WS {
 
+namespace {
+
+volatile std::sig_atomic_t checkpoint_requested = 0;
+
+} // namespace
+
 void VM::execute() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (profiler_ && pc_ == 0) {
+        profiler_->resumeBlock(pc_);
+    }
+    try {
+        if (guarded_ && !opstats_ && !profiler_ && !sampler_ && checkpoint_.empty()) {
+            executeGuarded();
+        }
+        else if (opstats_ || fuel_ || !checkpoint_.empty()) {
+            while (pc_ < instructions_.size()) {
+                if (!checkpoint_.empty() && (stats_.instructions >= next_checkpoint_ || checkpoint_requested)) {
+                    checkpoint();
+                }
+                if (fuel_ && stats_.instructions >= fuel_) {
+                    throw "Runtime Error: Out of fuel\n";
+                }
+                if (opstats_) {
+                    opstats_->record(pc_, instructions_[pc_].type);
+                }
+                stats_.instructions++;
+                step(instructions_[pc_]);
+            }
+            if (opstats_) {
+                opstats_->finish(pc_);
+            }
+        }
+        else {
+            while (pc_ < instructions_.size()) {
+                stats_.instructions++;
+                step(instructions_[pc_]);
+            }
+        }
+    }
+    catch (...) {
+        stats_.wall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        throw;
+    }
+    stats_.wall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs as execute would until the next instruction reads input, and
+// returns true there, or returns false once the program ends. Observers
+// are not notified, and the stack stays in the vector.
+bool VM::executeUntilRead() {
     while (pc_ < instructions_.size()) {
-        Instruction instr = instructions_[pc_];
-        switch (instr.type) {
-        case PUSH:   instrPush(instr.value); break;
-        case DUP:    instrDup(); break;
-        case COPY:   instrCopy(instr.value); break;
-        case SWAP:   instrSwap(); break;
-        case DROP:   instrDrop(); break;
-        case SLIDE:  instrSlide(instr.value); break;
-
-        case ADD:    instrAdd(); break;
-        case SUB:    instrSub(); break;
-        case MUL:    instrMul(); break;
-        case DIV:    instrDiv(); break;
-        case MOD:    instrMod(); break;
-
-        case STORE:  instrStore(); break;
-        case RETRIEVE: instrRetrieve(); break;
-
-        case LABEL:  instrLabel(); break;
-        case CALL:   instrCall(instr.value); break;
-        case JMP:    instrJmp(instr.value); break;
-        case JZ:     instrJz(instr.value); break;
-        case JN:     instrJn(instr.value); break;
-        case RET:    instrRet(); break;
-        case END:    instrEnd(); break;
-
-        case PRINTC: instrPrintC(); break;
-        case PRINTI: instrPrintI(); break;
-        case READC:  instrReadC(); break;
-        case READI:  instrReadI(); break;
-
-        case DEBUG_PRINTSTACK: instrDebugPrintStack(); break;
-        case DEBUG_PRINTHEAP:  instrDebugPrintHeap(); break;
-
-        case INVALID_INSTR: throw "Invalid instruction!";
+        if (instructions_[pc_].type == READC || instructions_[pc_].type == READI) {
+            return true;
         }
+        if (fuel_ && stats_.instructions >= fuel_) {
+            throw "Runtime Error: Out of fuel\n";
+        }
+        stats_.instructions++;
+        step(instructions_[pc_]);
     }
+    return false;
+}
+
+// Dispatch a single instruction
+inline void VM::step(const Instruction& instr) {
+    switch (instr.type) {
+    case PUSH:   instrPush(instr.value); break;
+    case DUP:    instrDup(); break;
+    case COPY:   instrCopy(instr.value); break;
+    case SWAP:   instrSwap(); break;
+    case DROP:   instrDrop(); break;
+    case SLIDE:  instrSlide(instr.value); break;
+
+    case ADD:    instrAdd(); break;
+    case SUB:    instrSub(); break;
+    case MUL:    instrMul(); break;
+    case DIV:    instrDiv(); break;
+    case MOD:    instrMod(); break;
+
+    case STORE:  instrStore(); break;
+    case RETRIEVE: instrRetrieve(); break;
+
+    case LABEL:  instrLabel(); break;
+    case CALL:   instrCall(instr.value); break;
+    case JMP:    instrJmp(instr.value); break;
+    case JZ:     instrJz(instr.value); break;
+    case JN:     instrJn(instr.value); break;
+    case RET:    instrRet(); break;
+    case END:    instrEnd(); break;
+
+    case PRINTC: instrPrintC(); break;
+    case PRINTI: instrPrintI(); break;
+    case READC:  instrReadC(); break;
+    case READI:  instrReadI(); break;
+
+    case DEBUG_PRINTSTACK: instrDebugPrintStack(); break;
+    case DEBUG_PRINTHEAP:  instrDebugPrintHeap(); break;
+
+    case ADDI:     instrAddI(instr.value); break;
+    case SHL:      instrShl(instr.value); break;
+    case SHR:      instrShr(instr.value); break;
+    case LOADVAR:  instrLoadVar(instr.value); break;
+    case STOREVAR: instrStoreVar(instr.value); break;
+    case LOADCELL:  instrLoadCell(instr.value); break;
+    case STORECELL: instrStoreCell(instr.value); break;
+    case WRITE:     instrWrite(instr.value); break;
+    case FASTDIV:   instrFastDiv(); break;
+    case FASTMOD:   instrFastMod(); break;
+
+    case INVALID_INSTR: throw "Invalid instruction!";
+    }
+}
+
+// Runs with the stack in the guarded region, where instructions with a
+// fixed number of operands skip the checks for underflow and overflow and
+// fault on a guard page instead. Only runGuarded touches the region, and
+// it has no objects to destroy, so a trap jumps back here past its frame
+// alone, with pc_ still at the faulting instruction as the checked VM
+// leaves it. Each instruction begins with a signal fence so that pc_ and
+// the statistics are in memory when it faults, while the stack pointer
+// stays in a register, since a trap leaves the stack empty or full.
+void VM::executeGuarded() {
+    gatherStack();
+    if (stack_.size() > (size_t) (guarded_->limit() - guarded_->base())) {
+        throw "Runtime Error: Stack overflow\n";
+    }
+    if (sigsetjmp(guarded_->trap, 1)) {
+        guarded_->disarm();
+        // Popping an empty stack leaves it empty, and pushing onto a full
+        // one leaves it full
+        bool overflowed = guarded_->overflowed();
+        stack_.assign(guarded_->base(), overflowed ? guarded_->limit() : guarded_->base());
+        stats_.peak_stack = std::max(stats_.peak_stack, stack_.size());
+        throw overflowed ? "Runtime Error: Stack overflow\n" : "Runtime Error: Stack underflow\n";
+    }
+    guarded_->arm();
+    try {
+        runGuarded();
+    }
+    catch (...) {
+        guarded_->disarm();
+        throw;
+    }
+    guarded_->disarm();
+}
+
+// Loop of executeGuarded, apart from the sigsetjmp that would keep the
+// compiler from holding its variables in registers
+void VM::runGuarded() {
+    integer_t* base = guarded_->base();
+    integer_t* sp = std::copy(stack_.begin(), stack_.end(), base);
+    try {
+        while (pc_ < instructions_.size()) {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            if (fuel_ && stats_.instructions >= fuel_) {
+                throw "Runtime Error: Out of fuel\n";
+            }
+            stats_.instructions++;
+            const Instruction& instr = instructions_[pc_];
+            integer_t a, b;
+            switch (instr.type) {
+            case PUSH:   *sp++ = instr.value; break;
+            case DUP:    sp[0] = sp[-1]; sp++; break;
+            case COPY:
+                if (instr.value < 0) {
+                    throw "Runtime Error: Index cannot be negative\n";
+                }
+                if ((unsigned_t) instr.value >= (unsigned_t) (sp - base)) {
+                    throw "Runtime Error: Stack underflow\n";
+                }
+                sp[0] = sp[-instr.value - 1];
+                sp++;
+                break;
+            case SWAP:   std::swap(sp[-1], sp[-2]); break;
+            case DROP:   sp -= sp > base; break;
+            case SLIDE:
+                if (instr.value < 0) {
+                    throw "Runtime Error: Count cannot be negative\n";
+                }
+                if ((unsigned_t) instr.value >= (unsigned_t) (sp - base)) {
+                    throw "Runtime Error: Stack underflow\n";
+                }
+                sp[-instr.value - 1] = sp[-1];
+                sp -= instr.value;
+                break;
+
+            case ADD:    b = sp[-1]; sp[-2] = sp[-2] + b; sp--; break;
+            case SUB:    b = sp[-1]; sp[-2] = sp[-2] - b; sp--; break;
+            case MUL:    b = sp[-1]; sp[-2] = sp[-2] * b; sp--; break;
+            case DIV:
+                a = sp[-1];
+                b = sp[-2];
+                sp -= 2;
+                if (a == 0) {
+                    throw "Runtime Error: Division by zero\n";
+                }
+                *sp++ = a == -1 ? (integer_t) (0 - (unsigned_t) b) : b / a;
+                break;
+            case MOD:
+                a = sp[-1];
+                b = sp[-2];
+                sp -= 2;
+                if (a == 0) {
+                    throw "Runtime Error: Division by zero\n";
+                }
+                *sp++ = a == -1 ? 0 : b % a;
+                break;
+
+            case STORE:  a = sp[-1]; b = sp[-2]; sp -= 2; cell(b) = a; break;
+            case RETRIEVE: sp[-1] = load(sp[-1]); break;
+
+            case LABEL:  instrLabel(); continue;
+            case JMP:    instrJmp(instr.value); continue;
+            case JZ:
+                if (*--sp == 0) {
+                    instrJmp(instr.value);
+                    continue;
+                }
+                break;
+            case JN:
+                if (*--sp < 0) {
+                    instrJmp(instr.value);
+                    continue;
+                }
+                break;
+            case CALL:
+            case RET:
+                // Memoization reads and writes the stack in stack_
+                if (memo_) {
+                    stack_.assign(base, sp);
+                    step(instr);
+                    gatherStack();
+                    sp = std::copy(stack_.begin(), stack_.end(), base);
+                }
+                else {
+                    step(instr);
+                }
+                continue;
+            case END:    instrEnd(); continue;
+
+            case PRINTC: out_.put(*--sp); break;
+            case PRINTI: out_ << *--sp; break;
+            case READC:  a = *--sp; cell(a) = (integer_t) in_.get(); break;
+            case READI:
+                a = *--sp;
+                b = 0;
+                in_ >> b;
+                cell(a) = b;
+                break;
+
+            case DEBUG_PRINTSTACK:
+                stack_.assign(base, sp);
+                instrDebugPrintStack();
+                continue;
+            case DEBUG_PRINTHEAP: instrDebugPrintHeap(); continue;
+
+            case ADDI:     sp[-1] = (integer_t) ((unsigned_t) sp[-1] + (unsigned_t) instr.value); break;
+            case SHL:      sp[-1] = (integer_t) ((unsigned_t) sp[-1] << instr.value); break;
+            case SHR:
+                a = sp[-1];
+                sp[-1] = (a + ((a >> 63) & (((integer_t) 1 << instr.value) - 1))) >> instr.value;
+                break;
+            case LOADVAR:  *sp++ = vars_[instr.value]; break;
+            case STOREVAR: vars_[instr.value] = *--sp; break;
+            case LOADCELL:
+                cell_present_[instr.value] = true;
+                *sp++ = cells_[instr.value];
+                break;
+            case STORECELL:
+                cells_[instr.value] = *--sp;
+                cell_present_[instr.value] = true;
+                break;
+            case WRITE:    instrWrite(instr.value); continue;
+            case FASTDIV:  b = sp[-1]; sp[-2] = sp[-2] / b; sp--; break;
+            case FASTMOD:  b = sp[-1]; sp[-2] = sp[-2] % b; sp--; break;
+
+            case INVALID_INSTR: throw "Invalid instruction!";
+            }
+            if ((size_t) (sp - base) > stats_.peak_stack) {
+                stats_.peak_stack = sp - base;
+            }
+            pc_++;
+        }
+    }
+    catch (...) {
+        stack_.assign(base, sp);
+        throw;
+    }
+    stack_.assign(base, sp);
 }
 
 // Push the number onto the stack
 void VM::instrPush(integer_t value) {
-    stack_.push_back(value);
+    push(value);
     pc_++;
 }
 // Duplicate the top item on the stack
@@ -66,9 +322,14 @@ void VM::instrCopy(integer_t n) {
         throw "Runtime Error: Index cannot be negative\n"; // Undefined behavior
     }
     if ((unsigned_t) n >= stack_.size()) {
-        throw "Runtime Error: Stack underflow\n";
+        if ((unsigned_t) n >= stack_.size() + segments_.size()) {
+            throw "Runtime Error: Stack underflow\n";
+        }
+        push(segments_.at(segments_.size() + stack_.size() - n - 1));
+    }
+    else {
+        push(stack_.at(stack_.size() - n - 1));
     }
-    push(stack_.at(stack_.size() - n - 1));
     pc_++;
 }
 // Swap the top two items on the stack
@@ -89,10 +350,29 @@ void VM::instrSlide(integer_t count) {
     if (count < 0) {
         throw "Runtime Error: Count cannot be negative\n"; // Undefined behavior
     }
-    if ((unsigned_t) count >= stack_.size()) {
+    if ((unsigned_t) count >= stack_.size() + segments_.size()) {
         throw "Runtime Error: Stack underflow\n";
     }
-    stack_.erase(stack_.end() - count - 1, stack_.end() - 1);
+    integer_t value = top();
+    if ((unsigned_t) count >= stack_.size()) {
+        // Whole segments above the entries that remain are dropped, and
+        // the one they end in is filled back into the vector
+        size_t keep = segments_.size() + stack_.size() - count - 1;
+        stack_.clear();
+        while (segments_.size() > keep) {
+            if (segments_.size() - segments_.segmentEntries() >= keep) {
+                segments_.drop();
+            }
+            else {
+                segments_.fill(stack_);
+                stack_.resize(keep - segments_.size());
+            }
+        }
+        stack_.push_back(value);
+    }
+    else {
+        stack_.erase(stack_.end() - count - 1, stack_.end() - 1);
+    }
     pc_++;
 }
 
@@ -117,14 +397,21 @@ void VM::instrMul() {
 void VM::instrDiv() {
     integer_t a = pop();
     integer_t b = pop();
-    push(b / a);
+    if (a == 0) {
+        throw "Runtime Error: Division by zero\n";
+    }
+    // The minimum integer divided by -1 overflows, so it wraps instead
+    push(a == -1 ? (integer_t) (0 - (unsigned_t) b) : b / a);
     pc_++;
 }
 // Modulo
 void VM::instrMod() {
     integer_t a = pop();
     integer_t b = pop();
-    push(b % a);
+    if (a == 0) {
+        throw "Runtime Error: Division by zero\n";
+    }
+    push(a == -1 ? 0 : b % a);
     pc_++;
 }
 
@@ -138,24 +425,39 @@ void VM::instrStore() {
 #endif
     integer_t value = pop();
     integer_t address = pop();
-    heap_[address] = value;
+    cell(address) = value;
     pc_++;
 }
 // Retrieve
 void VM::instrRetrieve() {
     integer_t address = pop();
-    push(heap_[address]);
+    push(load(address));
     pc_++;
 }
 
 // Mark a location in the program
 void VM::instrLabel() {
+    if (profiler_) {
+        profiler_->enterBlock(pc_);
+    }
+    if (sampler_) {
+        sampler_->poll();
+    }
     pc_++;
 }
 // Call a subroutine
 void VM::instrCall(integer_t label) {
+    if (memo_ && recall(label)) {
+        return;
+    }
     call_stack_.push(pc_);
+    if (call_stack_.size() > stats_.peak_call_depth) {
+        stats_.peak_call_depth = call_stack_.size();
+    }
     pc_ = labels_[label];
+    if (profiler_) {
+        profiler_->call(pc_);
+    }
 }
 // Jump unconditionally to a label
 void VM::instrJmp(integer_t label) {
@@ -163,26 +465,46 @@ void VM::instrJmp(integer_t label) {
 }
 // Jump to a label if the top of the stack is zero
 void VM::instrJz(integer_t label) {
-    if (pop() == 0) {
+    bool taken = pop() == 0;
+    if (profiler_) {
+        profiler_->branch(pc_, taken);
+    }
+    if (taken) {
         instrJmp(label);
     }
     else {
         pc_++;
+        if (profiler_) {
+            profiler_->resumeBlock(pc_);
+        }
     }
 }
 // Jump to a label if the top of the stack is negative
 void VM::instrJn(integer_t label) {
-    if (pop() < 0) {
+    bool taken = pop() < 0;
+    if (profiler_) {
+        profiler_->branch(pc_, taken);
+    }
+    if (taken) {
         instrJmp(label);
     }
     else {
         pc_++;
+        if (profiler_) {
+            profiler_->resumeBlock(pc_);
+        }
     }
 }
 // End a subroutine and transfer control back to the caller
 void VM::instrRet() {
-    pc_ = call_stack_.top() + 1;
-    call_stack_.pop();
+    if (!memo_frames_.empty() && memo_frames_.back().depth == call_stack_.size()) {
+        remember();
+    }
+    pc_ = call_stack_.pop() + 1;
+    if (profiler_) {
+        profiler_->ret();
+        profiler_->resumeBlock(pc_);
+    }
 }
 // End the program
 void VM::instrEnd() {
@@ -206,47 +528,409 @@ void VM::instrPrintI() {
 }
 // Read a character and place it in the location given by the top of the stack
 void VM::instrReadC() {
-    heap_[pop()] = (integer_t) in_.get();
+    cell(pop()) = (integer_t) in_.get();
     pc_++;
 }
 // 	Read a number and place it in the location given by the top of the stack
 void VM::instrReadI() {
-    integer_t integer;
+    integer_t integer = 0; // Left unchanged when the input is already at EOF
     in_ >> integer;
-    heap_[pop()] = integer;
+    cell(pop()) = integer;
     pc_++;
 }
 
 // Print contents of stack
 void VM::instrDebugPrintStack() {
     out_.put('[');
-    for (size_t i = 0; i < stack_.size(); i++) {
-        out_ << ' ' << stack_.at(i);
+    for (integer_t value : getStack()) {
+        out_ << ' ' << value;
     }
     out_ << " ]\n";
     pc_++;
 }
 // Print contents of heap
 void VM::instrDebugPrintHeap() {
-    std::map<integer_t, integer_t>::iterator iter = heap_.begin();
+    std::map<integer_t, integer_t> heap = getHeap();
+    std::map<integer_t, integer_t>::iterator iter = heap.begin();
     out_.put('{');
-    if (iter != heap_.end()) {
+    if (iter != heap.end()) {
         out_ << ' ' << iter->first << ": " << iter->second;
         ++iter;
     }
-    for (; iter != heap_.end(); ++iter) {
+    for (; iter != heap.end(); ++iter) {
         out_ << ", " << iter->first << ": " << iter->second;
     }
     out_ << " }\n";
     pc_++;
 }
 
+// Add a constant, as push and add would
+void VM::instrAddI(integer_t value) {
+    push((integer_t) ((unsigned_t) pop() + (unsigned_t) value));
+    pc_++;
+}
+// Multiply by a power of two, as push and mul would
+void VM::instrShl(integer_t shift) {
+    push((integer_t) ((unsigned_t) pop() << shift));
+    pc_++;
+}
+// Divide by a power of two, as push and div would. An arithmetic shift
+// rounds down, so negative numbers are biased to round toward zero.
+void VM::instrShr(integer_t shift) {
+    integer_t value = pop();
+    push((value + ((value >> 63) & (((integer_t) 1 << shift) - 1))) >> shift);
+    pc_++;
+}
+// Push a variable
+void VM::instrLoadVar(integer_t var) {
+    push(vars_[var]);
+    pc_++;
+}
+// Pop into a variable
+void VM::instrStoreVar(integer_t var) {
+    vars_[var] = pop();
+    pc_++;
+}
+// Push a promoted heap cell, creating it as retrieve would
+void VM::instrLoadCell(integer_t slot) {
+    cell_present_[slot] = true;
+    push(cells_[slot]);
+    pc_++;
+}
+// Pop into a promoted heap cell
+void VM::instrStoreCell(integer_t slot) {
+    cells_[slot] = pop();
+    cell_present_[slot] = true;
+    pc_++;
+}
+// Output a string at once
+void VM::instrWrite(integer_t string) {
+    out_.write(strings_[string].data(), strings_[string].size());
+    pc_++;
+}
+
+// Division without the checks for a divisor of 0 or -1, which the
+// optimizer ruled out
+void VM::instrFastDiv() {
+    integer_t a = pop();
+    integer_t b = pop();
+    push(b / a);
+    pc_++;
+}
+// Modulo without the checks for a divisor of 0 or -1
+void VM::instrFastMod() {
+    integer_t a = pop();
+    integer_t b = pop();
+    push(b % a);
+    pc_++;
+}
+
 std::vector<integer_t> VM::getStack() const {
-    return stack_;
+    if (segments_.size() == 0) {
+        return stack_;
+    }
+    std::vector<integer_t> stack;
+    stack.reserve(segments_.size() + stack_.size());
+    segments_.appendTo(stack);
+    stack.insert(stack.end(), stack_.begin(), stack_.end());
+    return stack;
 }
 
 std::map<integer_t, integer_t> VM::getHeap() const {
-    return heap_;
+    std::map<integer_t, integer_t> heap = paged_ ? paged_->cells() : heap_;
+    for (size_t slot = 0; slot < cells_.size(); slot++) {
+        if (cell_present_[slot]) {
+            heap[cell_addresses_[slot]] = cells_[slot];
+        }
+    }
+    return heap;
+}
+
+VMStats VM::getStats() const {
+    VMStats stats = stats_;
+    size_t heap_cells = paged_ ? paged_->size() : heap_.size();
+    stats.heap_cells = heap_cells + std::count(cell_present_.begin(), cell_present_.end(), true);
+    stats.heap_bytes = (paged_ ? paged_->bytes() : heap_.size() * (4 * sizeof(void*) + sizeof(std::map<integer_t, integer_t>::value_type))) +
+                       cells_.size() * (sizeof(integer_t) * 2 + sizeof(char));
+    // The stack grows geometrically, so its reallocations follow from its
+    // capacity without counting them on every push
+    for (size_t capacity = stack_.capacity(); capacity > 0; capacity /= 2) {
+        stats.allocations++;
+    }
+    stats.allocations += heap_cells + segments_.segments();
+    return stats;
+}
+
+// Writes the state of the VM as a snapshot, streaming the heap as it is
+// visited. Output is flushed first, so that its position counts all of it.
+void VM::save(std::ostream& out) const {
+    out_.flush();
+    SnapshotWriter writer(out);
+    writer.word(SNAPSHOT_MAGIC);
+    writer.word(SNAPSHOT_VERSION);
+    writer.word(programHash(instructions_, strings_));
+    writer.word(pc_);
+    writer.word(stats_.instructions);
+    writer.word(stats_.peak_stack);
+    writer.word(stats_.peak_call_depth);
+    // Every later read fails the same way once input has ended, wherever
+    // it ended. Without a count of what was read, the position is the
+    // stream's, which is -1 for a pipe.
+    integer_t input = -2;
+    if (!in_.eof() && !in_.fail()) {
+        input = counted_ ? (integer_t) counted_->count() :
+                (integer_t) in_.rdbuf()->pubseekoff(0, std::ios::cur, std::ios::in);
+    }
+    writer.word(input);
+    writer.word((integer_t) out_.tellp());
+
+    writer.word(segments_.size() + stack_.size());
+    for (size_t i = 0; i < segments_.size(); i++) {
+        writer.word(segments_.at(i));
+    }
+    for (integer_t value : stack_) {
+        writer.word(value);
+    }
+    writer.word(call_stack_.size());
+    for (size_t i = 0; i < call_stack_.size(); i++) {
+        writer.word(call_stack_.data()[i]);
+    }
+    writer.word(vars_.size());
+    for (integer_t value : vars_) {
+        writer.word(value);
+    }
+
+    auto visit = [&](integer_t address, integer_t value) {
+        writer.word(address);
+        writer.word(value);
+    };
+    size_t promoted = std::count(cell_present_.begin(), cell_present_.end(), true);
+    writer.word(promoted + (paged_ ? paged_->size() : heap_.size()));
+    for (size_t slot = 0; slot < cells_.size(); slot++) {
+        if (cell_present_[slot]) {
+            visit(cell_addresses_[slot], cells_[slot]);
+        }
+    }
+    if (paged_) {
+        paged_->each(visit);
+    }
+    else {
+        for (const std::pair<const integer_t, integer_t>& entry : heap_) {
+            visit(entry.first, entry.second);
+        }
+    }
+}
+
+// Replaces the state of the VM with a snapshot saved by a VM of the same
+// program, however either kept its heap and stacks. The file is mapped
+// into memory and checked whole before anything changes, and the heap is
+// read from it in place. A heap saved from the map is in address order, so
+// the map grows at its end.
+//
+// Input is read from its start through a counter, and skips as many
+// characters as the snapshot's VM had read. Output continues at its
+// position when the stream already reaches it, as when resuming into the
+// file the run wrote, and otherwise at the end of the stream.
+void VM::restore(const char* path) {
+    SnapshotReader reader(path);
+    if (reader.word() != SNAPSHOT_MAGIC || reader.word() != SNAPSHOT_VERSION) {
+        throw "Not a snapshot of this version\n";
+    }
+    if (reader.word() != programHash(instructions_, strings_)) {
+        throw "Snapshot is of a different program\n";
+    }
+    unsigned_t pc = reader.word();
+    unsigned_t instructions = reader.word();
+    unsigned_t peak_stack = reader.word();
+    unsigned_t peak_call_depth = reader.word();
+    integer_t input = (integer_t) reader.word();
+    integer_t output = (integer_t) reader.word();
+    unsigned_t stack_size = reader.word();
+    const integer_t* stack = (const integer_t*) reader.words(stack_size);
+    unsigned_t call_depth = reader.word();
+    const unsigned_t* calls = reader.words(call_depth);
+    unsigned_t var_count = reader.word();
+    const integer_t* vars = (const integer_t*) reader.words(var_count);
+    unsigned_t heap_cells = reader.word();
+    if (heap_cells > (unsigned_t) -1 / 2) {
+        throw "Snapshot is truncated\n";
+    }
+    const integer_t* heap = (const integer_t*) reader.words(heap_cells * 2);
+    if (!reader.atEnd() || pc > instructions_.size() || var_count != vars_.size() || input < -2 ||
+        call_depth > call_stack_.maxDepth() ||
+        std::any_of(calls, calls + call_depth, [&](unsigned_t call) { return call >= instructions_.size(); })) {
+        throw "Invalid snapshot\n";
+    }
+    if (input == -1) {
+        throw "Snapshot does not record how much input was read\n";
+    }
+    if (input >= 0 && counted_ && (unsigned_t) input < counted_->count()) {
+        throw "Input was read past the snapshot\n";
+    }
+
+    pc_ = pc;
+    stats_.instructions = instructions;
+    stats_.peak_stack = peak_stack;
+    stats_.peak_call_depth = peak_call_depth;
+    stack_.clear();
+    segments_ = SegmentedStack(segments_.segmentEntries());
+    for (unsigned_t i = 0; i < stack_size; i++) {
+        push(stack[i]);
+    }
+    while (!call_stack_.empty()) {
+        call_stack_.pop();
+    }
+    for (unsigned_t i = 0; i < call_depth; i++) {
+        call_stack_.push(calls[i]);
+    }
+    memo_frames_.clear();
+    std::copy(vars, vars + var_count, vars_.begin());
+
+    heap_.clear();
+    if (paged_) {
+        paged_.reset(new PagedHeap(paged_->window()));
+    }
+    std::fill(cells_.begin(), cells_.end(), 0);
+    std::fill(cell_present_.begin(), cell_present_.end(), false);
+    for (unsigned_t i = 0; i < heap_cells; i++) {
+        if (paged_ || !cells_.empty()) {
+            cell(heap[2 * i]) = heap[2 * i + 1];
+        }
+        else {
+            heap_.emplace_hint(heap_.end(), heap[2 * i], heap[2 * i + 1]);
+        }
+    }
+
+    countInput();
+    in_.clear();
+    if (input == -2) {
+        in_.setstate(std::ios::eofbit);
+    }
+    else {
+        in_.ignore(input - counted_->count());
+    }
+    if (output >= 0) {
+        if (out_.seekp(0, std::ios::end) && out_.tellp() >= output) {
+            out_.seekp(output);
+        }
+        out_.clear();
+    }
+    next_checkpoint_ = checkpoint_every_ ? stats_.instructions + checkpoint_every_ : (unsigned long long) -1;
+}
+
+// Notify the profiler of control flow edges during execution
+void VM::setProfiler(Profiler* profiler) {
+    profiler_ = profiler;
+}
+
+// Record opcode n-gram statistics for every executed instruction
+void VM::setOpStats(OpStats* opstats) {
+    opstats_ = opstats;
+}
+
+// Stop with a runtime error once this many instructions have executed, or
+// never when 0
+void VM::setFuel(unsigned long long fuel) {
+    fuel_ = fuel;
+}
+
+// Strings output by write instructions
+void VM::setStrings(const std::vector<std::string>& strings) {
+    strings_ = strings;
+}
+
+// Cache the results of calls to pure subroutines in this many entries, or
+// stop caching when 0. A call that hits the cache replaces its arguments
+// with the results and skips the subroutine, so it executes no
+// instructions and takes no call stack.
+void VM::setMemoization(size_t entries) {
+    memo_frames_.clear();
+    if (entries == 0) {
+        pure_.clear();
+        memo_.reset();
+        return;
+    }
+    pure_ = findPureSubroutines(instructions_);
+    memo_.reset(new MemoCache(entries));
+}
+
+// Keep the heap in a window of this many cells of reserved virtual memory,
+// committed a page at a time, or in the map when 0. Cells already in the
+// heap are moved over.
+void VM::setPagedHeap(integer_t window) {
+    std::map<integer_t, integer_t> heap = paged_ ? paged_->cells() : heap_;
+    heap_.clear();
+    paged_.reset(window ? new PagedHeap(window) : NULL);
+    for (const std::pair<const integer_t, integer_t>& entry : heap) {
+        if (paged_) {
+            paged_->at(entry.first) = entry.second;
+        }
+        else {
+            heap_[entry.first] = entry.second;
+        }
+    }
+}
+
+// Keep the operand stack of execute in a guarded region of this many
+// entries, where popping an empty stack or pushing a full one traps rather
+// than being checked, or in the vector when 0. A full stack is a runtime
+// error. Where the region is not supported, the VM stays checked, and it
+// also does while profiling, sampling, or recording opcode statistics.
+void VM::setGuardedStack(size_t capacity) {
+    guarded_.reset(capacity && GuardedStack::supported() ? new GuardedStack(capacity) : NULL);
+}
+
+// Move the bottom of the operand stack into segments of this many entries
+// once it grows to two segments, so that it grows without copying, or keep
+// it in one vector when 0
+void VM::setStackSegment(size_t entries) {
+    gatherStack();
+    segments_ = SegmentedStack(entries ? entries : STACK_SEGMENT_ENTRIES);
+    spill_at_ = entries ? 2 * entries : (size_t) -1;
+}
+
+// Allow calls this many deep before a runtime error, and clear the call
+// stack
+void VM::setCallStackDepth(size_t depth) {
+    call_stack_ = ReturnStack(depth);
+}
+
+// Save a snapshot to this path during execute every so many instructions,
+// or only when requested when 0, or never when the path is NULL. Each
+// snapshot replaces the last once it is written whole. Input is counted
+// from this call, so it belongs before the first read.
+void VM::setCheckpoint(const char* path, unsigned long long every) {
+    if (path) {
+        countInput();
+    }
+    checkpoint_ = path ? path : "";
+    checkpoint_every_ = every;
+    next_checkpoint_ = every ? stats_.instructions + every : (unsigned long long) -1;
+}
+
+// Reads input through a counter from here on, so that snapshots record
+// how much was read
+void VM::countInput() {
+    if (!counted_) {
+        std::ios::iostate state = in_.rdstate();
+        counted_.reset(new CountingInput(in_.rdbuf()));
+        in_.rdbuf(counted_.get());
+        in_.clear(state);
+    }
+}
+
+// Save a snapshot before the next instruction of a VM with a checkpoint
+// path. It only sets a flag, so a signal handler may call it.
+void VM::requestCheckpoint() {
+    checkpoint_requested = 1;
+}
+
+// Let the sampler follow the program counter and call stack
+void VM::setSampler(Sampler* sampler) {
+    sampler_ = sampler;
+    if (sampler_) {
+        sampler_->track(&pc_, &call_stack_);
+    }
 }
 
 // Private
@@ -260,11 +944,126 @@ void VM::initLabels() {
     }
 }
 
+void VM::initVars() {
+    for (const Instruction& instr : instructions_) {
+        if ((instr.type == LOADVAR || instr.type == STOREVAR) && (size_t) instr.value >= vars_.size()) {
+            vars_.resize(instr.value + 1);
+        }
+    }
+}
+
+// Gives each address of a loadcell or storecell a slot and rewrites their
+// arguments to it, so they skip the heap map
+void VM::initCells() {
+    for (const Instruction& instr : instructions_) {
+        if (instr.type == LOADCELL || instr.type == STORECELL) {
+            cell_addresses_.push_back(instr.value);
+        }
+    }
+    std::sort(cell_addresses_.begin(), cell_addresses_.end());
+    cell_addresses_.erase(std::unique(cell_addresses_.begin(), cell_addresses_.end()), cell_addresses_.end());
+    cells_.assign(cell_addresses_.size(), 0);
+    cell_present_.assign(cell_addresses_.size(), false);
+    for (Instruction& instr : instructions_) {
+        if (instr.type == LOADCELL || instr.type == STORECELL) {
+            instr.value = std::lower_bound(cell_addresses_.begin(), cell_addresses_.end(), instr.value) - cell_addresses_.begin();
+        }
+    }
+}
+
+// Heap cell at an address, whether promoted or in the map. The optimizer
+// only promotes cells when no access has a computed address, so the search
+// only happens for hand-written programs.
+inline integer_t& VM::cell(integer_t address) {
+    if (!cells_.empty()) {
+        std::vector<integer_t>::iterator slot = std::lower_bound(cell_addresses_.begin(), cell_addresses_.end(), address);
+        if (slot != cell_addresses_.end() && *slot == address) {
+            cell_present_[slot - cell_addresses_.begin()] = true;
+            return cells_[slot - cell_addresses_.begin()];
+        }
+    }
+    return paged_ ? paged_->at(address) : heap_[address];
+}
+
+// Value of a heap cell, which a paged heap reads without committing memory
+inline integer_t VM::load(integer_t address) {
+    return paged_ && cells_.empty() ? paged_->load(address) : cell(address);
+}
+
+// Moves the segments of the stack back into the vector
+void VM::gatherStack() {
+    if (segments_.size() > 0) {
+        stack_ = getStack();
+        segments_ = SegmentedStack(segments_.segmentEntries());
+    }
+}
+
+// Saves a snapshot beside the checkpoint path and renames it over the
+// path, so that a crash while saving leaves the last one
+void VM::checkpoint() {
+    checkpoint_requested = 0;
+    std::string temporary = checkpoint_ + ".tmp";
+    std::ofstream file(temporary.c_str(), std::ios::binary);
+    save(file);
+    file.close();
+    if (!file || std::rename(temporary.c_str(), checkpoint_.c_str()) != 0) {
+        throw "Unable to write snapshot\n";
+    }
+    next_checkpoint_ = checkpoint_every_ ? stats_.instructions + checkpoint_every_ : (unsigned long long) -1;
+}
+
+// Replaces the arguments of a call to a pure subroutine with its cached
+// results and continues after the call, or returns false when the call has
+// to run, noting its arguments to cache the results on return
+bool VM::recall(integer_t label) {
+    std::map<integer_t, PureSubroutine>::const_iterator pure = pure_.find(label);
+    if (pure == pure_.end() || stack_.size() < pure->second.args) {
+        return false;
+    }
+    const integer_t* args = stack_.data() + stack_.size() - pure->second.args;
+    const std::vector<integer_t>* results = memo_->find(label, args, pure->second.args);
+    if (!results) {
+        stats_.memo_misses++;
+        memo_frames_.push_back(MemoFrame{call_stack_.size() + 1, label,
+                                         std::vector<integer_t>(args, args + pure->second.args), pure->second.results});
+        return false;
+    }
+    stats_.memo_hits++;
+    stack_.resize(stack_.size() - pure->second.args);
+    for (integer_t result : *results) {
+        push(result);
+    }
+    pc_++;
+    if (profiler_) {
+        profiler_->resumeBlock(pc_);
+    }
+    return true;
+}
+
+// Caches the results of the innermost call that missed, which is returning
+void VM::remember() {
+    const MemoFrame& frame = memo_frames_.back();
+    if (stack_.size() >= frame.results) { // Unless some were moved into a segment
+        memo_->insert(frame.label, frame.args.data(), frame.args.size(),
+                      stack_.data() + stack_.size() - frame.results, frame.results);
+    }
+    memo_frames_.pop_back();
+}
+
 void VM::push(integer_t value) {
+    if (stack_.size() >= spill_at_) {
+        segments_.spill(stack_);
+    }
     stack_.push_back(value);
+    if (segments_.size() + stack_.size() > stats_.peak_stack) {
+        stats_.peak_stack = segments_.size() + stack_.size();
+    }
 }
 
 void VM::drop() {
+    if (stack_.size() < 1 && segments_.size() > 0) {
+        segments_.fill(stack_);
+    }
     if (stack_.size() >= 1) {
         stack_.pop_back();
     }
@@ -278,7 +1077,10 @@ integer_t VM::pop() {
 
 integer_t VM::top() {
     if (stack_.size() < 1) {
-        throw "Runtime Error: Stack underflow\n";
+        if (segments_.size() == 0) {
+            throw "Runtime Error: Stack underflow\n";
+        }
+        segments_.fill(stack_);
     }
     return stack_.back();
 }
@@ -3,22 +3,70 @@
 
 #include <iostream>
 #include <vector>
-#include <stack>
 #include <map>
+#include <memory>
+#include <string>
+#include "heap.h"
 #include "instruction.h"
+#include "memo.h"
+#include "opstats.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "snapshot.h"
+#include "stack.h"
 
 namespace WS {
 
+// Resource usage of a VM, cheap enough to always be collected
+struct VMStats {
+    unsigned long long instructions = 0;
+    size_t peak_stack = 0;      // Operand stack entries
+    size_t peak_call_depth = 0;
+    size_t heap_cells = 0;
+    size_t heap_bytes = 0;      // Estimated from the map node size, or committed by the paged heap
+    unsigned long long allocations = 0; // Estimated stack reallocations and heap cells created
+    double wall_seconds = 0;    // Time spent in VM::execute
+    unsigned long long memo_hits = 0;   // Calls to pure subroutines answered from the cache
+    unsigned long long memo_misses = 0; // Calls to pure subroutines that ran
+};
+
+// Unbuffered view of an input stream that counts the characters taken
+// from it, so that a snapshot knows how much input was read even from a
+// pipe, which cannot tell its position. Every character costs virtual
+// calls, so a VM only reads through it once it takes or restores snapshots.
+class CountingInput : public std::streambuf {
+public:
+    explicit CountingInput(std::streambuf* source) : source_(source), count_(0) {}
+
+    unsigned long long count() const { return count_; }
+
+protected:
+    int_type underflow() { return source_->sgetc(); }
+    int_type uflow() {
+        int_type c = source_->sbumpc();
+        count_ += !traits_type::eq_int_type(c, traits_type::eof());
+        return c;
+    }
+
+private:
+    std::streambuf* source_;
+    unsigned long long count_;
+};
+
 class VM {
 public:
     VM(std::vector<Instruction> instructions, std::istream &in, std::ostream &out)
-        : instructions_(instructions), pc_(0), in_(in), out_(out) {
+        : instructions_(instructions), spill_at_(2 * STACK_SEGMENT_ENTRIES), pc_(0), in_(in.rdbuf()), out_(out), profiler_(NULL), sampler_(NULL), opstats_(NULL), fuel_(0), checkpoint_every_(0), next_checkpoint_(0) {
+        in_.tie(in.tie()); // So std::cin still flushes std::cout before a read
         initLabels();
+        initVars();
+        initCells();
     }
 
     VM(std::vector<Instruction> instructions) : VM(instructions, std::cin, std::cout) {}
 
     void execute();
+    bool executeUntilRead();
 
     void instrPush(integer_t value);
     void instrDup();
@@ -52,20 +100,87 @@ public:
     void instrDebugPrintStack();
     void instrDebugPrintHeap();
 
+    void instrAddI(integer_t value);
+    void instrShl(integer_t shift);
+    void instrShr(integer_t shift);
+    void instrLoadVar(integer_t var);
+    void instrStoreVar(integer_t var);
+    void instrLoadCell(integer_t slot);
+    void instrStoreCell(integer_t slot);
+    void instrWrite(integer_t string);
+    void instrFastDiv();
+    void instrFastMod();
+
     std::vector<integer_t> getStack() const;
     std::map<integer_t, integer_t> getHeap() const;
+    VMStats getStats() const;
+
+    void save(std::ostream& out) const;
+    void restore(const char* path);
+
+    void setProfiler(Profiler* profiler);
+    void setSampler(Sampler* sampler);
+    void setOpStats(OpStats* opstats);
+    void setFuel(unsigned long long fuel);
+    void setStrings(const std::vector<std::string>& strings);
+    void setMemoization(size_t entries);
+    void setPagedHeap(integer_t window);
+    void setGuardedStack(size_t capacity);
+    void setStackSegment(size_t entries);
+    void setCallStackDepth(size_t depth);
+    void setCheckpoint(const char* path, unsigned long long every);
+    static void requestCheckpoint();
 
   private:
     std::vector<Instruction> instructions_;
-    std::vector<integer_t> stack_;
+    std::vector<integer_t> stack_; // Top of the stack, or all of it while small
+    SegmentedStack segments_; // Bottom of a large stack
+    size_t spill_at_; // Size of stack_ at which its bottom moves into a segment
     std::map<integer_t, integer_t> heap_;
+    std::unique_ptr<PagedHeap> paged_; // Replaces heap_ when set
     std::map<integer_t, size_t> labels_;
-    std::stack<size_t> call_stack_;
+    std::vector<integer_t> vars_; // Introduced by the optimizer, not part of the heap
+    std::vector<integer_t> cells_; // Heap cells promoted by the optimizer, indexed by slot
+    std::vector<integer_t> cell_addresses_; // Sorted, so a slot's address is at its index
+    std::vector<char> cell_present_; // Whether the cell exists in the heap
+    std::vector<std::string> strings_; // Output computed ahead of time
+    ReturnStack call_stack_; // Addresses of the calls
     size_t pc_;
-    std::istream &in_;
+    std::istream in_; // Over the buffer of the stream given
+    std::unique_ptr<CountingInput> counted_; // In front of that buffer once snapshots need it
     std::ostream &out_;
-
+    Profiler* profiler_;
+    Sampler* sampler_;
+    OpStats* opstats_;
+    unsigned long long fuel_;
+    std::string checkpoint_; // Path of snapshots taken during execute, or empty
+    unsigned long long checkpoint_every_;
+    unsigned long long next_checkpoint_; // Instructions executed at the next periodic snapshot
+    std::unique_ptr<GuardedStack> guarded_; // Holds the stack during execute when set
+    VMStats stats_;
+    std::map<integer_t, PureSubroutine> pure_; // Subroutines that may be memoized
+    std::unique_ptr<MemoCache> memo_;
+    struct MemoFrame {
+        size_t depth; // Of the call stack within the call
+        integer_t label;
+        std::vector<integer_t> args;
+        size_t results;
+    };
+    std::vector<MemoFrame> memo_frames_; // Calls that missed, whose results are cached on return
+
+    void step(const Instruction& instr);
+    void executeGuarded();
+    void runGuarded();
     void initLabels();
+    void initVars();
+    void initCells();
+    void gatherStack();
+    void checkpoint();
+    void countInput();
+    integer_t& cell(integer_t address);
+    integer_t load(integer_t address);
+    bool recall(integer_t label);
+    void remember();
     void push(integer_t value);
     void drop();
     integer_t pop();
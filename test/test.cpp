@@ -1,12 +1,32 @@
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS // SIGSTKSZ is no longer a constant in glibc 2.34+
 
 #include "catch.hpp"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <map>
+#include "../src/cfg.h"
+#include "../src/emitter.h"
+#include "../src/engine.h"
+#include "../src/forkserver.h"
+#include "../src/heap.h"
 #include "../src/instruction.h"
+#include "../src/memo.h"
+#include "../src/opstats.h"
+#include "../src/optimizer.h"
 #include "../src/parser.h"
+#include "../src/profiler.h"
+#include "../src/ranges.h"
+#include "../src/regvm.h"
+#include "../src/sampler.h"
+#include "../src/snapshot.h"
+#include "../src/specializer.h"
+#include "../src/stack.h"
 #include "../src/vm.h"
 
 using namespace WS;
@@ -45,6 +65,22 @@ void testProgram(std::vector<Instruction> program, std::vector<integer_t> stack,
     REQUIRE(vm.getHeap() == heap);
 }
 
+// Runs a program on a VM set up by the configure step, filling in what
+// the engines compare, and returns the VM's statistics
+VMStats runConfigured(const std::vector<Instruction>& program, const std::string& input,
+                      const std::function<void(VM&)>& configure, Execution& execution) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    VM vm(program, in, out);
+    configure(vm);
+    execution = Execution();
+    try { vm.execute(); } catch (const char* e) { execution.error = e; }
+    execution.output = out.str();
+    execution.stack = vm.getStack();
+    execution.heap = vm.getHeap();
+    return vm.getStats();
+}
+
 TEST_CASE("VM executes simple stack instructions", "[vm]") {
     const std::vector<integer_t> stack{1, 2, 3, 4, 5};
     std::istringstream in;
@@ -96,3 +132,1191 @@ TEST_CASE("Test programs", "[programs]") {
         testProgramOutput(parseProgram("programs/hello-world.ws"), "", "Hello, World!\n");
     }
 }
+
+TEST_CASE("Profiler counts blocks, branches, and calls", "[profiler]") {
+    std::vector<Instruction> program{
+        Instruction(PUSH, 3),
+        Instruction(LABEL, 0),
+        Instruction(CALL, 1),
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, 2),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 2),
+        END,
+        Instruction(LABEL, 1),
+        RET
+    };
+    std::istringstream in;
+    std::ostringstream out, json;
+    VM vm(program, in, out);
+    Profiler profiler(program);
+    vm.setProfiler(&profiler);
+    vm.execute();
+    profiler.writeJSON(json);
+
+    REQUIRE(profiler.executed() == 29);
+    REQUIRE(json.str().find("{\"start\": 1, \"end\": 3, \"label\": 0, \"count\": 3}") != std::string::npos);
+    REQUIRE(json.str().find("{\"start\": 3, \"end\": 7, \"count\": 3, \"taken\": 1, \"not_taken\": 2}") != std::string::npos);
+    REQUIRE(json.str().find("{\"start\": 10, \"end\": 12, \"label\": 1, \"count\": 3, \"calls\": 3, \"inclusive\": 6}") != std::string::npos);
+}
+
+TEST_CASE("Sampler attributes samples to folded label stacks", "[sampler]") {
+    std::vector<Instruction> program{
+        Instruction(PUSH, 1000000),
+        Instruction(LABEL, 0),
+        Instruction(CALL, 1),
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JN, 2),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 2),
+        END,
+        Instruction(LABEL, 1),
+        DUP,
+        DROP,
+        RET
+    };
+    std::istringstream in;
+    std::ostringstream out, folded;
+    VM vm(program, in, out);
+    Sampler sampler(program, 2000);
+    vm.setSampler(&sampler);
+    sampler.start();
+    vm.execute();
+    sampler.stop();
+    sampler.writeFolded(folded);
+
+    // Whether SIGPROF fires during so short a run depends on the machine,
+    // so the timed run only has to finish; samples are taken directly
+    REQUIRE(sampler.labelAt(0) == -1);
+    REQUIRE(sampler.labelAt(12) == 1);
+    size_t sampled_pc = 12;
+    ReturnStack sampled_calls;
+    sampled_calls.push(2);
+    Sampler direct(program);
+    direct.track(&sampled_pc, &sampled_calls);
+    direct.start();
+    direct.sample();
+    direct.sample();
+    direct.stop();
+    std::ostringstream direct_folded;
+    direct.writeFolded(direct_folded);
+    REQUIRE(direct.samples() == 2);
+    REQUIRE(direct_folded.str() == "main;label_1 2\n");
+
+    // Calls deeper than the limit keep their innermost frames
+    std::vector<Instruction> calls_program{
+        Instruction(LABEL, 1), Instruction(CALL, 1), Instruction(CALL, 5), Instruction(LABEL, 2), END
+    };
+    ReturnStack calls;
+    for (size_t i = 0; i < 44; i++) {
+        calls.push(2);
+    }
+    for (size_t i = 0; i < Sampler::MAX_DEPTH; i++) {
+        calls.push(1);
+    }
+    size_t pc = 4;
+    Sampler deep(calls_program);
+    deep.track(&pc, &calls);
+    deep.start();
+    deep.sample();
+    deep.stop();
+    std::ostringstream deep_folded;
+    deep.writeFolded(deep_folded);
+    std::string expected = "main;[truncated]";
+    for (size_t i = 0; i < Sampler::MAX_DEPTH; i++) {
+        expected += ";label_1";
+    }
+    expected += ";label_2 ";
+    REQUIRE(deep_folded.str().compare(0, expected.size(), expected) == 0);
+    REQUIRE(deep_folded.str().find("label_5") == std::string::npos);
+}
+
+TEST_CASE("OpStats records n-grams and branch patterns and merges runs", "[opstats]") {
+    std::vector<Instruction> program{
+        Instruction(PUSH, 2),
+        Instruction(LABEL, 0),
+        Instruction(PUSH, 1),
+        SUB,
+        DUP,
+        Instruction(JZ, 1),
+        Instruction(JMP, 0),
+        Instruction(LABEL, 1),
+        END
+    };
+    std::istringstream in;
+    std::ostringstream out;
+    OpStats stats;
+    VM vm(program, in, out);
+    vm.setOpStats(&stats);
+    vm.execute();
+
+    REQUIRE(stats.runs() == 1);
+    REQUIRE(stats.count(SUB) == 2);
+    REQUIRE(stats.count(PUSH, SUB) == 2);
+    REQUIRE(stats.count(SUB, DUP, JZ) == 2);
+    REQUIRE(stats.count(JMP, LABEL) == 0); // Not adjacent in sequence
+    REQUIRE(stats.branches(SUB, DUP, JZ, true) == 1);
+    REQUIRE(stats.branches(SUB, DUP, JZ, false) == 1);
+
+    std::stringstream file;
+    stats.save(file);
+    OpStats merged;
+    merged.load(file);
+    file.clear();
+    file.seekg(0);
+    merged.load(file);
+    REQUIRE(merged.runs() == 2);
+    REQUIRE(merged.count(SUB, DUP, JZ) == 4);
+    REQUIRE(merged.branches(SUB, DUP, JZ, false) == 2);
+}
+
+TEST_CASE("VM tracks resource usage", "[stats]") {
+    std::istringstream in;
+    std::ostringstream out;
+    VM vm({
+        Instruction(PUSH, 1),
+        Instruction(PUSH, 2),
+        Instruction(PUSH, 3),
+        DROP,
+        DROP,
+        Instruction(CALL, 0),
+        Instruction(PUSH, 10),
+        Instruction(PUSH, 20),
+        STORE,
+        END,
+        Instruction(LABEL, 0),
+        Instruction(CALL, 1),
+        RET,
+        Instruction(LABEL, 1),
+        RET
+    }, in, out);
+    vm.execute();
+    VMStats stats = vm.getStats();
+
+    REQUIRE(stats.instructions == 15);
+    REQUIRE(stats.peak_stack == 3);
+    REQUIRE(stats.peak_call_depth == 2);
+    REQUIRE(stats.heap_cells == 1);
+    REQUIRE(stats.heap_bytes > 0);
+    REQUIRE(stats.allocations >= 2);
+}
+
+TEST_CASE("Emitted Whitespace parses back to the same instructions", "[emitter]") {
+    std::vector<Instruction> program = parseProgram("programs/bottles.generated.ws");
+    program.push_back(Instruction(PUSH, 0));
+    program.push_back(Instruction(PUSH, -1));
+    program.push_back(Instruction(PUSH, -9223372036854775807LL - 1));
+    program.push_back(Instruction(COPY, 12345));
+    program.push_back(Instruction(LABEL, 0));
+    std::ostringstream source;
+    emitWhitespace(source, program);
+
+    FILE* file = tmpfile();
+    fwrite(source.str().data(), 1, source.str().size(), file);
+    rewind(file);
+    Parser parser(file);
+    Instruction instr;
+    for (const Instruction& expected : program) {
+        REQUIRE(parser.next(instr));
+        REQUIRE(instr.type == expected.type);
+        REQUIRE(instr.value == expected.value);
+    }
+    REQUIRE_FALSE(parser.next(instr));
+    fclose(file);
+}
+
+TEST_CASE("Every engine matches the VM, including runtime errors", "[engine]") {
+    const std::vector<Engine>& all = engines();
+    REQUIRE(std::string(all[0].name) == "vm");
+    REQUIRE(findEngine("vm") == &all[0]);
+    REQUIRE(findEngine("missing") == NULL);
+
+    std::vector<std::pair<std::vector<Instruction>, std::string>> cases{
+        {parseProgram("programs/bottles.generated.ws"), ""},
+        {parseProgram("programs/ws/interpreter.generated.ws"), std::string("  \t\n\t\n \t\n\n\n\0", 12)},
+        {{Instruction(PUSH, 7), Instruction(PUSH, 0), DIV}, ""},
+        {{Instruction(PUSH, -9223372036854775807LL - 1), Instruction(PUSH, -1), DIV, Instruction(PUSH, 3), Instruction(PUSH, -1), MOD}, ""},
+        {{Instruction(PUSH, 1), READI, Instruction(PUSH, 2), READI}, "12"},
+        {{Instruction(LABEL, 0), Instruction(JMP, 0)}, ""}
+    };
+    Execution reference = all[0].run(cases[2].first, cases[2].second, 0);
+    REQUIRE(reference.error == "Runtime Error: Division by zero\n");
+    REQUIRE(reference.stack.empty());
+    reference = all[0].run(cases[3].first, cases[3].second, 0);
+    REQUIRE(reference.stack == std::vector<integer_t>{-9223372036854775807LL - 1, 0});
+    reference = all[0].run(cases[4].first, cases[4].second, 0);
+    REQUIRE(reference.heap == (std::map<integer_t, integer_t>{{1, 12}, {2, 0}}));
+    reference = all[0].run(cases[5].first, cases[5].second, 1000);
+    REQUIRE(reference.error == "Runtime Error: Out of fuel\n");
+    cases.pop_back(); // Engines may run out of fuel at different points
+
+    for (const std::pair<std::vector<Instruction>, std::string>& c : cases) {
+        Execution expected = all[0].run(c.first, c.second, 100000);
+        for (const Engine& engine : all) {
+            INFO(engine.name);
+            REQUIRE(engine.run(c.first, c.second, 100000) == expected);
+        }
+    }
+}
+
+TEST_CASE("CFG builds blocks, edges, subroutines, dominators, and loops", "[cfg]") {
+    std::vector<Instruction> program{
+        Instruction(PUSH, 3),   // b0
+        Instruction(LABEL, 1),  // b1, loop header
+        DUP,
+        Instruction(JZ, 2),
+        Instruction(CALL, 10),  // b2
+        Instruction(PUSH, 1),   // b3, latch
+        SUB,
+        Instruction(JMP, 1),
+        Instruction(LABEL, 2),  // b4
+        END,
+        Instruction(LABEL, 10), // b5, subroutine
+        RET,
+        Instruction(PUSH, 5)    // b6, unreachable
+    };
+    CFG cfg(program);
+    REQUIRE(cfg.size() == 7);
+    REQUIRE(cfg.block(1).start == 1);
+    REQUIRE(cfg.block(1).end == 4);
+    REQUIRE(cfg.blockOf(6) == 3);
+
+    auto successors = [&](size_t b) {
+        std::vector<std::pair<size_t, EdgeKind>> edges;
+        for (const Edge& edge : cfg.successors(b)) {
+            edges.push_back(std::make_pair(edge.to, edge.kind));
+        }
+        return edges;
+    };
+    typedef std::vector<std::pair<size_t, EdgeKind>> Edges;
+    REQUIRE(successors(0) == (Edges{{1, EDGE_FALLTHROUGH}}));
+    REQUIRE(successors(1) == (Edges{{4, EDGE_TAKEN}, {2, EDGE_NOT_TAKEN}}));
+    REQUIRE(successors(2) == (Edges{{5, EDGE_CALL}, {3, EDGE_RETURN}}));
+    REQUIRE(successors(3) == (Edges{{1, EDGE_JUMP}}));
+    REQUIRE(successors(4) == (Edges{{CFG::EXIT, EDGE_EXIT}}));
+    REQUIRE(successors(5).empty());
+    REQUIRE(successors(6) == (Edges{{CFG::EXIT, EDGE_FALLTHROUGH}}));
+    REQUIRE(cfg.predecessors(1).size() == 2);
+    REQUIRE(cfg.predecessors(5).begin()->from == 2);
+
+    REQUIRE(cfg.subroutines().size() == 2);
+    REQUIRE(cfg.subroutines()[1].entry == 5);
+    REQUIRE(cfg.subroutines()[1].label == 10);
+    REQUIRE(cfg.subroutines()[1].calls == std::vector<size_t>{2});
+    REQUIRE(cfg.subroutineOf(3) == 0);
+    REQUIRE(cfg.subroutineOf(5) == 1);
+    REQUIRE_FALSE(cfg.reachable(6));
+    REQUIRE(cfg.reversePostorder() == (std::vector<size_t>{0, 1, 2, 3, 4, 5}));
+
+    REQUIRE(cfg.idom(0) == CFG::NONE);
+    REQUIRE(cfg.idom(2) == 1);
+    REQUIRE(cfg.idom(3) == 2);
+    REQUIRE(cfg.idom(4) == 1);
+    REQUIRE(cfg.idom(5) == CFG::NONE);
+    REQUIRE(cfg.dominates(1, 3));
+    REQUIRE_FALSE(cfg.dominates(3, 4));
+    REQUIRE_FALSE(cfg.dominates(0, 5));
+
+    REQUIRE(cfg.loops().size() == 1);
+    const CFG::Loop& loop = cfg.loops()[0];
+    REQUIRE(loop.header == 1);
+    REQUIRE(loop.parent == CFG::NONE);
+    REQUIRE(loop.latches == std::vector<size_t>{3});
+    REQUIRE(loop.blocks.size() == 3);
+    REQUIRE(cfg.loopOf(2) == 0);
+    REQUIRE(cfg.loopDepth(3) == 1);
+    REQUIRE(cfg.loopOf(4) == CFG::NONE);
+    REQUIRE(cfg.inductionVariables(0).empty()); // The call could change anything
+
+    std::vector<Instruction> counting{
+        Instruction(PUSH, 0),
+        Instruction(PUSH, 10), Instruction(PUSH, 0), STORE,
+        Instruction(LABEL, 1),
+        Instruction(PUSH, 10), RETRIEVE, Instruction(PUSH, 1), ADD, Instruction(PUSH, 10), SWAP, STORE,
+        Instruction(PUSH, 2), ADD,
+        DUP, Instruction(PUSH, 100), SUB, Instruction(JN, 1),
+        END
+    };
+    CFG counting_cfg(counting);
+    REQUIRE(counting_cfg.loops().size() == 1);
+    std::vector<InductionVariable> variables = counting_cfg.inductionVariables(0);
+    REQUIRE(variables.size() == 2);
+    REQUIRE((!variables[0].cell && variables[0].where == 0 && variables[0].step == 2));
+    REQUIRE((variables[1].cell && variables[1].where == 10 && variables[1].step == 1));
+    std::ostringstream dot_labels;
+    counting_cfg.writeDot(dot_labels);
+    REQUIRE(dot_labels.str().find("; entry 0 += 2\\l  ; cell 10 += 1\\l") != std::string::npos);
+    counting[13] = DUP; // Each iteration leaves two more entries
+    REQUIRE(CFG(counting).inductionVariables(0).size() == 1);
+    counting[13] = ADD;
+    counting.insert(counting.begin() + 17, Instruction(PUSH, 10));
+    counting.insert(counting.begin() + 18, RETRIEVE);
+    counting.insert(counting.begin() + 19, Instruction(PUSH, 10));
+    counting.insert(counting.begin() + 20, SWAP);
+    counting.insert(counting.begin() + 21, STORE); // A second store to the cell
+    std::vector<InductionVariable> entries = CFG(counting).inductionVariables(0);
+    REQUIRE(entries.size() == 1);
+    REQUIRE_FALSE(entries[0].cell);
+
+    std::ostringstream dot;
+    cfg.writeDot(dot);
+    REQUIRE(dot.str().find("digraph cfg {") == 0);
+    REQUIRE(dot.str().find("b2 -> b5 [style=dashed, label=\"call\"];") != std::string::npos);
+    REQUIRE(dot.str().find("label=\"unreachable\"") != std::string::npos);
+}
+
+TEST_CASE("Optimizer folds blocks and removes dead code without changing behavior", "[optimizer]") {
+    auto optimized = [](const std::vector<Instruction>& program) {
+        std::vector<std::pair<InstructionType, integer_t>> code;
+        for (const Instruction& instr : optimize(program, 1)) {
+            code.push_back(std::make_pair(instr.type, instr.type == PUSH || instr.type == COPY || instr.type == SLIDE ||
+                                          instr.type == LABEL || instr.type == JMP ? instr.value : 0));
+        }
+        return code;
+    };
+    typedef std::vector<std::pair<InstructionType, integer_t>> Code;
+
+    SECTION("Constants fold and dead values disappear") {
+        REQUIRE(optimized({Instruction(PUSH, 3), Instruction(PUSH, 4), MUL, PRINTI}) ==
+                (Code{{PUSH, 12}, {PRINTI, 0}}));
+        REQUIRE(optimized({Instruction(PUSH, 1), Instruction(PUSH, 2), DROP, DUP, ADD, Instruction(PUSH, 9), SWAP, DROP}) ==
+                (Code{{PUSH, 9}}));
+        REQUIRE(optimized({Instruction(PUSH, 7), RETRIEVE, Instruction(PUSH, 0), ADD, DUP, DROP, PRINTI}) ==
+                (Code{{PUSH, 7}, {RETRIEVE, 0}, {PRINTI, 0}}));
+    }
+    SECTION("Instructions that can fail are kept") {
+        REQUIRE(optimized({Instruction(PUSH, 7), Instruction(PUSH, 0), DIV}) ==
+                (Code{{PUSH, 7}, {PUSH, 0}, {DIV, 0}}));
+        REQUIRE(optimized({Instruction(PUSH, 1), ADD, Instruction(PUSH, 2), Instruction(PUSH, 3), ADD}) ==
+                (Code{{PUSH, 1}, {ADD, 0}, {PUSH, 5}}));
+    }
+    SECTION("Constant branches and unreachable blocks are removed") {
+        REQUIRE(optimized({Instruction(PUSH, 0), Instruction(JZ, 1), Instruction(PUSH, 5), PRINTI,
+                           Instruction(LABEL, 1), END, Instruction(LABEL, 2), RET}) ==
+                (Code{{END, 0}}));
+    }
+    SECTION("Small leaf subroutines are inlined") {
+        std::vector<Instruction> program{Instruction(PUSH, 2), Instruction(CALL, 1), PRINTI, END,
+                                         Instruction(LABEL, 1), Instruction(PUSH, 3), MUL, RET};
+        REQUIRE(optimized(program) == (Code{{PUSH, 2}, {CALL, 0}, {PRINTI, 0}, {END, 0}, {LABEL, 1}, {PUSH, 3}, {MUL, 0}, {RET, 0}}));
+        std::vector<std::pair<InstructionType, integer_t>> code;
+        for (const Instruction& instr : optimize(program, 2)) {
+            code.push_back(std::make_pair(instr.type, instr.type == PUSH ? instr.value : 0));
+        }
+        REQUIRE(code == (Code{{PUSH, 6}, {PRINTI, 0}, {END, 0}}));
+    }
+    SECTION("Tail recursion runs in constant call stack") {
+        // Counts down from the argument, recursing in tail position
+        std::vector<Instruction> program{
+            Instruction(PUSH, 100000), Instruction(CALL, 1), PRINTI, END,
+            Instruction(LABEL, 1), DUP, Instruction(JZ, 2), Instruction(PUSH, 1), SUB, Instruction(CALL, 1), RET,
+            Instruction(LABEL, 2), RET
+        };
+        std::istringstream in(""), optimized_in("");
+        std::ostringstream out, optimized_out;
+        VM vm(program, in, out);
+        vm.execute();
+        VM optimized_vm(optimize(program, 2), optimized_in, optimized_out);
+        optimized_vm.execute();
+        REQUIRE(out.str() == "0");
+        REQUIRE(optimized_out.str() == "0");
+        REQUIRE(vm.getStats().peak_call_depth == 100001);
+        REQUIRE(optimized_vm.getStats().peak_call_depth <= 1);
+    }
+    SECTION("Loop steps and powers of two become fused instructions") {
+        REQUIRE(reduceStrength({Instruction(PUSH, 1), ADD, Instruction(PUSH, 3), SUB, Instruction(PUSH, 8), MUL,
+                                Instruction(PUSH, 4), DIV, Instruction(PUSH, 6), DIV}).size() == 6);
+        std::vector<Instruction> program;
+        for (integer_t value : std::vector<integer_t>{-9, -8, -7, -1, 0, 7, 9, -9223372036854775807LL - 1}) {
+            for (integer_t divisor : std::vector<integer_t>{2, 4, 1LL << 62}) {
+                std::vector<Instruction> divide{Instruction(PUSH, value), Instruction(PUSH, divisor), DIV, PRINTI,
+                                                Instruction(PUSH, value), Instruction(PUSH, divisor), MUL, PRINTI};
+                program.insert(program.end(), divide.begin(), divide.end());
+            }
+        }
+        std::vector<Instruction> reduced = reduceStrength(program);
+        REQUIRE(std::count_if(reduced.begin(), reduced.end(), [](const Instruction& instr) { return instr.type == SHR; }) == 24);
+        compareProgramOutput(program, reduced, "");
+    }
+    SECTION("Invariant heap loads are hoisted out of loops") {
+        // Sums heap[7] into heap[8] three times, with heap[7] loaded at the
+        // start of the header
+        std::vector<Instruction> program{
+            Instruction(PUSH, 7), Instruction(PUSH, 5), STORE, Instruction(PUSH, 3),
+            Instruction(LABEL, 0), Instruction(PUSH, 7), RETRIEVE, Instruction(PUSH, 8), RETRIEVE, ADD,
+            Instruction(PUSH, 8), SWAP, STORE, Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+            Instruction(LABEL, 1), Instruction(PUSH, 8), RETRIEVE, PRINTI, END
+        };
+        std::vector<Instruction> hoisted = hoistInvariantLoads(program);
+        REQUIRE(std::count_if(hoisted.begin(), hoisted.end(), [](const Instruction& instr) { return instr.type == LOADVAR; }) == 1);
+        REQUIRE(std::count_if(hoisted.begin(), hoisted.end(), [](const Instruction& instr) { return instr.type == STOREVAR; }) == 1);
+        compareProgramOutput(program, hoisted, "");
+        compareProgramOutput(program, optimize(program, 3), "");
+
+        // A store to an unknown address may change any cell
+        program[10] = Instruction(COPY, 1);
+        REQUIRE(hoistInvariantLoads(program).size() == program.size());
+    }
+    SECTION("Invariant expressions are hoisted out of loops") {
+        // Prints heap[7] * 4 + 1 three times
+        std::vector<Instruction> program{
+            Instruction(PUSH, 7), Instruction(PUSH, 5), STORE, Instruction(PUSH, 3),
+            Instruction(LABEL, 0), Instruction(PUSH, 7), RETRIEVE, Instruction(PUSH, 4), MUL, Instruction(PUSH, 1), ADD, PRINTI,
+            Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+            Instruction(LABEL, 1), END
+        };
+        std::vector<Instruction> hoisted = hoistInvariantLoads(program);
+        REQUIRE(std::count_if(hoisted.begin(), hoisted.end(), [](const Instruction& instr) { return instr.type == LOADVAR; }) == 2);
+        REQUIRE(std::count_if(hoisted.begin(), hoisted.end(), [](const Instruction& instr) { return instr.type == STOREVAR; }) == 2);
+        REQUIRE(std::count_if(hoisted.begin(), hoisted.end(), [](const Instruction& instr) { return instr.type == MUL; }) == 1);
+        compareProgramOutput(program, hoisted, "");
+        compareProgramOutput(program, optimize(program, 3), "");
+        std::istringstream in, hoisted_in;
+        std::ostringstream out, hoisted_out;
+        VM vm(program, in, out), hoisted_vm(hoisted, hoisted_in, hoisted_out);
+        vm.execute();
+        hoisted_vm.execute();
+        REQUIRE(hoisted_out.str() == "212121");
+        // Five fewer instructions per iteration, for ten in the preheader
+        REQUIRE(hoisted_vm.getStats().instructions == vm.getStats().instructions - 3 * 5 + 10);
+
+        // The same expression of a variable the loop stores stays in the loop
+        std::vector<Instruction> stored{
+            Instruction(PUSH, 3), Instruction(LABEL, 0), Instruction(LOADVAR, 0), Instruction(ADDI, 2), PRINTI,
+            DUP, Instruction(STOREVAR, 0), Instruction(ADDI, -1), DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+            Instruction(LABEL, 1), END
+        };
+        REQUIRE(hoistInvariantLoads(stored).size() == stored.size());
+        stored[6] = DROP;
+        REQUIRE(hoistInvariantLoads(stored).size() == stored.size() + 3);
+        compareProgramOutput(stored, hoistInvariantLoads(stored), "");
+    }
+    SECTION("Heap cells only accessed at constant addresses are promoted") {
+        // heap[7] is only accessed by pushes right before, but heap[8] is
+        // stored through a swap of its address
+        std::vector<Instruction> program{
+            Instruction(PUSH, 7), Instruction(PUSH, 5), STORE, Instruction(PUSH, 3),
+            Instruction(LABEL, 0), Instruction(PUSH, 7), RETRIEVE, Instruction(PUSH, 8), RETRIEVE, ADD,
+            Instruction(PUSH, 8), SWAP, STORE, Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+            Instruction(LABEL, 1), Instruction(PUSH, 8), RETRIEVE, PRINTI, Instruction(PUSH, 9), RETRIEVE, END
+        };
+        std::vector<Instruction> promoted = promoteCells(program);
+        REQUIRE(std::count_if(promoted.begin(), promoted.end(), [](const Instruction& instr) { return instr.type == STORECELL; }) == 1);
+        REQUIRE(std::count_if(promoted.begin(), promoted.end(), [](const Instruction& instr) { return instr.type == LOADCELL; }) == 2);
+        REQUIRE(std::count_if(promoted.begin(), promoted.end(), [](const Instruction& instr) { return instr.type == STORE; }) == 1);
+        compareProgramOutput(program, promoted, "");
+        std::istringstream in, promoted_in;
+        std::ostringstream out, promoted_out;
+        VM vm(program, in, out), promoted_vm(promoted, promoted_in, promoted_out);
+        vm.execute();
+        promoted_vm.execute();
+        REQUIRE(promoted_out.str() == out.str());
+        REQUIRE(out.str() == "15");
+        REQUIRE(promoted_vm.getHeap() == vm.getHeap());
+        REQUIRE(promoted_vm.getStack() == vm.getStack());
+        REQUIRE(promoted_vm.getStats().heap_cells == 3);
+
+        // A retrieve at an unknown address may read any cell
+        program[22] = Instruction(COPY, 0);
+        REQUIRE(promoteCells(program).size() == program.size());
+
+        // Cells stay in the heap when accessed at computed addresses
+        testProgram({Instruction(PUSH, 4), Instruction(STORECELL, 2), Instruction(PUSH, 1), Instruction(PUSH, 1), ADD, RETRIEVE,
+                     Instruction(PUSH, 1), DUP, ADD, Instruction(PUSH, 6), STORE, Instruction(LOADCELL, 2)},
+                    {4, 6}, {{2, 6}});
+    }
+    SECTION("Programs behave the same") {
+        std::vector<Instruction> bottles = parseProgram("programs/bottles.generated.ws");
+        compareProgramOutput(bottles, optimize(bottles, 1), "");
+        REQUIRE(optimize(bottles, 0).size() == bottles.size());
+    }
+}
+
+TEST_CASE("Range analysis decides branches and removes division checks", "[ranges]") {
+    auto types = [](const std::vector<Instruction>& program) {
+        std::vector<InstructionType> types;
+        for (const Instruction& instr : program) {
+            types.push_back(instr.type);
+        }
+        return types;
+    };
+    // Divides by a heap cell plus one, after a branch on it
+    std::vector<Instruction> program{
+        Instruction(PUSH, 1), Instruction(PUSH, 7), STORE,
+        Instruction(PUSH, 100), Instruction(PUSH, 1), RETRIEVE, Instruction(PUSH, 1), ADD,
+        DUP, Instruction(JZ, 0),
+        DIV, PRINTI, END,
+        Instruction(LABEL, 0), END
+    };
+
+    SECTION("Stack slots and heap cells have ranges") {
+        RangeAnalysis ranges(program);
+        Range top;
+        REQUIRE(ranges.top(9, top));
+        REQUIRE(top.min == 1);
+        REQUIRE(top.max == 8);
+        REQUIRE(ranges.cell(1).min == 0);
+        REQUIRE(ranges.cell(1).max == 7);
+        REQUIRE(ranges.cell(2).max == 0);
+        REQUIRE(!ranges.top(0, top));
+
+        // Overflow and growing loop counters have the full range
+        ranges = RangeAnalysis({
+            Instruction(PUSH, 0x7fffffffffffffffLL), Instruction(PUSH, 1), ADD, Instruction(PUSH, 0),
+            Instruction(LABEL, 1), Instruction(PUSH, 1), ADD, DUP, Instruction(JZ, 2), Instruction(JMP, 1),
+            Instruction(LABEL, 2)
+        });
+        REQUIRE(ranges.top(3, top));
+        REQUIRE(top.full());
+        REQUIRE(ranges.top(8, top));
+        REQUIRE(top.max == 0x7fffffffffffffffLL);
+    }
+    SECTION("Decided branches and safe divisions are rewritten") {
+        REQUIRE(types(narrowRanges(program)) == (std::vector<InstructionType>{
+            PUSH, PUSH, STORE, PUSH, PUSH, RETRIEVE, PUSH, ADD, DUP, DROP, FASTDIV, PRINTI, END, LABEL, END
+        }));
+
+        // A character read is at most 255, so the branch is always taken
+        std::vector<Instruction> read{
+            Instruction(PUSH, 0), READC, Instruction(PUSH, 0), RETRIEVE, Instruction(PUSH, 300), SUB,
+            Instruction(JN, 0), Instruction(PUSH, 1), PRINTI, Instruction(LABEL, 0)
+        };
+        REQUIRE(types(narrowRanges(read)) == (std::vector<InstructionType>{
+            PUSH, READC, PUSH, RETRIEVE, PUSH, SUB, DROP, JMP, PUSH, PRINTI, LABEL
+        }));
+
+        // Division by a value that may be 0 or -1, or a branch on an entry
+        // that may not exist, keeps its checks
+        std::vector<Instruction> unknown{
+            Instruction(PUSH, 0), READI, Instruction(PUSH, 5), Instruction(PUSH, 0), RETRIEVE, DIV, Instruction(JZ, 0),
+            Instruction(LABEL, 0), Instruction(JZ, 0)
+        };
+        REQUIRE(types(narrowRanges(unknown)) == types(unknown));
+    }
+    SECTION("Every engine agrees on the narrowed program") {
+        for (const char* name : {"vm-O3", "regvm-O3"}) {
+            REQUIRE(findEngine(name)->run(program, "", 0) == findEngine("vm")->run(program, "", 0));
+        }
+        REQUIRE(findEngine("vm")->run(narrowRanges(program), "", 0).output == "12");
+    }
+}
+
+TEST_CASE("Register VM keeps stack values in registers within blocks", "[regvm]") {
+    auto run = [](const std::vector<Instruction>& program, std::string& output, std::vector<integer_t>& stack) {
+        RegisterProgram registers = translateToRegisters(program);
+        std::istringstream in("");
+        std::ostringstream out;
+        RegisterVM vm(registers, in, out);
+        std::string error;
+        try {
+            vm.execute();
+        }
+        catch (const char* e) {
+            error = e;
+        }
+        output = out.str();
+        stack = vm.getStack();
+        return error;
+    };
+    std::string output;
+    std::vector<integer_t> stack;
+
+    SECTION("Stack shuffles and constants become operands") {
+        RegisterProgram registers = translateToRegisters({Instruction(PUSH, 3), Instruction(PUSH, 4), ADD, DUP, SWAP, PRINTI, END});
+        REQUIRE(registers.code.size() == 3);
+        REQUIRE(registers.code[0].op == REG_PRINTI);
+        REQUIRE(registers.code[0].a.immediate);
+        REQUIRE(registers.code[0].a.value == 7);
+        REQUIRE(registers.code[1].op == REG_MOV);
+        REQUIRE(registers.code[2].op == REG_END);
+        REQUIRE(run({Instruction(PUSH, 3), Instruction(PUSH, 4), ADD, DUP, SWAP, PRINTI, END}, output, stack).empty());
+        REQUIRE(output == "7");
+        REQUIRE(stack == std::vector<integer_t>{7});
+    }
+    SECTION("Swapped values are put back in order through a temporary") {
+        REQUIRE(run({Instruction(PUSH, 1), Instruction(PUSH, 2), Instruction(LABEL, 0), SWAP, END}, output, stack).empty());
+        REQUIRE(stack == (std::vector<integer_t>{2, 1}));
+    }
+    SECTION("Blocks that would underflow run as stack code") {
+        REQUIRE(run({DROP, Instruction(PUSH, 5), PRINTI, ADD}, output, stack) == "Runtime Error: Stack underflow\n");
+        REQUIRE(output == "5");
+        REQUIRE(stack.empty());
+    }
+    SECTION("Failed divisions leave the stack as the VM does") {
+        REQUIRE(run({Instruction(PUSH, 9), Instruction(PUSH, 8), SWAP, Instruction(PUSH, 0), DIV}, output, stack) ==
+                "Runtime Error: Division by zero\n");
+        REQUIRE(stack == std::vector<integer_t>{8});
+    }
+    SECTION("Programs dispatch fewer instructions") {
+        std::vector<Instruction> bottles = parseProgram("programs/bottles.generated.ws");
+        RegisterProgram registers = translateToRegisters(bottles);
+        std::istringstream in(""), vm_in("");
+        std::ostringstream out, vm_out;
+        RegisterVM vm(registers, in, out);
+        vm.execute();
+        VM reference(bottles, vm_in, vm_out);
+        reference.execute();
+        REQUIRE(out.str() == vm_out.str());
+        REQUIRE(vm.getDispatches() < reference.getStats().instructions * 3 / 5);
+    }
+}
+
+TEST_CASE("Specializer folds known input into a residual program", "[specializer]") {
+    // Specializes to a known prefix, checks the residual program on the
+    // rest of the input against the VM, and counts its executed instructions
+    auto check = [](const std::vector<Instruction>& program, const std::string& input, size_t known,
+                    Specialization& specialization, unsigned long long steps = MAX_STATIC_STEPS) {
+        specialization = specialize(program, input.substr(0, known), steps);
+        std::istringstream in(input), residual_in(input.substr(specialization.consumed));
+        std::ostringstream out, residual_out;
+        VM vm(program, in, out), residual(specialization.program, residual_in, residual_out);
+        std::string error, residual_error;
+        try { vm.execute(); } catch (const char* e) { error = e; }
+        try { residual.execute(); } catch (const char* e) { residual_error = e; }
+        REQUIRE(residual_out.str() == out.str());
+        REQUIRE(residual.getStack() == vm.getStack());
+        REQUIRE(residual.getHeap() == vm.getHeap());
+        REQUIRE(residual_error == error);
+        return residual.getStats().instructions;
+    };
+    auto count = [](const std::vector<Instruction>& program, InstructionType type) {
+        return std::count_if(program.begin(), program.end(), [=](const Instruction& instr) { return instr.type == type; });
+    };
+    Specialization specialization;
+
+    SECTION("Reads of known input become constants") {
+        std::vector<Instruction> program{
+            Instruction(PUSH, 0), READC, Instruction(PUSH, 1), READI, Instruction(PUSH, 0), RETRIEVE, PRINTC,
+            Instruction(PUSH, 1), RETRIEVE, Instruction(PUSH, 2), MUL, PRINTI, Instruction(PUSH, 2), READI
+        };
+        check(program, "a12\n34\n", 5, specialization);
+        REQUIRE(specialization.consumed == 3);
+        REQUIRE(count(specialization.program, READC) == 0);
+        REQUIRE(count(specialization.program, READI) == 1);
+        REQUIRE(count(specialization.program, MUL) == 0);
+    }
+    SECTION("The self-interpreter is specialized to its program") {
+        std::vector<Instruction> interpreter = parseProgram("programs/ws/interpreter.generated.ws");
+        std::ifstream file("programs/hello-world.ws");
+        std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        source += '\0';
+        REQUIRE(check(interpreter, source, source.size(), specialization) * 20 < 7618);
+        REQUIRE(specialization.consumed == source.size());
+        REQUIRE(count(specialization.program, READC) == 0);
+        REQUIRE(count(specialization.program, JZ) == 0);
+
+        // Without its end, the rest of the guest program is dynamic
+        check(interpreter, source, source.size() / 2, specialization);
+        REQUIRE(specialization.consumed == source.size() / 2);
+    }
+    SECTION("Dynamic branches specialize each successor") {
+        // Echoes input up to a zero, counting characters in heap[1]
+        std::vector<Instruction> program{
+            Instruction(PUSH, 1), Instruction(PUSH, 0), STORE,
+            Instruction(LABEL, 0), Instruction(PUSH, 0), READC, Instruction(PUSH, 0), RETRIEVE, DUP, Instruction(JZ, 1),
+            PRINTC, Instruction(PUSH, 1), Instruction(PUSH, 1), RETRIEVE, Instruction(PUSH, 1), ADD, STORE, Instruction(JMP, 0),
+            Instruction(LABEL, 1), Instruction(PUSH, 1), RETRIEVE, PRINTI, END
+        };
+        std::string input = "ab" + std::string(100, 'x') + '\0';
+        check(program, input, 2, specialization);
+        REQUIRE(specialization.consumed == 2);
+        REQUIRE(count(specialization.program, READC) > 0);
+
+        // The count differs in each iteration, so copies of the loop are
+        // bounded before it continues in the original program
+        REQUIRE(count(specialization.program, READC) <= MAX_VARIANTS + 2);
+        check(program, input, 0, specialization);
+        REQUIRE(specialization.program.size() < 4 * program.size() + 16 * MAX_VARIANTS);
+    }
+    SECTION("Runtime errors leave the same stack and heap") {
+        check({Instruction(PUSH, 3), Instruction(PUSH, 4), STORE, Instruction(PUSH, 5), Instruction(PUSH, 0), DIV},
+              "", 0, specialization);
+        check({Instruction(PUSH, 3), Instruction(PUSH, 4), STORE, Instruction(PUSH, 0), READI, Instruction(PUSH, 5),
+               Instruction(PUSH, 0), RETRIEVE, MOD}, "0\n", 0, specialization);
+        check({Instruction(PUSH, 1), Instruction(CALL, 0), END, Instruction(LABEL, 0), Instruction(PUSH, 1), ADD, DROP, DROP, SWAP},
+              "", 0, specialization);
+
+        // Out of steps, a loop continues in the original program
+        std::vector<Instruction> loop{
+            Instruction(PUSH, 1000), Instruction(LABEL, 0), Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1),
+            Instruction(JMP, 0), Instruction(LABEL, 1), Instruction(PUSH, 1), Instruction(PUSH, 0), DIV
+        };
+        REQUIRE(check(loop, "", 0, specialization) < 10);
+        REQUIRE(check(loop, "", 0, specialization, 100) > 4000);
+    }
+}
+
+TEST_CASE("Supercompiled programs write their output ahead of time", "[supercompile]") {
+    auto run = [](const Supercompilation& supercompiled, const std::string& input, Execution& execution) {
+        return runConfigured(supercompiled.program, input, [&](VM& vm) { vm.setStrings(supercompiled.strings); },
+                             execution).instructions;
+    };
+    const Engine* reference = findEngine("vm");
+    Execution execution;
+
+    SECTION("Programs that never read collapse to a single write") {
+        std::vector<Instruction> hello_world = parseProgram("programs/hello-world.ws");
+        Supercompilation supercompiled = supercompile(hello_world);
+        REQUIRE(supercompiled.program.size() == 2);
+        REQUIRE(supercompiled.program[0].type == WRITE);
+        REQUIRE(supercompiled.strings == std::vector<std::string>{"Hello, World!\n"});
+        REQUIRE(run(supercompiled, "", execution) == 2);
+        REQUIRE(execution == reference->run(hello_world, "", 0));
+
+        // The final heap is stored after the write
+        std::vector<Instruction> bottles = parseProgram("programs/bottles.generated.ws");
+        supercompiled = supercompile(bottles);
+        REQUIRE(std::count_if(supercompiled.program.begin(), supercompiled.program.end(),
+                              [](const Instruction& instr) { return instr.type == WRITE || instr.type == PRINTC; }) == 1);
+        run(supercompiled, "", execution);
+        REQUIRE(execution == reference->run(bottles, "", 0));
+    }
+    SECTION("Programs suspend at their first read") {
+        // Prints, then reads and echoes within a subroutine, so the call
+        // stack is set up before continuing
+        std::vector<Instruction> program{
+            Instruction(PUSH, 'a'), PRINTC, Instruction(PUSH, 4), Instruction(PUSH, 5), STORE, Instruction(PUSH, 9),
+            Instruction(CALL, 0), Instruction(PUSH, 2), PRINTI, END,
+            Instruction(LABEL, 0), Instruction(PUSH, 7), DUP, READC, RETRIEVE, PRINTC, RET
+        };
+        Supercompilation supercompiled = supercompile(program);
+        REQUIRE(supercompiled.strings == std::vector<std::string>{"a"});
+        run(supercompiled, "z", execution);
+        REQUIRE(execution == reference->run(program, "z", 0));
+        REQUIRE(execution.output == "az2");
+
+        // Out of fuel, the program continues where it stopped
+        supercompiled = supercompile(program, 3);
+        run(supercompiled, "z", execution);
+        REQUIRE(execution == reference->run(program, "z", 0));
+    }
+    SECTION("Runtime errors happen after the output") {
+        std::vector<Instruction> program{Instruction(PUSH, 1), PRINTI, Instruction(PUSH, 1), Instruction(PUSH, 0), MOD};
+        Supercompilation supercompiled = supercompile(program);
+        run(supercompiled, "", execution);
+        REQUIRE(execution == reference->run(program, "", 0));
+        REQUIRE(execution.error == "Runtime Error: Division by zero\n");
+    }
+}
+
+TEST_CASE("Calls to pure subroutines are memoized", "[memo]") {
+    // Naive fib, and a subroutine that prints before calling it
+    std::vector<Instruction> fib{
+        Instruction(PUSH, 25), Instruction(CALL, 0), PRINTI, Instruction(PUSH, 7), Instruction(CALL, 2), END,
+        Instruction(LABEL, 0), DUP, Instruction(PUSH, 2), SUB, Instruction(JN, 1),
+        DUP, Instruction(PUSH, 1), SUB, Instruction(CALL, 0), SWAP, Instruction(PUSH, 2), SUB, Instruction(CALL, 0), ADD, RET,
+        Instruction(LABEL, 1), RET,
+        Instruction(LABEL, 2), DUP, PRINTI, Instruction(CALL, 0), RET
+    };
+    auto run = [](const std::vector<Instruction>& program, size_t entries, Execution& execution) {
+        return runConfigured(program, "", [&](VM& vm) { vm.setMemoization(entries); }, execution);
+    };
+    const Engine* reference = findEngine("vm");
+    Execution execution;
+
+    SECTION("Pure subroutines have a stack effect") {
+        std::map<integer_t, PureSubroutine> pure = findPureSubroutines(fib);
+        REQUIRE(pure.size() == 1);
+        REQUIRE(pure[0].args == 1);
+        REQUIRE(pure[0].results == 1);
+
+        // Returning at different heights, reading the heap, and calling an
+        // impure subroutine are each impure
+        pure = findPureSubroutines({
+            Instruction(CALL, 0), Instruction(CALL, 1), Instruction(CALL, 2), Instruction(CALL, 3), END,
+            Instruction(LABEL, 0), DUP, Instruction(JZ, 4), RET, Instruction(LABEL, 4), DUP, RET,
+            Instruction(LABEL, 1), RETRIEVE, RET,
+            Instruction(LABEL, 2), Instruction(CALL, 1), RET,
+            Instruction(LABEL, 3), Instruction(COPY, 2), Instruction(SLIDE, 1), RET
+        });
+        REQUIRE(pure.size() == 1);
+        REQUIRE(pure[3].args == 3);
+        REQUIRE(pure[3].results == 3);
+    }
+    SECTION("Memoized calls skip recomputation") {
+        VMStats stats = run(fib, MEMO_CACHE_SIZE, execution);
+        REQUIRE(execution == reference->run(fib, "", 0));
+        REQUIRE(execution.output == "750257");
+        REQUIRE(stats.memo_hits == 24);
+        REQUIRE(stats.memo_misses == 26);
+        REQUIRE(stats.instructions < 1000);
+
+        // Without memoization, no call is counted
+        stats = run(fib, 0, execution);
+        REQUIRE(stats.memo_hits + stats.memo_misses == 0);
+        REQUIRE(stats.instructions > 1000000);
+    }
+    SECTION("A bounded cache replaces entries and stays correct") {
+        VMStats stats = run(fib, 1, execution);
+        REQUIRE(execution == reference->run(fib, "", 0));
+        REQUIRE(stats.memo_hits == 0);
+        stats = run(fib, 4, execution);
+        REQUIRE(execution == reference->run(fib, "", 0));
+        REQUIRE(stats.memo_hits > 0);
+        REQUIRE(stats.memo_misses > 26);
+    }
+    SECTION("Runtime errors in pure subroutines are not cached") {
+        std::vector<Instruction> program{
+            Instruction(PUSH, 1), Instruction(PUSH, 2), Instruction(CALL, 0), Instruction(PUSH, 0), Instruction(CALL, 0), END,
+            Instruction(LABEL, 0), Instruction(PUSH, 6), SWAP, DIV, RET
+        };
+        VMStats stats = run(program, MEMO_CACHE_SIZE, execution);
+        REQUIRE(execution == reference->run(program, "", 0));
+        REQUIRE(execution.error == "Runtime Error: Division by zero\n");
+        REQUIRE(stats.memo_misses == 2);
+    }
+}
+
+TEST_CASE("Paged heap commits pages on store and falls back outside its window", "[heap]") {
+    SECTION("Loads read 0 without committing memory") {
+        PagedHeap heap;
+        size_t reserved = heap.bytes();
+        REQUIRE(heap.load(123456789) == 0);
+        REQUIRE(heap.load(-5) == 0);
+        REQUIRE(heap.size() == 2);
+        size_t loaded = heap.bytes();
+        heap.at(123456789) = 7;
+        heap.at(-5) = -8;
+        REQUIRE(heap.load(123456789) == 7);
+        REQUIRE(heap.load(123456790) == 0);
+        REQUIRE(heap.bytes() > loaded);
+        REQUIRE(heap.bytes() - reserved < 1 << 20);
+
+        // Outside the window, cells are in the hash table
+        heap.at(PAGED_HEAP_WINDOW) = 9;
+        REQUIRE(heap.load(-PAGED_HEAP_WINDOW) == 0);
+        std::map<integer_t, integer_t> cells{
+            {-PAGED_HEAP_WINDOW, 0}, {-5, -8}, {123456789, 7}, {123456790, 0}, {PAGED_HEAP_WINDOW, 9}
+        };
+        REQUIRE(heap.cells() == cells);
+        REQUIRE(heap.size() == 5);
+    }
+    SECTION("The VM heap matches the map") {
+        // Stores, loads, and reads at addresses spread over the window and beyond
+        std::vector<Instruction> program{
+            Instruction(PUSH, 1000), Instruction(LABEL, 0),
+            DUP, Instruction(PUSH, 2654435761LL), MUL, DUP, Instruction(COPY, 2), STORE,
+            Instruction(PUSH, -7), MUL, RETRIEVE, DROP,
+            Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+            Instruction(LABEL, 1), Instruction(PUSH, 3), READI, Instruction(PUSH, 3), RETRIEVE, PRINTI, END
+        };
+        std::istringstream in("42\n");
+        std::ostringstream out;
+        VM vm(program, in, out);
+        vm.setPagedHeap(PAGED_HEAP_WINDOW);
+        vm.execute();
+        Execution execution = findEngine("vm")->run(program, "42\n", 0);
+        REQUIRE(out.str() == "42");
+        REQUIRE(vm.getHeap() == execution.heap);
+        REQUIRE(vm.getStats().heap_cells == 2001);
+
+        // Switching back moves the cells into the map
+        vm.setPagedHeap(0);
+        REQUIRE(vm.getHeap() == execution.heap);
+    }
+}
+
+TEST_CASE("Guarded stack traps underflow and overflow", "[stack]") {
+    auto run = [](const std::vector<Instruction>& program, size_t capacity, Execution& execution) {
+        return runConfigured(program, "", [&](VM& vm) { vm.setGuardedStack(capacity); }, execution);
+    };
+    const Engine* reference = findEngine("vm");
+    Execution execution;
+
+    SECTION("Underflow reports the error of the checked VM at the same instruction") {
+        std::vector<std::vector<Instruction>> programs{
+            {Instruction(PUSH, 1), PRINTI, ADD, END},
+            {Instruction(PUSH, 1), SWAP, END},
+            {DUP},
+            {Instruction(PUSH, 3), Instruction(PUSH, 4), STORE, Instruction(JZ, 0), Instruction(LABEL, 0)},
+            {DROP, DROP, Instruction(PUSH, 5), Instruction(COPY, 1)},
+            {Instruction(PUSH, 1), Instruction(PUSH, 0), DIV}
+        };
+        for (const std::vector<Instruction>& program : programs) {
+            Execution expected = reference->run(program, "", 0);
+            VMStats stats = run(program, GUARDED_STACK_CAPACITY, execution);
+            REQUIRE(execution == expected);
+            std::istringstream in;
+            std::ostringstream out;
+            VM checked(program, in, out);
+            try { checked.execute(); } catch (const char*) {}
+            REQUIRE(stats.instructions == checked.getStats().instructions);
+            REQUIRE(execution.output == out.str());
+        }
+        REQUIRE(execution.error == "Runtime Error: Division by zero\n");
+
+        // The VM keeps running after a trap
+        std::vector<Instruction> program{Instruction(PUSH, 1), ADD};
+        run(program, GUARDED_STACK_CAPACITY, execution);
+        REQUIRE(execution.error == "Runtime Error: Stack underflow\n");
+        run(program, GUARDED_STACK_CAPACITY, execution);
+        REQUIRE(execution.error == "Runtime Error: Stack underflow\n");
+    }
+    SECTION("Pushing onto a full stack is an overflow") {
+        std::vector<Instruction> program{
+            Instruction(LABEL, 0), Instruction(PUSH, 1), Instruction(JMP, 0)
+        };
+        // Elsewhere the stack is checked and grows without bound
+        if (GuardedStack::supported()) {
+            VMStats stats = run(program, 4096, execution);
+            REQUIRE(execution.error == "Runtime Error: Stack overflow\n");
+            REQUIRE(execution.stack.size() >= 4096);
+            REQUIRE(stats.peak_stack == execution.stack.size());
+        }
+    }
+}
+
+TEST_CASE("Large stacks move into segments and behave as one vector", "[stack]") {
+    auto run = [](const std::vector<Instruction>& program, size_t entries, Execution& execution) {
+        return runConfigured(program, "", [&](VM& vm) { vm.setStackSegment(entries); }, execution);
+    };
+    // Pushes 100 down to 1, then copies and slides across segments
+    std::vector<Instruction> program{
+        Instruction(PUSH, 100), Instruction(LABEL, 0), DUP, Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+        Instruction(LABEL, 1), DROP, Instruction(COPY, 98), PRINTI, Instruction(COPY, 50), Instruction(SLIDE, 60), PRINTI,
+        Instruction(SLIDE, 3), DEBUG_PRINTSTACK, Instruction(SLIDE, 30), ADD, PRINTI, DROP, DROP, DROP, Instruction(SLIDE, 5)
+    };
+    const Engine* reference = findEngine("vm");
+    Execution expected = reference->run(program, "", 0);
+    REQUIRE(expected.error == "Runtime Error: Stack underflow\n");
+    Execution execution;
+    size_t peak_stack = run(program, 0, execution).peak_stack;
+    for (size_t entries : {1, 3, 8, 64}) {
+        VMStats stats = run(program, entries, execution);
+        REQUIRE(execution == expected);
+        REQUIRE(stats.peak_stack == peak_stack);
+    }
+
+    // Changing the segments regroups the stack without changing it
+    std::istringstream in;
+    std::ostringstream out;
+    VM vm(std::vector<Instruction>(program.begin(), program.begin() + 9), in, out);
+    vm.setStackSegment(3);
+    vm.execute();
+    std::vector<integer_t> stack = vm.getStack();
+    REQUIRE(stack.size() == 101);
+    vm.setStackSegment(7);
+    REQUIRE(vm.getStack() == stack);
+    vm.setStackSegment(0);
+    REQUIRE(vm.getStack() == stack);
+}
+
+TEST_CASE("Return stack has a fixed depth and checks both ends", "[stack]") {
+    ReturnStack calls(2);
+    calls.push(5);
+    calls.push(7);
+    REQUIRE(calls.size() == 2);
+    REQUIRE(calls.data()[0] == 5);
+    REQUIRE_THROWS_WITH(calls.push(9), "Runtime Error: Call stack overflow\n");
+    REQUIRE(calls.pop() == 7);
+    REQUIRE(calls.pop() == 5);
+    REQUIRE_THROWS_WITH(calls.pop(), "Runtime Error: Call stack underflow\n");
+
+    // Recursion as deep as the limit runs, and one call deeper is an error
+    std::vector<Instruction> program{
+        Instruction(PUSH, 100), Instruction(CALL, 0), PRINTI, END,
+        Instruction(LABEL, 0), DUP, Instruction(JZ, 1), DUP, Instruction(PUSH, 1), SUB, Instruction(CALL, 0), ADD,
+        Instruction(LABEL, 1), RET
+    };
+    for (size_t depth : {101, 100}) {
+        std::istringstream in;
+        std::ostringstream out;
+        VM vm(program, in, out);
+        vm.setCallStackDepth(depth);
+        const char* error = "";
+        try { vm.execute(); } catch (const char* e) { error = e; }
+        if (depth == 101) {
+            REQUIRE(out.str() == "5050");
+            REQUIRE(vm.getStats().peak_call_depth == 101);
+        }
+        else {
+            REQUIRE(std::string(error) == "Runtime Error: Call stack overflow\n");
+        }
+    }
+
+    // Returning from the top level is an error in every engine
+    program = {Instruction(PUSH, 1), RET};
+    Execution expected = findEngine("vm")->run(program, "", 0);
+    REQUIRE(expected.error == "Runtime Error: Call stack underflow\n");
+    for (const Engine& engine : engines()) {
+        INFO(engine.name);
+        REQUIRE(engine.run(program, "", 0) == expected);
+    }
+}
+
+TEST_CASE("Snapshots resume a VM where it stopped", "[snapshot]") {
+    // Reads a line into the heap, counting it at 0, then prints it back in
+    // reverse by recursion
+    std::vector<Instruction> program{
+        Instruction(PUSH, 0), Instruction(PUSH, 0), STORE,
+        Instruction(LABEL, 0), Instruction(PUSH, 0), RETRIEVE, Instruction(PUSH, 1), ADD,
+        DUP, Instruction(PUSH, 0), SWAP, STORE, DUP, READC,
+        RETRIEVE, Instruction(PUSH, 10), SUB, Instruction(JZ, 1), Instruction(JMP, 0),
+        Instruction(LABEL, 1), Instruction(PUSH, 0), RETRIEVE, Instruction(CALL, 2), END,
+        Instruction(LABEL, 2), DUP, Instruction(JZ, 3), DUP, RETRIEVE, PRINTC,
+        Instruction(PUSH, 1), SUB, Instruction(CALL, 2), Instruction(LABEL, 3), RET
+    };
+    const std::string input = "hello\nrest";
+    const char* path = "respace-test.snapshot";
+    std::istringstream reference_in(input);
+    std::ostringstream reference_out;
+    VM reference(program, reference_in, reference_out);
+    reference.execute();
+    REQUIRE(reference_out.str() == "\nolleh");
+
+    // A run out of fuel leaves a snapshot of its last instruction, from
+    // which another VM finishes with the rest of the output
+    for (unsigned long long fuel : {1, 40, 90, 120}) {
+        std::istringstream in(input);
+        std::ostringstream out;
+        VM vm(program, in, out);
+        vm.setCheckpoint(path, fuel);
+        vm.setFuel(fuel);
+        REQUIRE_THROWS_WITH(vm.execute(), "Runtime Error: Out of fuel\n");
+
+        std::istringstream resumed_in(input);
+        std::ostringstream resumed_out;
+        VM resumed(program, resumed_in, resumed_out);
+        resumed.setPagedHeap(1);
+        resumed.setStackSegment(1);
+        resumed.restore(path);
+        REQUIRE(resumed.getStack() == vm.getStack());
+        REQUIRE(resumed.getHeap() == vm.getHeap());
+        resumed.execute();
+        REQUIRE(out.str() + resumed_out.str() == reference_out.str());
+        REQUIRE(resumed.getStack() == reference.getStack());
+        REQUIRE(resumed.getHeap() == reference.getHeap());
+        REQUIRE(resumed.getStats().instructions == reference.getStats().instructions);
+        REQUIRE(resumed.getStats().peak_call_depth == reference.getStats().peak_call_depth);
+        REQUIRE(std::ifstream(std::string(path) + ".tmp").fail());
+    }
+
+    // A requested snapshot is taken before the next instruction, and one
+    // taken after input ended resumes with it ended
+    {
+        std::istringstream in("hi");
+        std::ostringstream out;
+        VM vm(program, in, out);
+        vm.setCheckpoint(path, 0);
+        VM::requestCheckpoint();
+        vm.setFuel(1);
+        REQUIRE_THROWS(vm.execute());
+        std::ifstream file(path, std::ios::binary);
+        std::vector<unsigned_t> words(5);
+        file.read((char*) words.data(), 5 * sizeof(unsigned_t));
+        REQUIRE(words[0] == SNAPSHOT_MAGIC);
+        REQUIRE(words[2] == programHash(program, std::vector<std::string>()));
+        REQUIRE(words[3] == 0);
+        REQUIRE(words[4] == 0);
+    }
+    {
+        std::vector<Instruction> reads{Instruction(PUSH, 1), READC, Instruction(PUSH, 2), READI,
+                                       Instruction(PUSH, 3), READC, Instruction(PUSH, 3), RETRIEVE, PRINTI};
+        std::istringstream in("x");
+        std::ostringstream out;
+        VM vm(reads, in, out);
+        vm.setCheckpoint(path, 4);
+        vm.setFuel(4);
+        REQUIRE_THROWS(vm.execute());
+        std::istringstream resumed_in("abc");
+        std::ostringstream resumed_out;
+        VM resumed(reads, resumed_in, resumed_out);
+        resumed.restore(path);
+        resumed.execute();
+        REQUIRE(resumed_out.str() == "-1");
+    }
+
+    // Input from a stream that cannot tell its position, like a pipe,
+    // resumes after the characters the VM had read
+    {
+        std::vector<Instruction> reads{Instruction(PUSH, 1), READI, Instruction(PUSH, 2), READC, Instruction(PUSH, 3), READC,
+                                       Instruction(PUSH, 1), RETRIEVE, PRINTI, Instruction(PUSH, 3), RETRIEVE, PRINTC};
+        std::istringstream source("12 ab"), resumed_source("12 ab");
+        CountingInput pipe(source.rdbuf()), resumed_pipe(resumed_source.rdbuf());
+        std::istream in(&pipe), resumed_in(&resumed_pipe);
+        REQUIRE(in.tellg() == -1);
+        in.clear();
+        std::ostringstream out, resumed_out;
+        VM vm(reads, in, out);
+        vm.setCheckpoint(path, 2);
+        vm.setFuel(2);
+        REQUIRE_THROWS(vm.execute());
+        VM resumed(reads, resumed_in, resumed_out);
+        resumed.restore(path);
+        resumed.execute();
+        REQUIRE(resumed_out.str() == "12a");
+
+        // A VM that was not counting its input cannot tell where a pipe was
+        VM uncounted(reads, resumed_in, resumed_out);
+        {
+            std::ofstream file(path, std::ios::binary);
+            uncounted.save(file);
+        }
+        REQUIRE_THROWS_WITH(resumed.restore(path), "Snapshot does not record how much input was read\n");
+    }
+
+    // Snapshots of another program, or that are not snapshots, are refused
+    VM other(std::vector<Instruction>{Instruction(PUSH, 1)});
+    REQUIRE_THROWS_WITH(other.restore(path), "Snapshot is of a different program\n");
+    std::ofstream(path, std::ios::binary) << "not a snapshot";
+    REQUIRE_THROWS_WITH(other.restore(path), "Not a snapshot of this version\n");
+    std::ofstream(path, std::ios::binary).write((const char*) &SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    REQUIRE_THROWS_WITH(other.restore(path), "Snapshot is truncated\n");
+    std::remove(path);
+    REQUIRE_THROWS_WITH(other.restore(path), "Unable to open snapshot\n");
+}
+
+TEST_CASE("Fork server runs each input from the state at the first read", "[forkserver]") {
+    // Builds a table of squares, then prints the squares of the digits read
+    std::vector<Instruction> program{
+        Instruction(PUSH, 100), Instruction(LABEL, 0), DUP, DUP, DUP, MUL, STORE,
+        Instruction(PUSH, 1), SUB, DUP, Instruction(JZ, 1), Instruction(JMP, 0),
+        Instruction(LABEL, 1), DROP,
+        Instruction(LABEL, 2), Instruction(PUSH, -1), READC, Instruction(PUSH, -1), RETRIEVE, DUP, Instruction(JN, 3),
+        Instruction(PUSH, '0'), SUB, RETRIEVE, PRINTI, Instruction(PUSH, ' '), PRINTC, Instruction(JMP, 2),
+        Instruction(LABEL, 3), DROP, END
+    };
+    if (!ForkServer::supported()) {
+        return;
+    }
+    ForkServer server(program, 0, true);
+    REQUIRE(server.warmupInstructions() > 1000);
+    const Engine* reference = findEngine("vm");
+    for (const char* input : {"123", "", "9x", "123"}) {
+        INFO(input);
+        Execution expected = reference->run(program, input, 0);
+        REQUIRE(server.run(input) == expected);
+        std::istringstream in(input);
+        std::ostringstream out;
+        VM vm(program, in, out);
+        vm.execute();
+        REQUIRE(server.lastInstructions() == vm.getStats().instructions - server.warmupInstructions());
+    }
+    Execution execution = ForkServer(program).run("3");
+    REQUIRE(execution.output == "9 ");
+    REQUIRE(execution.heap.empty());
+
+    // Programs that end or fail before reading fork nothing
+    std::vector<std::vector<Instruction>> unread{
+        {Instruction(PUSH, 7), PRINTI},
+        {Instruction(PUSH, 7), ADD, Instruction(PUSH, 0), READC}
+    };
+    for (const std::vector<Instruction>& other : unread) {
+        ForkServer other_server(other, 0, true);
+        Execution expected = reference->run(other, "5", 0);
+        REQUIRE(other_server.run("5") == expected);
+        REQUIRE(other_server.lastInstructions() == 0);
+    }
+    REQUIRE(ForkServer(program, 50).run("1").error == "Runtime Error: Out of fuel\n");
+
+    // Children inherit the configuration of the VM
+    std::vector<Instruction> calls{Instruction(PUSH, 0), READC, Instruction(CALL, 1), END,
+                                   Instruction(LABEL, 1), Instruction(CALL, 2), RET, Instruction(LABEL, 2), RET};
+    REQUIRE(ForkServer(calls).run("x").error.empty());
+    ForkServer shallow(calls, 0, false, [](VM& vm) { vm.setCallStackDepth(1); });
+    REQUIRE(shallow.run("x").error == "Runtime Error: Call stack overflow\n");
+}
@@ -0,0 +1,219 @@
+// Compares the output, run time, and peak memory of several respace builds,
+// engines, or optimization levels over a corpus of programs.
+//
+// ./compare [--runs <n>] [--threshold <percent>] <baseline> <candidate>... -- <program>[=<input>]...
+//
+// Each build is a command line, such as "./respace" or "old/respace --stats",
+// to which the program path is appended. The input file, if given, is passed
+// on stdin. Every command runs each program the given number of times,
+// alternating between commands, and its output must match the baseline.
+// Speedups are baseline time over candidate time with a 95% confidence
+// interval. A candidate fails when it differs in output, or when it is
+// slower than the baseline by more than the threshold and the confidence
+// interval excludes no change.
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Run {
+    std::string output;
+    int status;
+    double seconds;
+    long max_rss_kb;
+};
+
+struct Summary {
+    double mean;
+    double stddev;
+    long max_rss_kb;
+};
+
+std::vector<std::string> splitCommand(const std::string& command) {
+    std::istringstream words(command);
+    std::vector<std::string> args;
+    std::string word;
+    while (words >> word) {
+        args.push_back(word);
+    }
+    return args;
+}
+
+Run runCommand(const std::string& command, const std::string& program, const std::string& input) {
+    std::vector<std::string> args = splitCommand(command);
+    args.push_back(program);
+    int out[2];
+    if (pipe(out) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int in = open(input.empty() ? "/dev/null" : input.c_str(), O_RDONLY);
+        if (in < 0) {
+            perror(input.c_str());
+            _exit(127);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        std::vector<char*> argv;
+        for (std::string& arg : args) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(NULL);
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(out[1]);
+    Run run;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(out[0], buffer, sizeof(buffer))) > 0) {
+        run.output.append(buffer, n);
+    }
+    close(out[0]);
+    struct rusage usage;
+    wait4(pid, &run.status, 0, &usage);
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.max_rss_kb = usage.ru_maxrss;
+    return run;
+}
+
+Summary summarize(const std::vector<Run>& runs) {
+    Summary summary = {0, 0, 0};
+    for (const Run& run : runs) {
+        summary.mean += run.seconds / runs.size();
+        summary.max_rss_kb = std::max(summary.max_rss_kb, run.max_rss_kb);
+    }
+    for (const Run& run : runs) {
+        summary.stddev += (run.seconds - summary.mean) * (run.seconds - summary.mean);
+    }
+    summary.stddev = runs.size() > 1 ? std::sqrt(summary.stddev / (runs.size() - 1)) : 0;
+    return summary;
+}
+
+// Two-sided 95% critical value of Student's t distribution
+double tCritical(size_t df) {
+    static const double table[] = {12.71, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086};
+    if (df == 0) {
+        return INFINITY;
+    }
+    return df <= 20 ? table[df - 1] : df <= 30 ? 2.042 : 1.960;
+}
+
+std::string normalizeLineEndings(const std::string& output) {
+    std::string normalized;
+    for (size_t i = 0; i < output.size(); i++) {
+        if (output[i] != '\r' || i + 1 >= output.size() || output[i + 1] != '\n') {
+            normalized += output[i];
+        }
+    }
+    return normalized;
+}
+
+int main(int argc, char* argv[]) {
+    int runs = 10;
+    double threshold = 3;
+    std::vector<std::string> commands;
+    std::vector<std::string> programs, inputs;
+    bool corpus = false;
+    for (int i = 1; i < argc; i++) {
+        if (corpus) {
+            std::string arg = argv[i];
+            size_t eq = arg.find('=');
+            programs.push_back(arg.substr(0, eq));
+            inputs.push_back(eq == std::string::npos ? "" : arg.substr(eq + 1));
+        }
+        else if (strcmp(argv[i], "--") == 0) {
+            corpus = true;
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else {
+            commands.push_back(argv[i]);
+        }
+    }
+    if (commands.size() < 2 || programs.empty() || runs < 1) {
+        fprintf(stderr, "Usage: %s [--runs <n>] [--threshold <percent>] <baseline> <candidate>... -- <program>[=<input>]...\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<double> log_speedups(commands.size(), 0);
+    int failures = 0;
+    for (size_t p = 0; p < programs.size(); p++) {
+        printf("\e[4;36m%s\e[0m%s%s\n", programs[p].c_str(), inputs[p].empty() ? "" : " < ", inputs[p].c_str());
+        std::vector<std::vector<Run>> results(commands.size());
+        for (int r = 0; r < runs; r++) {
+            for (size_t c = 0; c < commands.size(); c++) {
+                results[c].push_back(runCommand(commands[c], programs[p], inputs[p]));
+            }
+        }
+
+        Summary baseline = summarize(results[0]);
+        printf("  %-40s %10s %19s %10s  %s\n", "command", "mean ms", "speedup (95% CI)", "max RSS", "result");
+        for (size_t c = 0; c < commands.size(); c++) {
+            Summary summary = summarize(results[c]);
+            const Run& first = results[c][0];
+            bool consistent = true;
+            for (const Run& run : results[c]) {
+                consistent = consistent && run.output == first.output && run.status == first.status;
+            }
+            const char* output_result = "\e[92mEqual\e[0m";
+            bool failed = false;
+            if (!consistent) {
+                output_result = "\e[91mNondeterministic\e[0m";
+                failed = true;
+            }
+            else if (first.status != results[0][0].status) {
+                output_result = "\e[91mExit status differs\e[0m";
+                failed = true;
+            }
+            else if (first.output != results[0][0].output) {
+                bool approx = normalizeLineEndings(first.output) == normalizeLineEndings(results[0][0].output);
+                output_result = approx ? "\e[93mEqual with normalized line endings\e[0m" : "\e[91mNot equal\e[0m";
+                failed = !approx;
+            }
+
+            // Confidence interval of the ratio of means by the delta method
+            double speedup = baseline.mean / summary.mean;
+            double relative_variance = baseline.stddev * baseline.stddev / (runs * baseline.mean * baseline.mean) +
+                                       summary.stddev * summary.stddev / (runs * summary.mean * summary.mean);
+            double margin = tCritical(runs - 1) * speedup * std::sqrt(relative_variance);
+            bool regressed = c > 0 && speedup < 1 / (1 + threshold / 100) && speedup + margin < 1;
+            failed = failed || regressed;
+            failures += failed;
+            log_speedups[c] += std::log(speedup);
+
+            printf("  %-40s %10.3f %7.3f [%.3f, %.3f] %7ld KB  %s%s\n", commands[c].c_str(), summary.mean * 1e3,
+                   speedup, speedup - margin, speedup + margin, summary.max_rss_kb, output_result,
+                   regressed ? ", \e[91mslower\e[0m" : "");
+        }
+        putchar('\n');
+    }
+
+    printf("Geometric mean speedup over %zu programs:\n", programs.size());
+    for (size_t c = 1; c < commands.size(); c++) {
+        printf("  %-40s %7.3f\n", commands[c].c_str(), std::exp(log_speedups[c] / programs.size()));
+    }
+    printf("\n%s: %d failure%s (threshold %.1f%% slower)\n", failures ? "\e[91mFAIL\e[0m" : "\e[92mPASS\e[0m",
+           failures, failures == 1 ? "" : "s", threshold);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,622 @@
+// Differential testing of every execution engine against the reference VM.
+//
+// ./differential [options]
+//
+//   --iterations <n>       Random cases to run, 0 to run until interrupted
+//                          (default 0)
+//   --seed <n>             Seed of the first case (default 1)
+//   --corpus <dir>         Replay every <name>.ws in dir first, with
+//                          <name>.in as its input when present
+//   --failures <dir>       Write minimized divergences to dir (default .)
+//   --write-corpus <dir>   Write the generated cases to dir as seeds instead
+//                          of testing them
+//
+// Case i is generated from seed + i alone, so any case can be reproduced
+// with --seed and --iterations 1. A case is a structured program of
+// straight-line code, counted loops that may load heap cells at the start
+// of each iteration, forward branches, and calls to
+// non-recursive subroutines, with random input. About half the subroutines
+// only compute on the stack, without loops, so that they may be pure and
+// memoized. Straight-line code is free
+// to underflow the stack or divide by zero, since all engines must agree on
+// runtime errors too. Loop counters live in heap cells that the generated
+// code never addresses, so every case terminates; fuel still bounds the run
+// for minimized cases, which may not, and those that run out are skipped.
+//
+// When an engine differs from the reference in output, final stack, final
+// heap, or error, the case is minimized by greedily removing units and
+// instructions, unwrapping loops and branches, simplifying literals, and
+// shortening the input while the divergence persists.
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../src/emitter.h"
+#include "../src/engine.h"
+#include "../src/instruction.h"
+#include "../src/parser.h"
+
+using namespace WS;
+
+const unsigned long long FUEL = 1000000;
+const integer_t COUNTER_BASE = 1 << 20; // Loop counter cells, above any generated address
+const int MAX_NESTING = 2;
+
+struct Unit {
+    enum Kind { CODE, LOOP, BRANCH, CALL_SUB } kind;
+    std::vector<Instruction> code; // CODE
+    std::vector<Unit> body;        // LOOP and BRANCH
+    integer_t iterations;          // LOOP
+    std::vector<integer_t> loads;  // LOOP, cells loaded at the top of its header
+    InstructionType branch;        // BRANCH, JZ or JN on the top of the stack
+    size_t subroutine;             // CALL_SUB
+    std::vector<integer_t> args;   // CALL_SUB, small literals pushed before the call, which then
+                                   // repeats with them, so that memoized calls hit
+
+    Unit(Kind kind) : kind(kind), iterations(0), branch(JZ), subroutine(0) {}
+};
+
+struct Case {
+    std::vector<Unit> main;
+    std::vector<std::vector<Unit>> subroutines; // Each may only call later ones
+    std::string input;
+};
+
+class Random {
+public:
+    Random(unsigned long long seed) : state_(seed * 2 + 1) {
+        for (int i = 0; i < 4; i++) {
+            next();
+        }
+    }
+
+    unsigned long long next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        return state_;
+    }
+    unsigned long long below(unsigned long long n) {
+        return next() % n;
+    }
+
+private:
+    unsigned long long state_;
+};
+
+class Generator {
+public:
+    Generator(unsigned long long seed) : random_(seed) {}
+
+    Case generate() {
+        Case c;
+        size_t subroutines = random_.below(4);
+        for (size_t i = 0; i < subroutines; i++) {
+            subroutines_ = subroutines;
+            first_callable_ = i + 1;
+            pure_ = random_.below(2) == 0;
+            c.subroutines.push_back(block(0));
+        }
+        first_callable_ = 0;
+        pure_ = false;
+        c.main = block(0);
+        // Random code often underflows the stack early, so calls with
+        // arguments also start the program half the time
+        if (subroutines > 0 && random_.below(2)) {
+            c.main.insert(c.main.begin(), call());
+        }
+        size_t length = random_.below(12);
+        for (size_t i = 0; i < length; i++) {
+            c.input += random_.below(3) == 0 ? (char) ('0' + random_.below(10)) :
+                       random_.below(4) == 0 ? '\n' : (char) (' ' + random_.below(95));
+        }
+        return c;
+    }
+
+private:
+    Random random_;
+    size_t subroutines_ = 0;
+    size_t first_callable_ = 0;
+    bool pure_ = false; // Generating stack code only
+
+    Unit call() {
+        Unit call(Unit::CALL_SUB);
+        call.subroutine = first_callable_ + random_.below(subroutines_ - first_callable_);
+        for (size_t args = random_.below(2) ? random_.below(10) : 0; args > 0; args--) {
+            call.args.push_back(random_.below(4));
+        }
+        return call;
+    }
+
+    std::vector<Unit> block(int nesting) {
+        std::vector<Unit> units;
+        size_t count = 1 + random_.below(nesting == 0 ? 10 : 5);
+        for (size_t i = 0; i < count; i++) {
+            units.push_back(unit(nesting));
+        }
+        return units;
+    }
+
+    Unit unit(int nesting) {
+        unsigned long long kind = random_.below(12);
+        if (kind == 0 && nesting < MAX_NESTING && !pure_) {
+            Unit loop(Unit::LOOP);
+            loop.iterations = random_.below(6);
+            for (size_t loads = random_.below(3); loads > 0; loads--) {
+                loop.loads.push_back(address());
+            }
+            loop.body = block(nesting + 1);
+            return loop;
+        }
+        if (kind == 1 && nesting < MAX_NESTING) {
+            Unit branch(Unit::BRANCH);
+            branch.branch = random_.below(2) ? JZ : JN;
+            branch.body = block(nesting + 1);
+            return branch;
+        }
+        if (kind == 2 && first_callable_ < subroutines_) {
+            return call();
+        }
+        Unit code(Unit::CODE);
+        size_t length = 1 + random_.below(6);
+        for (size_t i = 0; i < length; i++) {
+            snippet(code.code);
+        }
+        return code;
+    }
+
+    integer_t literal() {
+        switch (random_.below(8)) {
+        case 0:  return (integer_t) random_.next();
+        case 1:  return -(integer_t) random_.below(100);
+        case 2:  return random_.below(2) ? 0x7fffffffffffffffLL : -0x7fffffffffffffffLL - 1;
+        default: return random_.below(20);
+        }
+    }
+
+    integer_t address() {
+        return (integer_t) random_.below(20) - 4;
+    }
+
+    // Heap accesses take their address from a literal, so that they never
+    // reach the loop counters
+    void snippet(std::vector<Instruction>& code) {
+        static const InstructionType stack_ops[] = {DUP, SWAP, DROP, ADD, SUB, MUL, DIV, MOD, PRINTI, PRINTC};
+        size_t ops = sizeof(stack_ops) / sizeof(stack_ops[0]);
+        unsigned long long kind = random_.below(10);
+        if (pure_ && kind >= 4 && kind <= 6) {
+            kind = 7; // Heap access and input would make the subroutine impure
+        }
+        switch (kind) {
+        case 0:
+        case 1:
+        case 2:
+            code.push_back(Instruction(PUSH, literal()));
+            break;
+        case 3:
+            code.push_back(Instruction(random_.below(2) ? COPY : SLIDE, (integer_t) random_.below(4)));
+            break;
+        case 4:
+            code.push_back(Instruction(PUSH, address()));
+            code.push_back(random_.below(2) ? Instruction(COPY, 1) : Instruction(PUSH, literal()));
+            code.push_back(STORE);
+            break;
+        case 5:
+            code.push_back(Instruction(PUSH, address()));
+            code.push_back(RETRIEVE);
+            break;
+        case 6:
+            code.push_back(Instruction(PUSH, address()));
+            code.push_back(random_.below(2) ? READC : READI);
+            break;
+        default:
+            code.push_back(stack_ops[random_.below(pure_ ? ops - 2 : ops)]);
+            break;
+        }
+    }
+};
+
+class Lowering {
+public:
+    std::vector<Instruction> lower(const Case& c) {
+        next_label_ = c.subroutines.size();
+        next_counter_ = COUNTER_BASE;
+        block(c.main);
+        program_.push_back(END);
+        for (size_t i = 0; i < c.subroutines.size(); i++) {
+            program_.push_back(Instruction(LABEL, i));
+            block(c.subroutines[i]);
+            program_.push_back(RET);
+        }
+        return program_;
+    }
+
+private:
+    std::vector<Instruction> program_;
+    integer_t next_label_;
+    integer_t next_counter_;
+
+    void block(const std::vector<Unit>& units) {
+        for (const Unit& unit : units) {
+            switch (unit.kind) {
+            case Unit::CODE:
+                program_.insert(program_.end(), unit.code.begin(), unit.code.end());
+                break;
+            case Unit::LOOP:
+                loop(unit);
+                break;
+            case Unit::BRANCH: {
+                integer_t end = next_label_++;
+                program_.push_back(Instruction(unit.branch, end));
+                block(unit.body);
+                program_.push_back(Instruction(LABEL, end));
+                break;
+            }
+            case Unit::CALL_SUB:
+                for (int i = 0; i < (unit.args.empty() ? 1 : 2); i++) {
+                    for (integer_t arg : unit.args) {
+                        program_.push_back(Instruction(PUSH, arg));
+                    }
+                    program_.push_back(Instruction(CALL, unit.subroutine));
+                }
+                break;
+            }
+        }
+    }
+
+    void loop(const Unit& unit) {
+        integer_t top = next_label_++;
+        integer_t end = next_label_++;
+        integer_t counter = next_counter_++;
+        std::vector<Instruction> head{
+            Instruction(PUSH, counter),
+            Instruction(PUSH, unit.iterations),
+            STORE,
+            Instruction(LABEL, top)
+        };
+        for (integer_t address : unit.loads) {
+            head.push_back(Instruction(PUSH, address));
+            head.push_back(RETRIEVE);
+            // Scaling some loads makes invariant expressions to hoist
+            if (address % 2 != 0) {
+                head.push_back(Instruction(PUSH, address));
+                head.push_back(MUL);
+                head.push_back(Instruction(PUSH, 1));
+                head.push_back(ADD);
+            }
+        }
+        head.insert(head.end(), {
+            Instruction(PUSH, counter),
+            RETRIEVE,
+            Instruction(JZ, end),
+            Instruction(PUSH, counter),
+            Instruction(PUSH, counter),
+            RETRIEVE,
+            Instruction(PUSH, 1),
+            SUB,
+            STORE
+        });
+        program_.insert(program_.end(), head.begin(), head.end());
+        block(unit.body);
+        program_.push_back(Instruction(JMP, top));
+        program_.push_back(Instruction(LABEL, end));
+    }
+};
+
+std::vector<Instruction> lower(const Case& c) {
+    return Lowering().lower(c);
+}
+
+std::string quote(const std::string& text) {
+    std::string quoted = "\"";
+    for (char ch : text) {
+        if (ch == '\n') quoted += "\\n";
+        else if (ch == '"' || ch == '\\') (quoted += '\\') += ch;
+        else if (ch < ' ' || ch > '~') {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\x%02x", (unsigned char) ch);
+            quoted += escape;
+        }
+        else quoted += ch;
+    }
+    return quoted + '"';
+}
+
+void printExecution(const char* name, const Execution& execution) {
+    printf("  %-20s output %s\n", name, quote(execution.output).c_str());
+    printf("  %-20s stack [", "");
+    for (integer_t value : execution.stack) {
+        printf(" %lld", value);
+    }
+    printf(" ]\n  %-20s heap {", "");
+    for (const std::pair<const integer_t, integer_t>& cell : execution.heap) {
+        printf(" %lld: %lld", cell.first, cell.second);
+    }
+    printf(" }\n  %-20s error %s\n", "", execution.error.empty() ? "none" : quote(execution.error).c_str());
+}
+
+// Index of the first engine that disagrees with the reference, or 0 when
+// they all agree. Engines execute different numbers of instructions, so
+// programs that run out of fuel are not compared.
+size_t divergence(const std::vector<Instruction>& program, const std::string& input) {
+    const std::vector<Engine>& all = engines();
+    Execution reference = all[0].run(program, input, FUEL);
+    if (reference.error == "Runtime Error: Out of fuel\n") {
+        return 0;
+    }
+    for (size_t e = 1; e < all.size(); e++) {
+        if (all[e].run(program, input, FUEL) != reference) {
+            return e;
+        }
+    }
+    return 0;
+}
+
+class Minimizer {
+public:
+    Minimizer(size_t engine) : engine_(engine) {}
+
+    // Repeats single reductions until none preserves the divergence
+    Case minimize(Case c) {
+        bool reduced = true;
+        while (reduced) {
+            reduced = false;
+            // Restoring a block after a failed attempt reallocates the
+            // blocks nested in it, so they are collected again each time
+            for (size_t b = 0; !reduced && b < blocks(c).size(); b++) {
+                reduced = reduceBlock(c, *blocks(c)[b]);
+            }
+            if (!reduced) {
+                reduced = reduceInput(c);
+            }
+        }
+        return c;
+    }
+
+private:
+    size_t engine_;
+
+    bool diverges(const Case& c) {
+        return divergence(lower(c), c.input) == engine_;
+    }
+
+    std::vector<std::vector<Unit>*> blocks(Case& c) {
+        std::vector<std::vector<Unit>*> all;
+        collect(c.main, all);
+        for (std::vector<Unit>& sub : c.subroutines) {
+            collect(sub, all);
+        }
+        return all;
+    }
+
+    void collect(std::vector<Unit>& units, std::vector<std::vector<Unit>*>& blocks) {
+        blocks.push_back(&units);
+        for (Unit& unit : units) {
+            if (unit.kind == Unit::LOOP || unit.kind == Unit::BRANCH) {
+                collect(unit.body, blocks);
+            }
+        }
+    }
+
+    // Applies change to a copy of the case and keeps it if the divergence
+    // remains. The block pointer refers into c, so the original is saved.
+    template <typename Change>
+    bool attempt(Case& c, std::vector<Unit>& units, Change change) {
+        std::vector<Unit> saved = units;
+        change(units);
+        if (diverges(c)) {
+            return true;
+        }
+        units = saved;
+        return false;
+    }
+
+    bool reduceBlock(Case& c, std::vector<Unit>& units) {
+        for (size_t i = 0; i < units.size(); i++) {
+            if (attempt(c, units, [i](std::vector<Unit>& u) { u.erase(u.begin() + i); })) {
+                return true;
+            }
+            Unit::Kind kind = units[i].kind;
+            if ((kind == Unit::LOOP || kind == Unit::BRANCH) && attempt(c, units, [i](std::vector<Unit>& u) {
+                    std::vector<Unit> body = u[i].body;
+                    u.erase(u.begin() + i);
+                    u.insert(u.begin() + i, body.begin(), body.end());
+                })) {
+                return true;
+            }
+            if (kind == Unit::LOOP && units[i].iterations > 1 &&
+                attempt(c, units, [i](std::vector<Unit>& u) { u[i].iterations--; })) {
+                return true;
+            }
+            if (kind == Unit::CODE) {
+                for (size_t j = 0; j < units[i].code.size(); j++) {
+                    if (attempt(c, units, [i, j](std::vector<Unit>& u) { u[i].code.erase(u[i].code.begin() + j); })) {
+                        return true;
+                    }
+                    integer_t value = units[i].code[j].value;
+                    if (units[i].code[j].type == PUSH && value != 0 && value != 1) {
+                        for (integer_t simpler : {(integer_t) 0, (integer_t) 1, value / 2}) {
+                            if (attempt(c, units, [i, j, simpler](std::vector<Unit>& u) { u[i].code[j].value = simpler; })) {
+                                return true;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    bool reduceInput(Case& c) {
+        for (size_t i = 0; i < c.input.size(); i++) {
+            std::string saved = c.input;
+            c.input.erase(i, 1);
+            if (diverges(c)) {
+                return true;
+            }
+            c.input = saved;
+        }
+        return false;
+    }
+};
+
+bool writeFile(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary);
+    out << contents;
+    return (bool) out;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+std::string whitespace(const std::vector<Instruction>& program) {
+    std::ostringstream out;
+    emitWhitespace(out, program);
+    return out.str();
+}
+
+void report(const std::string& name, const std::vector<Instruction>& program, const std::string& input, size_t engine) {
+    const std::vector<Engine>& all = engines();
+    printf("\e[91mDivergence\e[0m in %s: %s differs from %s\n", name.c_str(), all[engine].name, all[0].name);
+    printf("  input %s\n", quote(input).c_str());
+    for (const Instruction& instr : program) {
+        printf("    %s", mnemonic(instr.type));
+        if (instr.type == PUSH || instr.type == COPY || instr.type == SLIDE) {
+            printf(" %lld", instr.value);
+        }
+        else if (instr.type == LABEL || instr.type == CALL || instr.type == JMP || instr.type == JZ || instr.type == JN) {
+            printf(" label_%lld", instr.value);
+        }
+        putchar('\n');
+    }
+    printExecution(all[0].name, all[0].run(program, input, FUEL));
+    printExecution(all[engine].name, all[engine].run(program, input, FUEL));
+}
+
+// Replays the corpus, returning the number of divergences
+int replayCorpus(const std::string& dir) {
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        perror(dir.c_str());
+        exit(2);
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".ws") == 0) {
+            names.push_back(name.substr(0, name.size() - 3));
+        }
+    }
+    closedir(handle);
+
+    int failures = 0;
+    for (const std::string& name : names) {
+        std::string path = dir + "/" + name;
+        FILE* file = fopen((path + ".ws").c_str(), "r");
+        std::vector<Instruction> program;
+        Parser parser(file);
+        Instruction instr;
+        while (parser.next(instr)) {
+            program.push_back(instr);
+        }
+        fclose(file);
+        std::string input = readFile(path + ".in");
+        size_t engine = divergence(program, input);
+        if (engine) {
+            report(path + ".ws", program, input, engine);
+            failures++;
+        }
+    }
+    printf("Replayed %zu corpus programs, %d divergence%s\n", names.size(), failures, failures == 1 ? "" : "s");
+    return failures;
+}
+
+volatile unsigned long long current_seed;
+
+// Reports the case that crashed the harness, so it can be reproduced
+void crashHandler(int signal) {
+    char message[64];
+    int length = snprintf(message, sizeof(message), "\nCrashed with signal %d on seed %llu\n", signal, current_seed);
+    ssize_t written = write(STDERR_FILENO, message, length);
+    (void) written;
+    _exit(3);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long long iterations = 0;
+    unsigned long long seed = 1;
+    const char* corpus = NULL;
+    std::string failures_dir = ".";
+    const char* write_corpus = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[++i] : NULL;
+        if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 2;
+        }
+        if (strcmp(arg, "--iterations") == 0) iterations = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--seed") == 0) seed = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--corpus") == 0) corpus = value;
+        else if (strcmp(arg, "--failures") == 0) failures_dir = value;
+        else if (strcmp(arg, "--write-corpus") == 0) write_corpus = value;
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 2;
+        }
+    }
+
+    if (write_corpus) {
+        for (unsigned long long i = 0; i < iterations; i++) {
+            Case c = Generator(seed + i).generate();
+            std::string path = std::string(write_corpus) + "/seed-" + std::to_string(seed + i);
+            if (!writeFile(path + ".ws", whitespace(lower(c))) || (!c.input.empty() && !writeFile(path + ".in", c.input))) {
+                perror(path.c_str());
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    printf("Engines:");
+    for (const Engine& engine : engines()) {
+        printf(" %s", engine.name);
+    }
+    putchar('\n');
+    int failures = corpus ? replayCorpus(corpus) : 0;
+
+    signal(SIGSEGV, crashHandler);
+    signal(SIGFPE, crashHandler);
+    signal(SIGABRT, crashHandler);
+    for (unsigned long long i = 0; iterations == 0 || i < iterations; i++) {
+        unsigned long long case_seed = seed + i;
+        current_seed = case_seed;
+        Case c = Generator(case_seed).generate();
+        size_t engine = divergence(lower(c), c.input);
+        if (engine) {
+            c = Minimizer(engine).minimize(c);
+            std::vector<Instruction> program = lower(c);
+            std::string path = failures_dir + "/divergence-" + std::to_string(case_seed);
+            report("seed " + std::to_string(case_seed), program, c.input, engine);
+            if (writeFile(path + ".ws", whitespace(program)) && writeFile(path + ".in", c.input)) {
+                printf("  written to %s.ws\n", path.c_str());
+            }
+            failures++;
+        }
+        if ((i + 1) % 10000 == 0) {
+            fprintf(stderr, "%llu cases, %d divergences\n", i + 1, failures);
+        }
+    }
+    printf("%s: %d divergence%s\n", failures ? "\e[91mFAIL\e[0m" : "\e[92mPASS\e[0m", failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
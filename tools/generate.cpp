@@ -0,0 +1,301 @@
+// Generates synthetic Whitespace programs with a tunable shape for scale
+// testing the parser, label resolution, heap, and wide literals.
+//
+// ./generate [options] [-o <file>]
+//
+//   --instructions <n>     Approximate instruction count (default 100000)
+//   --labels <n>           Forward jump targets (default 1000)
+//   --sparse-labels        Spread label numbers over 48 bits instead of
+//                          numbering them consecutively
+//   --call-depth <n>       Depth of the subroutine call chain (default 8)
+//   --heap <distribution>  dense, sparse, or negative addresses (default dense)
+//   --heap-cells <n>       Distinct heap addresses (default 1024)
+//   --literal-bits <n>     Width of discarded wide literals, 0 for none
+//   --comments <density>   Comment bytes per Whitespace byte (default 0)
+//   --seed <n>             Random seed (default 1)
+//
+// The program is straight-line code made of units that each update a
+// checksum on top of the stack, modulo a prime so that no operation
+// overflows. Forward jumps skip over dead units. At the end the checksum is
+// printed followed by a newline. The expected output is written before the
+// code as a comment, which must not contain whitespace, so it has the form
+// "expected:<checksum>\n" with the newline spelled out.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../src/emitter.h"
+#include "../src/instruction.h"
+
+using namespace WS;
+
+const integer_t MODULUS = 1000003;
+
+enum HeapDistribution { HEAP_DENSE, HEAP_SPARSE, HEAP_NEGATIVE };
+
+struct Options {
+    unsigned long long instructions = 100000;
+    unsigned long long labels = 1000;
+    bool sparse_labels = false;
+    int call_depth = 8;
+    HeapDistribution heap = HEAP_DENSE;
+    unsigned long long heap_cells = 1024;
+    int literal_bits = 0;
+    double comments = 0;
+    unsigned long long seed = 1;
+    const char* output = NULL;
+};
+
+class Generator {
+public:
+    Generator(const Options& options, FILE* out) : options_(options), out_(out), state_(options.seed * 2 + 1) {
+        for (int i = 0; i < options_.call_depth; i++) {
+            subroutines_.push_back(std::make_pair(1 + random() % (MODULUS - 1), random() % MODULUS));
+        }
+    }
+
+    // Expected output, computed without running the program
+    std::string expected() {
+        return std::to_string(checksum_) + "\n";
+    }
+
+    void generate() {
+        emit(Instruction(PUSH, checksum_));
+        while (emitted_ < options_.instructions) {
+            unit(true);
+        }
+        emit(PRINTI);
+        emit(Instruction(PUSH, '\n'));
+        emit(PRINTC);
+        emit(END);
+        for (int i = 0; i < options_.call_depth; i++) {
+            emit(Instruction(LABEL, label(i)));
+            arithmetic(subroutines_[i].first, subroutines_[i].second, false);
+            if (i + 1 < options_.call_depth) {
+                emit(Instruction(CALL, label(i + 1)));
+            }
+            emit(RET);
+        }
+        flush();
+    }
+
+private:
+    const Options& options_;
+    FILE* out_;
+    unsigned long long state_;
+    integer_t checksum_ = 1;
+    unsigned long long emitted_ = 0;
+    unsigned long long next_label_ = 0;
+    std::vector<std::pair<integer_t, integer_t>> subroutines_;
+    std::unordered_map<integer_t, integer_t> heap_;
+    std::ostringstream code_;
+    std::string buffer_;
+
+    unsigned long long random() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        return state_;
+    }
+
+    // Subroutine labels come first, then jump labels. Multiplying by an odd
+    // constant modulo 2^48 is a bijection, so sparse labels stay distinct.
+    integer_t label(unsigned long long index) {
+        return options_.sparse_labels ? (index * 0x9E3779B97F4A7C15ULL) & ((1ULL << 48) - 1) : index;
+    }
+
+    integer_t address() {
+        unsigned long long cell = random() % options_.heap_cells;
+        switch (options_.heap) {
+        case HEAP_DENSE:    return cell;
+        case HEAP_SPARSE:   return (cell * 0x9E3779B97F4A7C15ULL) & ((1ULL << 40) - 1);
+        case HEAP_NEGATIVE: return -1 - (integer_t) cell;
+        }
+        return cell;
+    }
+
+    // A unit leaves only the checksum on the stack. When not live, it is
+    // dead code and the checksum is not updated.
+    void unit(bool live) {
+        unsigned long long kind = random() % 20;
+        if (kind < 3 && next_label_ < options_.labels && live) {
+            integer_t target = label(options_.call_depth + next_label_++);
+            if (kind == 0) {
+                emit(Instruction(JMP, target));
+            }
+            else if (kind == 1) {
+                emit(Instruction(PUSH, 0));
+                emit(Instruction(JZ, target));
+            }
+            else {
+                emit(Instruction(PUSH, -1));
+                emit(Instruction(JN, target));
+            }
+            unit(false);
+            emit(Instruction(LABEL, target));
+        }
+        else if (kind < 4 && options_.call_depth > 0) {
+            emit(Instruction(CALL, label(0)));
+            if (live) {
+                for (const std::pair<integer_t, integer_t>& sub : subroutines_) {
+                    checksum_ = (checksum_ * sub.first + sub.second) % MODULUS;
+                }
+            }
+        }
+        else if (kind < 7) {
+            integer_t addr = address();
+            emit(Instruction(PUSH, addr));
+            emit(Instruction(COPY, 1));
+            emit(STORE);
+            if (live) {
+                heap_[addr] = checksum_;
+            }
+        }
+        else if (kind < 10) {
+            integer_t addr = address();
+            emit(Instruction(PUSH, addr));
+            emit(RETRIEVE);
+            emit(ADD);
+            emit(Instruction(PUSH, MODULUS));
+            emit(MOD);
+            if (live) {
+                std::unordered_map<integer_t, integer_t>::iterator cell = heap_.find(addr);
+                checksum_ = (checksum_ + (cell == heap_.end() ? 0 : cell->second)) % MODULUS;
+            }
+        }
+        else if (kind < 12) {
+            emit(Instruction(PUSH, (integer_t) (random() >> 1)));
+            emit(DUP);
+            emit(Instruction(SLIDE, 1));
+            emit(SWAP);
+            emit(Instruction(SLIDE, 1));
+        }
+        else if (kind < 13 && options_.literal_bits > 0) {
+            wideLiteral(options_.literal_bits);
+            emit(DROP);
+        }
+        else {
+            arithmetic(1 + random() % (MODULUS - 1), random() % MODULUS, live);
+        }
+    }
+
+    void arithmetic(integer_t a, integer_t b, bool live) {
+        emit(Instruction(PUSH, a));
+        emit(MUL);
+        emit(Instruction(PUSH, b));
+        emit(ADD);
+        emit(Instruction(PUSH, MODULUS));
+        emit(MOD);
+        if (live) {
+            checksum_ = (checksum_ * a + b) % MODULUS;
+        }
+    }
+
+    // Push of a literal wider than integer_t, which emitWhitespace cannot encode
+    void wideLiteral(int bits) {
+        std::string code = "  ";
+        code += random() & 1 ? '\t' : ' ';
+        code += '\t';
+        for (int i = 1; i < bits; i++) {
+            code += random() & 1 ? '\t' : ' ';
+        }
+        code += '\n';
+        write(code);
+        emitted_++;
+    }
+
+    void emit(const Instruction& instr) {
+        code_.str("");
+        emitWhitespace(code_, instr);
+        write(code_.str());
+        emitted_++;
+    }
+
+    void write(const std::string& code) {
+        for (char c : code) {
+            buffer_ += c;
+            // Comments are any bytes other than space, tab, and LF
+            while (options_.comments > 0 && (random() % 1000000) < options_.comments * 1000000 / (1 + options_.comments)) {
+                buffer_ += (char) ('a' + random() % 26);
+            }
+        }
+        if (buffer_.size() >= 1 << 16) {
+            flush();
+        }
+    }
+
+    void flush() {
+        fwrite(buffer_.data(), 1, buffer_.size(), out_);
+        buffer_.clear();
+    }
+};
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--sparse-labels") == 0) {
+            options.sparse_labels = true;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 2;
+        }
+        i++;
+        if (strcmp(arg, "--instructions") == 0) options.instructions = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--labels") == 0) options.labels = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--call-depth") == 0) options.call_depth = atoi(value);
+        else if (strcmp(arg, "--heap-cells") == 0) options.heap_cells = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--literal-bits") == 0) options.literal_bits = atoi(value);
+        else if (strcmp(arg, "--comments") == 0) options.comments = atof(value);
+        else if (strcmp(arg, "--seed") == 0) options.seed = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "-o") == 0) options.output = value;
+        else if (strcmp(arg, "--heap") == 0) {
+            if (strcmp(value, "dense") == 0) options.heap = HEAP_DENSE;
+            else if (strcmp(value, "sparse") == 0) options.heap = HEAP_SPARSE;
+            else if (strcmp(value, "negative") == 0) options.heap = HEAP_NEGATIVE;
+            else {
+                fprintf(stderr, "Unknown heap distribution %s\n", value);
+                return 2;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 2;
+        }
+    }
+    if (options.heap_cells == 0 || options.call_depth < 0 || options.literal_bits < 0 || options.comments < 0) {
+        fprintf(stderr, "Invalid options\n");
+        return 2;
+    }
+
+    // The code is generated into a temporary file first, since the
+    // expected output is only known at the end
+    FILE* code = tmpfile();
+    Generator generator(options, code);
+    generator.generate();
+    FILE* out = options.output ? fopen(options.output, "wb") : stdout;
+    if (!out) {
+        perror(options.output);
+        return 1;
+    }
+    std::string expected = generator.expected();
+    fprintf(out, "expected:%.*s\\n", (int) expected.size() - 1, expected.c_str());
+    rewind(code);
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), code)) > 0) {
+        fwrite(buffer, 1, n, out);
+    }
+    fclose(code);
+    if (out != stdout) {
+        fclose(out);
+    }
+    fprintf(stderr, "%s", expected.c_str());
+    return 0;
+}
@@ -0,0 +1,130 @@
+// Ranks candidate superinstructions from a statistics file written by
+// `respace --opstats`.
+//
+// ./rank-superinstructions <opstats file> [count]
+//
+// Fusing an n-instruction sequence saves n - 1 dispatches each time it
+// executes. Sequences containing labels are skipped, since labels are not
+// dispatched by a translating engine, as are sequences with a control
+// transfer before their last instruction. Overlapping candidates are ranked
+// independently, so their savings do not add up.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../src/instruction.h"
+#include "../src/opstats.h"
+
+using namespace WS;
+
+struct Candidate {
+    std::vector<InstructionType> sequence;
+    unsigned long long count;
+    unsigned long long savings;
+};
+
+bool isControl(InstructionType type) {
+    switch (type) {
+    case LABEL: case CALL: case JMP: case JZ: case JN: case RET: case END:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isFusible(const std::vector<InstructionType>& sequence) {
+    for (size_t i = 0; i < sequence.size(); i++) {
+        if (sequence[i] == LABEL || (i + 1 < sequence.size() && isControl(sequence[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void addCandidate(std::vector<Candidate>& candidates, std::vector<InstructionType> sequence, unsigned long long count) {
+    if (count > 0 && isFusible(sequence)) {
+        candidates.push_back(Candidate{sequence, count, count * (sequence.size() - 1)});
+    }
+}
+
+void printSequence(const std::vector<InstructionType>& sequence) {
+    for (size_t i = 0; i < sequence.size(); i++) {
+        printf("%s%s", i ? "; " : "", mnemonic(sequence[i]));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <opstats file> [count]\n", argv[0]);
+        return 2;
+    }
+    std::ifstream in(argv[1]);
+    if (!in) {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+    size_t limit = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+    OpStats stats;
+    stats.load(in);
+
+    unsigned long long dispatches = 0;
+    std::vector<Candidate> singles, candidates;
+    for (int a = 0; a < OpStats::N; a++) {
+        InstructionType ta = (InstructionType) a;
+        dispatches += stats.count(ta);
+        if (stats.count(ta) > 0) {
+            singles.push_back(Candidate{{ta}, stats.count(ta), 0});
+        }
+        for (int b = 0; b < OpStats::N; b++) {
+            InstructionType tb = (InstructionType) b;
+            addCandidate(candidates, {ta, tb}, stats.count(ta, tb));
+            for (int c = 0; c < OpStats::N; c++) {
+                InstructionType tc = (InstructionType) c;
+                addCandidate(candidates, {ta, tb, tc}, stats.count(ta, tb, tc));
+            }
+        }
+    }
+    if (dispatches == 0) {
+        fprintf(stderr, "No instructions recorded in %s\n", argv[1]);
+        return 1;
+    }
+    std::stable_sort(singles.begin(), singles.end(), [](const Candidate& a, const Candidate& b) {
+        return a.count > b.count;
+    });
+    std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.savings > b.savings;
+    });
+
+    printf("%llu dispatches over %llu runs\n", dispatches, stats.runs());
+    printf("\nHottest handlers:\n%14s %7s  instruction\n", "count", "%");
+    for (size_t i = 0; i < singles.size() && i < limit; i++) {
+        printf("%14llu %6.2f%%  ", singles[i].count, 100.0 * singles[i].count / dispatches);
+        printSequence(singles[i].sequence);
+        putchar('\n');
+    }
+    printf("\nSuperinstruction candidates by dispatches saved:\n%14s %7s %14s  sequence\n", "saved", "%", "count");
+    for (size_t i = 0; i < candidates.size() && i < limit; i++) {
+        printf("%14llu %6.2f%% %14llu  ", candidates[i].savings,
+               100.0 * candidates[i].savings / dispatches, candidates[i].count);
+        printSequence(candidates[i].sequence);
+        putchar('\n');
+    }
+    printf("\nBranch operand patterns:\n%14s %7s  pattern\n", "executed", "taken");
+    for (int a = 0; a <= OpStats::N; a++) {
+        for (int b = 0; b <= OpStats::N; b++) {
+            for (InstructionType branch : {JZ, JN}) {
+                unsigned long long taken = stats.branches(a, b, branch, true);
+                unsigned long long total = taken + stats.branches(a, b, branch, false);
+                if (total == 0) {
+                    continue;
+                }
+                printf("%14llu %6.2f%%  %s; %s; %s\n", total, 100.0 * taken / total,
+                       a == OpStats::NONE ? "-" : mnemonic((InstructionType) a),
+                       b == OpStats::NONE ? "-" : mnemonic((InstructionType) b), mnemonic(branch));
+            }
+        }
+    }
+    return 0;
+}